@@ -28,6 +28,7 @@ type CvmBootManager interface {
 type cvmBootManager struct {
 	config          *config.CvmConfig
 	cvmBootSequence *CvmBootSequence
+	assistantGraph  *taskGraph
 	secretService   secret.SecretService
 }
 
@@ -39,15 +40,30 @@ func NewCvmBootManager(config *config.CvmConfig, secretService secret.SecretServ
 		return nil, err
 	}
 	service.cvmBootSequence = cvmBootSequence
+	service.assistantGraph, err = buildTaskGraph(cvmBootSequence.CvmAssistants)
+	if err != nil {
+		return nil, fmt.Errorf("csvAssistants of %s: %s", config.ConfigPath, err.Error())
+	}
 	return service, nil
 }
 
 // Start starts the cvm service
 func (s *cvmBootManager) Start() {
-	s.processTasks(s.cvmBootSequence.CvmAssistants)
+	s.processAssistants()
 	s.processTasks(s.cvmBootSequence.AppInfo)
 }
 
+// processAssistants runs the csvAssistants, each as soon as the ones it
+// depends on are done, so that the boot takes as long as the longest
+// dependency chain rather than the sum of all steps
+func (cbm *cvmBootManager) processAssistants() {
+	timings, err := cbm.assistantGraph.run(cbm.processTask)
+	cbm.assistantGraph.logTimings(timings)
+	if err != nil {
+		log.Fatalf("Failed to run csvAssistants: %v", err)
+	}
+}
+
 // loadConfig loads the cvm app config
 func (cbm *cvmBootManager) loadConfig() (*CvmBootSequence, error) {
 	appfile, err := os.ReadFile(cbm.config.ConfigPath)
@@ -146,35 +162,44 @@ func (cbm *cvmBootManager) deployService(taskInfo *TaskInfo) error {
 
 func (cbm *cvmBootManager) processTasks(tasks []*TaskInfo) {
 	for i, t := range tasks {
-		switch t.Type {
-		case JOB:
-			log.Printf("Executing job: %s (entrypoint: %s)", t.Name, t.Entrypoint)
-			err := cbm.executeTask(t)
-			if err != nil {
-				log.Fatalf("Failed to execute job %s: %v", t.Name, err)
-			}
-			log.Printf("Job completed: %s", t.Name)
-		case SERVER:
-			log.Printf("Deploying service: %s (entrypoint: %s)", t.Name, t.Entrypoint)
-			t.Priority = i + 2
-			err := cbm.deployService(t)
-			if err != nil {
-				log.Fatalf("Failed to deploy service %s: %v", t.Name, err)
-			}
-			log.Printf("Service deployed: %s", t.Name)
-			log.Printf("Updating supervisor configuration for service: %s", t.Name)
-			err = command.RunCommand("supervisorctl", nil, "update")
-			if err != nil {
-				log.Fatalf("Failed to update supervisor configuration: %v", err)
-			}
-			log.Printf("Starting service: %s with supervisor configuration", t.Name)
-			err = command.RunCommand("supervisorctl", nil, "start", t.Name)
-			if err != nil {
-				log.Fatalf("Failed to start service %s: %v", t.Name, err)
-			}
-			log.Printf("Service started: %s", t.Name)
-		default:
-			log.Fatalf("Task type: %s is not supported", t.Type)
+		if err := cbm.processTask(i, t); err != nil {
+			log.Fatalf("%v", err)
+		}
+	}
+}
+
+// processTask runs a job, or deploys and starts a service; i is the position
+// of the task in its list, which sets the supervisor priority of a service
+func (cbm *cvmBootManager) processTask(i int, t *TaskInfo) error {
+	switch t.Type {
+	case JOB:
+		log.Printf("Executing job: %s (entrypoint: %s)", t.Name, t.Entrypoint)
+		err := cbm.executeTask(t)
+		if err != nil {
+			return fmt.Errorf("failed to execute job %s: %v", t.Name, err)
+		}
+		log.Printf("Job completed: %s", t.Name)
+	case SERVER:
+		log.Printf("Deploying service: %s (entrypoint: %s)", t.Name, t.Entrypoint)
+		t.Priority = i + 2
+		err := cbm.deployService(t)
+		if err != nil {
+			return fmt.Errorf("failed to deploy service %s: %v", t.Name, err)
 		}
+		log.Printf("Service deployed: %s", t.Name)
+		log.Printf("Updating supervisor configuration for service: %s", t.Name)
+		err = command.RunCommand("supervisorctl", nil, "update")
+		if err != nil {
+			return fmt.Errorf("failed to update supervisor configuration: %v", err)
+		}
+		log.Printf("Starting service: %s with supervisor configuration", t.Name)
+		err = command.RunCommand("supervisorctl", nil, "start", t.Name)
+		if err != nil {
+			return fmt.Errorf("failed to start service %s: %v", t.Name, err)
+		}
+		log.Printf("Service started: %s", t.Name)
+	default:
+		return fmt.Errorf("task type: %s is not supported", t.Type)
 	}
+	return nil
 }
@@ -0,0 +1,224 @@
+package cvm
+
+import (
+	"fmt"
+	"log"
+	"strings"
+	"time"
+)
+
+// taskGraph holds, for each task, the indexes of the tasks it waits for
+type taskGraph struct {
+	tasks []*TaskInfo
+	deps  [][]int
+}
+
+// stepTiming is when a task ran, relative to the start of the boot sequence
+type stepTiming struct {
+	Start time.Duration
+	End   time.Duration
+	Err   error
+	Run   bool
+}
+
+// buildTaskGraph resolves dependsOn. A task without dependsOn waits for the
+// one listed before it, so a file without dependencies keeps running in
+// order; `dependsOn: []` lets a task start right away.
+func buildTaskGraph(tasks []*TaskInfo) (*taskGraph, error) {
+	index := make(map[string]int, len(tasks))
+	for i, t := range tasks {
+		if _, ok := index[t.Name]; ok {
+			return nil, fmt.Errorf("task %s is declared twice", t.Name)
+		}
+		index[t.Name] = i
+	}
+
+	g := &taskGraph{tasks: tasks, deps: make([][]int, len(tasks))}
+	for i, t := range tasks {
+		if t.DependsOn == nil {
+			if i > 0 {
+				g.deps[i] = []int{i - 1}
+			}
+			continue
+		}
+		for _, name := range t.DependsOn {
+			j, ok := index[name]
+			if !ok {
+				return nil, fmt.Errorf("task %s depends on unknown task %s", t.Name, name)
+			}
+			if j == i {
+				return nil, fmt.Errorf("task %s depends on itself", t.Name)
+			}
+			g.deps[i] = append(g.deps[i], j)
+		}
+	}
+
+	if cycle := g.findCycle(); cycle != nil {
+		return nil, fmt.Errorf("dependency cycle: %s", strings.Join(cycle, " -> "))
+	}
+	return g, nil
+}
+
+// findCycle returns the names along a dependency cycle, nil when there is none
+func (g *taskGraph) findCycle() []string {
+	const (
+		unvisited = iota
+		visiting
+		done
+	)
+	state := make([]int, len(g.tasks))
+	var stack []int
+
+	var visit func(i int) []string
+	visit = func(i int) []string {
+		state[i] = visiting
+		stack = append(stack, i)
+		for _, j := range g.deps[i] {
+			switch state[j] {
+			case visiting:
+				// each task on the stack depends on the next one, i on j
+				k := len(stack) - 1
+				for stack[k] != j {
+					k--
+				}
+				var cycle []string
+				for _, t := range stack[k:] {
+					cycle = append(cycle, g.tasks[t].Name)
+				}
+				return append(cycle, g.tasks[j].Name)
+			case unvisited:
+				if cycle := visit(j); cycle != nil {
+					return cycle
+				}
+			}
+		}
+		stack = stack[:len(stack)-1]
+		state[i] = done
+		return nil
+	}
+
+	for i := range g.tasks {
+		if state[i] == unvisited {
+			if cycle := visit(i); cycle != nil {
+				return cycle
+			}
+		}
+	}
+	return nil
+}
+
+// run starts every task as soon as the tasks it depends on are done, each in
+// its own goroutine. After a failure no further task is started; the running
+// ones are waited for and the first error is returned.
+func (g *taskGraph) run(runTask func(i int, t *TaskInfo) error) ([]stepTiming, error) {
+	n := len(g.tasks)
+	timings := make([]stepTiming, n)
+	waiting := make([]int, n)
+	dependents := make([][]int, n)
+	for i, deps := range g.deps {
+		waiting[i] = len(deps)
+		for _, j := range deps {
+			dependents[j] = append(dependents[j], i)
+		}
+	}
+
+	begin := time.Now()
+	finished := make(chan int) // also hands timings[i] back to the scheduler
+	start := func(i int) {
+		timings[i] = stepTiming{Start: time.Since(begin), Run: true}
+		go func() {
+			err := runTask(i, g.tasks[i])
+			timings[i].End = time.Since(begin)
+			timings[i].Err = err
+			finished <- i
+		}()
+	}
+
+	running := 0
+	for i := range g.tasks {
+		if waiting[i] == 0 {
+			start(i)
+			running++
+		}
+	}
+
+	var firstErr error
+	for running > 0 {
+		i := <-finished
+		running--
+		if err := timings[i].Err; err != nil {
+			if firstErr == nil {
+				firstErr = fmt.Errorf("task %s: %w", g.tasks[i].Name, err)
+			}
+			continue
+		}
+		if firstErr != nil {
+			continue
+		}
+		for _, j := range dependents[i] {
+			waiting[j]--
+			if waiting[j] == 0 {
+				start(j)
+				running++
+			}
+		}
+	}
+	return timings, firstErr
+}
+
+// criticalPath is the chain of tasks that bounded the boot: from the task
+// that ended last, back through the dependency each task waited for longest.
+func (g *taskGraph) criticalPath(timings []stepTiming) []int {
+	last := -1
+	for i, t := range timings {
+		if t.Run && (last < 0 || t.End > timings[last].End) {
+			last = i
+		}
+	}
+	var path []int
+	for i := last; i >= 0; {
+		path = append([]int{i}, path...)
+		next := -1
+		for _, j := range g.deps[i] {
+			if timings[j].Run && (next < 0 || timings[j].End > timings[next].End) {
+				next = j
+			}
+		}
+		i = next
+	}
+	return path
+}
+
+// logTimings reports how long each step took and the critical path
+func (g *taskGraph) logTimings(timings []stepTiming) {
+	for i, t := range timings {
+		if !t.Run {
+			log.Printf("Step %s: not started", g.tasks[i].Name)
+			continue
+		}
+		log.Printf("Step %s: started at %v, took %v", g.tasks[i].Name,
+			t.Start.Round(time.Millisecond), (t.End - t.Start).Round(time.Millisecond))
+	}
+
+	path := g.criticalPath(timings)
+	if len(path) == 0 {
+		return
+	}
+	names := make([]string, len(path))
+	var sum time.Duration
+	for k, i := range path {
+		names[k] = fmt.Sprintf("%s (%v)", g.tasks[i].Name,
+			(timings[i].End - timings[i].Start).Round(time.Millisecond))
+		sum += timings[i].End - timings[i].Start
+	}
+	var serial time.Duration
+	for _, t := range timings {
+		if t.Run {
+			serial += t.End - t.Start
+		}
+	}
+	log.Printf("Critical path: %s", strings.Join(names, " -> "))
+	log.Printf("Boot steps took %v, %v on the critical path, %v if run one after another",
+		timings[path[len(path)-1]].End.Round(time.Millisecond),
+		sum.Round(time.Millisecond), serial.Round(time.Millisecond))
+}
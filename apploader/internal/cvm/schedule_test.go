@@ -0,0 +1,90 @@
+package cvm
+
+import (
+	"fmt"
+	"sync"
+	"testing"
+	"time"
+)
+
+func TestTaskGraph(t *testing.T) {
+	// network and keyProvider are independent, disk needs the key, secret
+	// the network; app has no dependsOn and so waits for the entry above
+	tasks := []*TaskInfo{
+		{Name: "network", DependsOn: []string{}},
+		{Name: "keyProvider", DependsOn: []string{}},
+		{Name: "secret", DependsOn: []string{"network"}},
+		{Name: "disk", DependsOn: []string{"keyProvider"}},
+		{Name: "app"},
+	}
+	g, err := buildTaskGraph(tasks)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	step := 50 * time.Millisecond
+	durations := map[string]time.Duration{
+		"network": step, "keyProvider": step, "disk": 3 * step, "secret": step, "app": step,
+	}
+	var mu sync.Mutex
+	done := map[string]bool{}
+	timings, err := g.run(func(i int, task *TaskInfo) error {
+		for _, j := range g.deps[i] {
+			mu.Lock()
+			ok := done[tasks[j].Name]
+			mu.Unlock()
+			if !ok {
+				return fmt.Errorf("%s started before %s", task.Name, tasks[j].Name)
+			}
+		}
+		time.Sleep(durations[task.Name])
+		mu.Lock()
+		done[task.Name] = true
+		mu.Unlock()
+		return nil
+	})
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	// keyProvider, disk and app in series: 5 steps instead of 7
+	if end := timings[4].End; end < 5*step || end > 6*step+step/2 {
+		t.Fatalf("boot took %v, expected about %v", end, 5*step)
+	}
+	path := g.criticalPath(timings)
+	if fmt.Sprint(path) != "[1 3 4]" {
+		t.Fatalf("critical path %v, expected keyProvider, disk, app", path)
+	}
+}
+
+func TestTaskGraphFailure(t *testing.T) {
+	tasks := []*TaskInfo{
+		{Name: "network", DependsOn: []string{}},
+		{Name: "secret", DependsOn: []string{"network"}},
+	}
+	g, err := buildTaskGraph(tasks)
+	if err != nil {
+		t.Fatal(err)
+	}
+	timings, err := g.run(func(i int, task *TaskInfo) error {
+		return fmt.Errorf("no link")
+	})
+	if err == nil || timings[1].Run {
+		t.Fatalf("secret ran after network failed, error %v", err)
+	}
+}
+
+func TestTaskGraphErrors(t *testing.T) {
+	for _, tasks := range [][]*TaskInfo{
+		{{Name: "a"}, {Name: "a"}},
+		{{Name: "a", DependsOn: []string{"b"}}},
+		{{Name: "a", DependsOn: []string{"a"}}},
+		{{Name: "a", DependsOn: []string{"c"}}, {Name: "b", DependsOn: []string{"a"}}, {Name: "c"}},
+	} {
+		if _, err := buildTaskGraph(tasks); err == nil {
+			t.Fatalf("no error for %v", tasks)
+		} else {
+			t.Log(err)
+		}
+	}
+}
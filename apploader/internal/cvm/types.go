@@ -15,6 +15,9 @@ type TaskInfo struct {
 	Env        interface{} `yaml:"env"`
 	Priority   int         `yaml:"-"`
 	Args       []string    `yaml:"args"`
+	// DependsOn names the csvAssistants that must complete before this one
+	// starts. Left out, the task waits for the one listed before it.
+	DependsOn []string `yaml:"dependsOn"`
 }
 
 // SupervisorConf is the configuration of a supervisor
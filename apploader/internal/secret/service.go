@@ -28,9 +28,14 @@ func (s *secretService) SaveSecret(key string, value string) {
 	s.secrets[key] = value
 }
 
-// GetAllSecrets gets all secrets
+// GetAllSecrets gets a copy of all secrets, which csvAssistants running in
+// parallel read while others save theirs
 func (s *secretService) GetAllSecrets() map[string]string {
 	s.secretsMutex.RLock()
 	defer s.secretsMutex.RUnlock()
-	return s.secrets
+	secrets := make(map[string]string, len(s.secrets))
+	for k, v := range s.secrets {
+		secrets[k] = v
+	}
+	return secrets
 }
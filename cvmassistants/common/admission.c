@@ -0,0 +1,182 @@
+#include "admission.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// buckets examined per key before recycling the stalest one
+#define PROBE_WINDOW 8
+
+struct bucket {
+  uint8_t key[RATE_LIMITER_KEY_MAX];
+  size_t key_len;
+  double tokens;
+  uint64_t last_ns;
+  bool used;
+};
+
+struct rate_limiter {
+  pthread_mutex_t lock;
+  struct bucket *buckets;
+  size_t mask;
+};
+
+struct conn_entry {
+  int fd;
+  uint64_t queued_ms;
+};
+
+struct conn_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  struct conn_entry *entries;
+  size_t capacity;
+  size_t head;
+  size_t count;
+};
+
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t monotonic_ms(void) { return monotonic_ns() / 1000000ull; }
+
+static uint64_t hash_bytes(const uint8_t *key, size_t len) {
+  uint64_t h = 1469598103934665603ull; // FNV-1a
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ key[i]) * 1099511628211ull;
+  return h;
+}
+
+struct rate_limiter *rate_limiter_new(size_t capacity) {
+  size_t size = PROBE_WINDOW;
+  while (size < capacity)
+    size *= 2;
+
+  struct rate_limiter *rl = calloc(1, sizeof(struct rate_limiter));
+  if (rl == NULL)
+    return NULL;
+  rl->buckets = calloc(size, sizeof(struct bucket));
+  if (rl->buckets == NULL) {
+    free(rl);
+    return NULL;
+  }
+  rl->mask = size - 1;
+  pthread_mutex_init(&rl->lock, NULL);
+  return rl;
+}
+
+void rate_limiter_free(struct rate_limiter *rl) {
+  if (rl == NULL)
+    return;
+  pthread_mutex_destroy(&rl->lock);
+  free(rl->buckets);
+  free(rl);
+}
+
+bool rate_limiter_allow(struct rate_limiter *rl, const void *key, size_t len,
+                        double rate, double burst) {
+  if (rate <= 0)
+    return true;
+  if (burst < 1)
+    burst = 1;
+  if (len > RATE_LIMITER_KEY_MAX)
+    len = RATE_LIMITER_KEY_MAX;
+
+  uint64_t now = monotonic_ns();
+  size_t start = hash_bytes(key, len) & rl->mask;
+  bool allowed;
+
+  pthread_mutex_lock(&rl->lock);
+  struct bucket *b = NULL, *victim = NULL;
+  for (size_t i = 0; i < PROBE_WINDOW; i++) {
+    struct bucket *cand = &rl->buckets[(start + i) & rl->mask];
+    if (cand->used && cand->key_len == len && !memcmp(cand->key, key, len)) {
+      b = cand;
+      break;
+    }
+    if (victim == NULL || !cand->used ||
+        (victim->used && cand->last_ns < victim->last_ns))
+      victim = cand;
+  }
+  if (b == NULL) {
+    b = victim;
+    memcpy(b->key, key, len);
+    b->key_len = len;
+    b->tokens = burst;
+    b->last_ns = now;
+    b->used = true;
+  }
+
+  b->tokens += (now - b->last_ns) / 1e9 * rate;
+  if (b->tokens > burst)
+    b->tokens = burst;
+  b->last_ns = now;
+  allowed = b->tokens >= 1;
+  if (allowed)
+    b->tokens -= 1;
+  pthread_mutex_unlock(&rl->lock);
+  return allowed;
+}
+
+struct conn_queue *conn_queue_new(size_t capacity) {
+  struct conn_queue *q = calloc(1, sizeof(struct conn_queue));
+  if (q == NULL)
+    return NULL;
+  q->entries = calloc(capacity ? capacity : 1, sizeof(struct conn_entry));
+  if (q->entries == NULL) {
+    free(q);
+    return NULL;
+  }
+  q->capacity = capacity ? capacity : 1;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->not_empty, NULL);
+  return q;
+}
+
+void conn_queue_free(struct conn_queue *q) {
+  if (q == NULL)
+    return;
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->not_empty);
+  free(q->entries);
+  free(q);
+}
+
+int conn_queue_push(struct conn_queue *q, int fd) {
+  pthread_mutex_lock(&q->lock);
+  if (q->count == q->capacity) {
+    pthread_mutex_unlock(&q->lock);
+    return -1;
+  }
+  struct conn_entry *e = &q->entries[(q->head + q->count) % q->capacity];
+  e->fd = fd;
+  e->queued_ms = monotonic_ms();
+  q->count++;
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+  return 0;
+}
+
+int conn_queue_pop(struct conn_queue *q, uint64_t *waited_ms) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0)
+    pthread_cond_wait(&q->not_empty, &q->lock);
+  struct conn_entry e = q->entries[q->head];
+  q->head = (q->head + 1) % q->capacity;
+  q->count--;
+  pthread_mutex_unlock(&q->lock);
+
+  *waited_ms = monotonic_ms() - e.queued_ms;
+  return e.fd;
+}
+
+size_t conn_queue_depth(struct conn_queue *q) {
+  pthread_mutex_lock(&q->lock);
+  size_t depth = q->count;
+  pthread_mutex_unlock(&q->lock);
+  return depth;
+}
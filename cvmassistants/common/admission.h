@@ -0,0 +1,51 @@
+#ifndef CONKER_ADMISSION_H
+#define CONKER_ADMISSION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// -----------------------------------------------------------------------------
+// Admission control for the broker accept loop.
+//
+// rate_limiter: token buckets keyed by an arbitrary byte string (source
+// address, appId claim). The table has a fixed size; when a probe window is
+// full the least recently refilled bucket is recycled, which only forgets
+// clients that have been idle long enough for their bucket to be full anyway.
+// Rate and burst are passed on every call so that they follow config reloads.
+//
+// conn_queue: bounded FIFO of accepted sockets between the accept loop and
+// the worker threads. A full queue refuses new connections instead of letting
+// them wait, and entries older than the caller's deadline are dropped by the
+// worker before any handshake work is spent on them.
+// -----------------------------------------------------------------------------
+
+#define RATE_LIMITER_KEY_MAX 64
+
+struct rate_limiter;
+
+struct rate_limiter *rate_limiter_new(size_t capacity);
+void rate_limiter_free(struct rate_limiter *rl);
+
+// Take one token from key's bucket. rate is tokens per second, burst the
+// bucket size; a rate of 0 disables the limit.
+bool rate_limiter_allow(struct rate_limiter *rl, const void *key, size_t len,
+                        double rate, double burst);
+
+struct conn_queue;
+
+struct conn_queue *conn_queue_new(size_t capacity);
+void conn_queue_free(struct conn_queue *q);
+
+// Returns -1 without blocking when the queue is full.
+int conn_queue_push(struct conn_queue *q, int fd);
+
+// Block until a connection is available. waited_ms receives the time it
+// spent queued.
+int conn_queue_pop(struct conn_queue *q, uint64_t *waited_ms);
+
+size_t conn_queue_depth(struct conn_queue *q);
+
+uint64_t monotonic_ms(void);
+
+#endif
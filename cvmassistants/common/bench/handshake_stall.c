@@ -0,0 +1,222 @@
+// Check that a stalled handshake cannot hold a broker worker: open a
+// connection, send the first byte of a TLS record and stop, then run one
+// attested client behind it. Run it against a broker started with
+// --workers 1, so that the client can only be served once the stalled
+// handshake has timed out.
+//
+//   make -C common/bench handshake_stall
+//   ./common/bench/handshake_stall -e 127.0.0.1:1234
+//
+// Exits 0 when the client is served within --max-wait seconds, 1 otherwise.
+
+#include "log.h"
+#include "tls_conf.h"
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include <rats-tls/api.h>
+
+#define DEFAULT_MAX_WAIT_S 15 // the broker's handshake timeout and some slack
+#define STALL_SETTLE_MS 200   // for the broker to hand the stall to a worker
+
+static const uint8_t client_hello_start = 0x16; // TLS handshake record
+
+struct stall_options {
+  const char *attester_type;
+  const char *verifier_type;
+  const char *tls_type;
+  const char *crypto_type;
+  bool mutual;
+  struct sockaddr_in broker;
+  const char *app_id;
+};
+
+static struct stall_options opts = {
+    .attester_type = "nullattester",
+    .verifier_type = "nullverifier",
+    .tls_type = "openssl",
+    .crypto_type = "openssl",
+};
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// The stalled connection, kept open until exit. Returns -1 on error.
+static int open_stall(void) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr *)&opts.broker, sizeof(opts.broker)) ||
+      write(fd, &client_hello_start, 1) != 1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// One attested handshake, giving up after max_wait_s. Returns 0 on success.
+static int negotiate_once(int max_wait_s) {
+  rats_tls_conf_t conf;
+  if (tls_conf_init(&conf, RATS_TLS_LOG_LEVEL_ERROR, opts.attester_type,
+                    opts.verifier_type, opts.tls_type, opts.crypto_type,
+                    opts.mutual, false))
+    return -1;
+  claim_t claim = {"appId", (uint8_t *)opts.app_id, strlen(opts.app_id)};
+  if (opts.app_id[0] != '\0') {
+    conf.custom_claims = &claim;
+    conf.custom_claims_length = 1;
+  }
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  // without the fix the broker never answers, don't wait for it forever
+  struct timeval timeout = {max_wait_s, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  rats_tls_handle handle;
+  if (connect(fd, (struct sockaddr *)&opts.broker, sizeof(opts.broker)) ||
+      rats_tls_init(&conf, &handle) != RATS_TLS_ERR_NONE) {
+    close(fd);
+    return -1;
+  }
+  int ret = -1;
+  if (rats_tls_set_verification_callback(&handle, NULL) == RATS_TLS_ERR_NONE &&
+      rats_tls_negotiate(handle, fd) == RATS_TLS_ERR_NONE)
+    ret = 0;
+  rats_tls_cleanup(handle);
+  close(fd);
+  return ret;
+}
+
+static void usage(void) {
+  puts("    Usage:\n\n"
+       "        handshake_stall <options>\n\n"
+       "    Options:\n\n"
+       "        --endpoint/-e IP:PORT   broker to check, started with "
+       "--workers 1\n"
+       "        --max-wait/-w N         seconds the client may wait (default "
+       "15)\n"
+       "        --app-id/-i value       appId claimed by the client\n"
+       "        --attester/-a value     rats-tls attester (default "
+       "nullattester)\n"
+       "        --verifier/-v value     rats-tls verifier (default "
+       "nullverifier)\n"
+       "        --tls/-t value          rats-tls TLS wrapper (default "
+       "openssl)\n"
+       "        --crypto/-c value       rats-tls crypto wrapper (default "
+       "openssl)\n"
+       "        --mutual/-m             mutual attestation\n"
+       "        --log-level/-l value    set the log level\n"
+       "        --help/-h               show the usage\n");
+}
+
+int main(int argc, char **argv) {
+  const char *endpoint = NULL;
+  int max_wait_s = DEFAULT_MAX_WAIT_S;
+
+  opts.app_id = "";
+  char *const short_options = "e:w:i:a:v:t:c:ml:h";
+  struct option long_options[] = {
+      {"endpoint", required_argument, NULL, 'e'},
+      {"max-wait", required_argument, NULL, 'w'},
+      {"app-id", required_argument, NULL, 'i'},
+      {"attester", required_argument, NULL, 'a'},
+      {"verifier", required_argument, NULL, 'v'},
+      {"tls", required_argument, NULL, 't'},
+      {"crypto", required_argument, NULL, 'c'},
+      {"mutual", no_argument, NULL, 'm'},
+      {"log-level", required_argument, NULL, 'l'},
+      {"help", no_argument, NULL, 'h'},
+      {0, 0, 0, 0}};
+  int opt;
+  while ((opt = getopt_long(argc, argv, short_options, long_options, NULL)) !=
+         -1) {
+    switch (opt) {
+    case 'e':
+      endpoint = optarg;
+      break;
+    case 'w':
+      max_wait_s = atoi(optarg);
+      break;
+    case 'i':
+      opts.app_id = optarg;
+      break;
+    case 'a':
+      opts.attester_type = optarg;
+      break;
+    case 'v':
+      opts.verifier_type = optarg;
+      break;
+    case 't':
+      opts.tls_type = optarg;
+      break;
+    case 'c':
+      opts.crypto_type = optarg;
+      break;
+    case 'm':
+      opts.mutual = true;
+      break;
+    case 'l':
+      if (log_level_parse(optarg) >= 0)
+        app_log_level = log_level_parse(optarg);
+      break;
+    case 'h':
+      usage();
+      return 0;
+    default:
+      return 1;
+    }
+  }
+  if (optind != argc || endpoint == NULL || max_wait_s <= 0) {
+    usage();
+    return 1;
+  }
+
+  char ip[INET_ADDRSTRLEN];
+  const char *colon = strchr(endpoint, ':');
+  if (colon == NULL || colon - endpoint >= (long)sizeof(ip)) {
+    LOG_ERROR("Invalid endpoint %s, expected IP:PORT", endpoint);
+    return 1;
+  }
+  memcpy(ip, endpoint, colon - endpoint);
+  ip[colon - endpoint] = '\0';
+  opts.broker.sin_family = AF_INET;
+  opts.broker.sin_port = htons(atoi(colon + 1));
+  if (inet_pton(AF_INET, ip, &opts.broker.sin_addr) != 1) {
+    LOG_ERROR("Invalid endpoint %s, expected IP:PORT", endpoint);
+    return 1;
+  }
+
+  int stall = open_stall();
+  if (stall < 0) {
+    LOG_ERROR("Failed to connect to %s", endpoint);
+    return 1;
+  }
+  usleep(STALL_SETTLE_MS * 1000);
+
+  uint64_t start = now_ms();
+  int ret = negotiate_once(max_wait_s);
+  uint64_t elapsed = now_ms() - start;
+  close(stall);
+
+  if (ret != 0 || elapsed > (uint64_t)max_wait_s * 1000) {
+    printf("FAIL: client not served within %d s behind a stalled handshake\n",
+           max_wait_s);
+    return 1;
+  }
+  printf("ok: client served after %.2f s behind a stalled handshake\n",
+         elapsed / 1e3);
+  return 0;
+}
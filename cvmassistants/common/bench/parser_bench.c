@@ -0,0 +1,312 @@
+// Throughput of the protocol and file parsers, in bytes per second, with
+// rats-tls replaced by the in-memory transport of common/fuzz. With --check
+// it fails when a parser got slower than the recorded baseline by more than
+// the tolerance; --record writes the baseline of this machine.
+//
+//   make -C common/bench check
+//   ./common/bench/parser_bench [--record FILE | --check FILE] [--tolerance PCT]
+
+#include "broker_config.h"
+#include "frame.h"
+#include "frame_client.h"
+#include "hex.h"
+#include "log.h"
+#include "secret_bundle.h"
+#include "secure_mem.h"
+#include "transport_stub.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ROUNDS 5
+#define ROUND_SECONDS 0.2
+#define DEFAULT_TOLERANCE 20 // percent
+#define BUNDLE_ENTRIES 4096
+
+struct parser_bench {
+  const char *name;
+  size_t (*run)(void); // bytes parsed by one run
+  double bytes_per_sec;
+};
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// keep the compiler from discarding the benchmarked work
+static volatile size_t sink;
+
+struct stream {
+  uint8_t *data;
+  size_t len;
+};
+
+static struct stream small_frames, large_frames, one_reply, session,
+    session_batched;
+
+// count replies of len bytes, each split into frames of at most max bytes as
+// the broker does. Above the default frame size, the stream starts with the
+// broker's HELLO agreeing on max and on size prefixed replies.
+static void build_stream(struct stream *s, size_t count, size_t len,
+                         size_t max) {
+  bool batched = max > FRAME_PAYLOAD_MAX;
+  size_t prefix = batched ? FRAME_SIZE_PREFIX : 0;
+  size_t frames = (len + prefix + max - 1) / max;
+  size_t hello = batched ? FRAME_HEADER_SIZE + FRAME_HELLO_SIZE : 0;
+  s->len = hello + count * (prefix + len + frames * FRAME_HEADER_SIZE);
+  s->data = malloc(s->len);
+  if (s->data == NULL)
+    exit(1);
+  uint8_t *p = s->data;
+  if (hello) {
+    struct frame_header h = {FRAME_VERSION_MIN, FRAME_HELLO, 0, 0,
+                             FRAME_HELLO_SIZE};
+    frame_encode_header(p, &h);
+    frame_encode_hello(p + FRAME_HEADER_SIZE, FRAME_VERSION_MIN,
+                       FRAME_VERSION_MIN, FRAME_FLAG_SIZED, max);
+    p += hello;
+  }
+  for (size_t i = 0; i < count; i++) {
+    for (size_t off = 0; off < len;) {
+      size_t first = off == 0 ? prefix : 0;
+      size_t n = len - off < max - first ? len - off : max - first;
+      uint16_t flags = (off + n < len ? FRAME_FLAG_MORE : 0) |
+                       (first ? FRAME_FLAG_SIZED : 0);
+      struct frame_header h = {FRAME_VERSION_MIN, FRAME_REPLY, flags, 1,
+                               first + n};
+      frame_encode_header(p, &h);
+      p += FRAME_HEADER_SIZE;
+      if (first)
+        frame_encode_size(p, len);
+      memset(p + first, 'a' + i % 26, n);
+      p += first + n;
+      off += n;
+    }
+  }
+}
+
+static int receive(void *ctx, void *buf, size_t *len) {
+  return rats_tls_receive(ctx, buf, len) != RATS_TLS_ERR_NONE;
+}
+
+static size_t read_frames(const struct stream *s, size_t chunk) {
+  static uint8_t buf[FRAME_READER_BUFFER];
+  struct frame_reader reader;
+  struct frame_header h;
+  const uint8_t *payload;
+
+  transport_stub_feed(s->data, s->len, chunk);
+  frame_reader_init(&reader, buf, receive, NULL);
+  while (frame_read(&reader, &h, &payload) > 0)
+    sink += payload[0];
+  return s->len;
+}
+
+// small frames, many per receive as a pipelining client sends them
+static size_t frames_small(void) { return read_frames(&small_frames, 0); }
+
+// large replies arriving in TLS record sized pieces
+static size_t frames_large(void) {
+  return read_frames(&large_frames, 16 * 1024);
+}
+
+// as the agent fetches a secret, the transport returning TLS records
+static size_t fetch(const struct stream *s) {
+  size_t len;
+  transport_stub_feed(s->data, s->len, 16 * 1024);
+  char *reply = frame_client_call(NULL, "getSecret", 100 * 1024 * 1024, &len);
+  if (reply == NULL)
+    exit(1);
+  sink += reply[len / 2];
+  secure_free(reply);
+  return s->len;
+}
+
+static size_t client_reply(void) { return fetch(&one_reply); }
+
+// a 64 MiB session from a broker without batching, then from one that agreed
+// on 1 MiB frames and announced the length
+static size_t client_session(void) { return fetch(&session); }
+static size_t client_session_batched(void) { return fetch(&session_batched); }
+
+static char *config_text;
+static size_t config_len;
+
+static size_t config(void) {
+  struct broker_config *cfg =
+      broker_config_parse(config_text, config_len, "bench");
+  if (cfg == NULL)
+    exit(1);
+  sink += cfg->app_secret_count;
+  broker_config_free(cfg);
+  return config_len;
+}
+
+static char hex_text[2 * 4096];
+
+static size_t hex(void) {
+  static uint8_t out[sizeof(hex_text) / 2];
+  sink += hex_decode(out, hex_text, sizeof(hex_text));
+  return sizeof(hex_text);
+}
+
+static char bundle_path[] = "/tmp/parser_bench_bundle.XXXXXX";
+static size_t bundle_size;
+
+// open validates every index entry
+static size_t bundle(void) {
+  struct secret_bundle *b = secret_bundle_open(bundle_path);
+  if (b == NULL)
+    exit(1);
+  sink += secret_bundle_count(b);
+  secret_bundle_close(b);
+  return bundle_size;
+}
+
+static void setup(void) {
+  app_log_level = LOG_LEVEL_NONE;
+  secure_pool_init(SECURE_POOL_DEFAULT_SIZE);
+
+  build_stream(&small_frames, 4096, 64, FRAME_PAYLOAD_MAX);
+  build_stream(&large_frames, 16, 256 * 1024, FRAME_PAYLOAD_MAX);
+  build_stream(&one_reply, 1, 1024 * 1024, FRAME_PAYLOAD_MAX);
+  build_stream(&session, 1, 64 * 1024 * 1024, FRAME_PAYLOAD_MAX);
+  build_stream(&session_batched, 1, 64 * 1024 * 1024, FRAME_BATCH_MAX);
+
+  // measurements and per-app secrets, as a large deployment has them
+  size_t cap = 1 << 20;
+  config_text = malloc(cap);
+  for (int i = 0; i < 64; i++)
+    config_len += snprintf(config_text + config_len, cap - config_len,
+                           "measurement = %064x\n", i);
+  for (int i = 0; i < 4096; i++)
+    config_len +=
+        snprintf(config_text + config_len, cap - config_len,
+                 "# app %d\nsecret.app-%05d = {\"wrapkey\": \"%032x\"}\n", i,
+                 (i * 7919) % 4096, i);
+
+  for (size_t i = 0; i < sizeof(hex_text); i++)
+    hex_text[i] = "0123456789abcdef"[i % 16];
+
+  static struct secret_bundle_input inputs[BUNDLE_ENTRIES];
+  static char app_ids[BUNDLE_ENTRIES][16];
+  static const uint8_t secret[64];
+  for (int i = 0; i < BUNDLE_ENTRIES; i++) {
+    snprintf(app_ids[i], sizeof(app_ids[i]), "app-%05d", i);
+    inputs[i] = (struct secret_bundle_input){app_ids[i], secret, sizeof(secret)};
+  }
+  int fd = mkstemp(bundle_path);
+  if (fd < 0 || secret_bundle_write(bundle_path, inputs, BUNDLE_ENTRIES, NULL))
+    exit(1);
+  close(fd);
+  FILE *f = fopen(bundle_path, "rb");
+  fseek(f, 0, SEEK_END);
+  bundle_size = ftell(f);
+  fclose(f);
+}
+
+// best of several rounds, a busy neighbour only makes rounds slower
+static double measure(size_t (*run)(void)) {
+  double best = 0;
+  run(); // warm up
+  for (int round = 0; round < ROUNDS; round++) {
+    size_t bytes = 0;
+    double start = now_s(), elapsed;
+    do {
+      bytes += run();
+      elapsed = now_s() - start;
+    } while (elapsed < ROUND_SECONDS);
+    if (bytes / elapsed > best)
+      best = bytes / elapsed;
+  }
+  return best;
+}
+
+static double baseline_of(FILE *file, const char *name) {
+  char line[256], n[64];
+  double value;
+  rewind(file);
+  while (fgets(line, sizeof(line), file) != NULL)
+    if (sscanf(line, "%63s %lf", n, &value) == 2 && !strcmp(n, name))
+      return value;
+  return 0;
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: parser_bench [--record FILE | --check FILE] "
+                  "[--tolerance PCT]\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  const char *record = NULL, *check = NULL;
+  double tolerance = DEFAULT_TOLERANCE;
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 >= argc)
+      usage();
+    if (!strcmp(argv[i], "--record"))
+      record = argv[++i];
+    else if (!strcmp(argv[i], "--check"))
+      check = argv[++i];
+    else if (!strcmp(argv[i], "--tolerance"))
+      tolerance = atof(argv[++i]);
+    else
+      usage();
+  }
+
+  struct parser_bench benches[] = {
+      {"frames_small", frames_small},
+      {"frames_large", frames_large},
+      {"client_reply", client_reply},
+      {"client_session", client_session},
+      {"client_batched", client_session_batched},
+      {"config", config},
+      {"hex_decode", hex},
+      {"bundle_open", bundle},
+  };
+  size_t count = sizeof(benches) / sizeof(benches[0]);
+
+  setup();
+  for (size_t i = 0; i < count; i++) {
+    benches[i].bytes_per_sec = measure(benches[i].run);
+    printf("%-14s %10.1f MB/s\n", benches[i].name,
+           benches[i].bytes_per_sec / 1e6);
+  }
+  unlink(bundle_path);
+
+  if (record != NULL) {
+    FILE *file = fopen(record, "w");
+    if (file == NULL) {
+      perror(record);
+      return 1;
+    }
+    for (size_t i = 0; i < count; i++)
+      fprintf(file, "%s %.0f\n", benches[i].name, benches[i].bytes_per_sec);
+    fclose(file);
+  }
+
+  int failed = 0;
+  if (check != NULL) {
+    FILE *file = fopen(check, "r");
+    if (file == NULL) {
+      perror(check);
+      return 1;
+    }
+    for (size_t i = 0; i < count; i++) {
+      double base = baseline_of(file, benches[i].name);
+      if (base > 0 &&
+          benches[i].bytes_per_sec < base * (1 - tolerance / 100)) {
+        fprintf(stderr, "%s regressed: %.1f MB/s, baseline %.1f MB/s\n",
+                benches[i].name, benches[i].bytes_per_sec / 1e6, base / 1e6);
+        failed = 1;
+      }
+    }
+    fclose(file);
+  }
+  return failed;
+}
@@ -0,0 +1,383 @@
+// Replay traffic recorded by a broker with --record-traffic against a broker,
+// as agents would: one attested connection per record, at the recorded
+// arrival times divided by --speed, with the recorded appId and first
+// command. Attestation uses the rats-tls instances given with -a/-v/-t/-c,
+// mock ones (nullattester) by default, so that a boot storm can be replayed
+// from any machine.
+//
+//   make -C common/bench traffic_replay
+//   ./common/bench/traffic_replay -e 127.0.0.1:1234 -x 10 broker.trace
+//
+// Prints the latencies seen by the replayed clients next to the recorded
+// ones. Sessions that do not start on time (more than --max-inflight
+// outstanding) are reported as lag. Connections whose client never spoke are
+// replayed as connections held open without a handshake, for as long as
+// recorded.
+
+#include "frame_client.h"
+#include "log.h"
+#include "secure_mem.h"
+#include "tls_conf.h"
+#include "traffic_trace.h"
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <rats-tls/api.h>
+
+#define DEFAULT_INFLIGHT 1024
+#define REPLY_MAX (100 * 1024 * 1024) // as the secret provider agent
+
+struct replay_options {
+  const char *attester_type;
+  const char *verifier_type;
+  const char *tls_type;
+  const char *crypto_type;
+  bool mutual;
+  struct sockaddr_in broker;
+  const char *app_id; // replaces the recorded ones when set
+};
+
+struct session {
+  struct traffic_record rec;
+  uint64_t lag_us;       // started late by this much
+  uint64_t negotiate_us; // connect and handshake
+  uint64_t total_us;     // until the reply was in
+  bool failed;
+};
+
+static struct replay_options opts = {
+    .attester_type = "nullattester",
+    .verifier_type = "nullverifier",
+    .tls_type = "openssl",
+    .crypto_type = "openssl",
+};
+static sem_t inflight;
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static size_t done;
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void hold_silent(struct session *s) {
+  s->failed = true;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return;
+  if (connect(fd, (struct sockaddr *)&opts.broker, sizeof(opts.broker)) == 0) {
+    usleep(s->rec.wait_us);
+    s->failed = false;
+  }
+  close(fd);
+}
+
+static void run_session(struct session *s) {
+  if (s->rec.outcome == TRAFFIC_SILENT) {
+    hold_silent(s);
+    return;
+  }
+
+  rats_tls_conf_t conf;
+  if (tls_conf_init(&conf, RATS_TLS_LOG_LEVEL_ERROR, opts.attester_type,
+                    opts.verifier_type, opts.tls_type, opts.crypto_type,
+                    opts.mutual, false)) {
+    s->failed = true;
+    return;
+  }
+  const char *app_id = opts.app_id != NULL ? opts.app_id : s->rec.app_id;
+  claim_t claim = {"appId", (uint8_t *)app_id, strlen(app_id)};
+  if (app_id[0] != '\0') {
+    conf.custom_claims = &claim;
+    conf.custom_claims_length = 1;
+  }
+
+  uint64_t start = now_us();
+  s->failed = true;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return;
+  rats_tls_handle handle;
+  if (connect(fd, (struct sockaddr *)&opts.broker, sizeof(opts.broker)) ||
+      rats_tls_init(&conf, &handle) != RATS_TLS_ERR_NONE) {
+    close(fd);
+    return;
+  }
+  if (rats_tls_set_verification_callback(&handle, NULL) == RATS_TLS_ERR_NONE &&
+      rats_tls_negotiate(handle, fd) == RATS_TLS_ERR_NONE) {
+    s->negotiate_us = now_us() - start;
+    if (s->rec.command[0] == '\0') {
+      s->failed = false;
+    } else {
+      size_t len;
+      char *reply = frame_client_call(handle, s->rec.command, REPLY_MAX, &len);
+      if (reply != NULL) {
+        secure_free(reply);
+        s->failed = false;
+      }
+    }
+  }
+  s->total_us = now_us() - start;
+  rats_tls_cleanup(handle);
+  close(fd);
+}
+
+static void *session_main(void *arg) {
+  run_session(arg);
+  sem_post(&inflight);
+  pthread_mutex_lock(&done_lock);
+  done++;
+  pthread_cond_signal(&done_cond);
+  pthread_mutex_unlock(&done_lock);
+  return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// records are written as connections end, replay them in arrival order
+static int compare_arrivals(const void *a, const void *b) {
+  return compare_u64(&((const struct session *)a)->rec.accept_us,
+                     &((const struct session *)b)->rec.accept_us);
+}
+
+// p50, p99 and max of n values, in milliseconds
+static void print_latency(const char *name, uint64_t *v, size_t n) {
+  if (n == 0) {
+    printf("%-24s -\n", name);
+    return;
+  }
+  qsort(v, n, sizeof(*v), compare_u64);
+  printf("%-24s p50 %8.2f  p99 %8.2f  max %8.2f ms\n", name,
+         v[n / 2] / 1e3, v[(n * 99) / 100] / 1e3, v[n - 1] / 1e3);
+}
+
+static void report(struct session *sessions, size_t count, double elapsed_s) {
+  uint64_t *v = calloc(count ? count : 1, sizeof(uint64_t));
+  if (v == NULL)
+    return;
+  size_t failed = 0, outcomes[TRAFFIC_SILENT + 1] = {0}, n;
+
+  for (size_t i = 0; i < count; i++) {
+    failed += sessions[i].failed;
+    if (sessions[i].rec.outcome <= TRAFFIC_SILENT)
+      outcomes[sessions[i].rec.outcome]++;
+  }
+  printf("%zu sessions in %.2f s, %zu failed\n\n", count, elapsed_s, failed);
+
+  printf("recorded: %zu served, %zu failed negotiation, %zu dropped, %zu "
+         "shed, %zu silent\n",
+         outcomes[TRAFFIC_SERVED], outcomes[TRAFFIC_NEGOTIATE_FAILED],
+         outcomes[TRAFFIC_DROPPED], outcomes[TRAFFIC_SHED],
+         outcomes[TRAFFIC_SILENT]);
+  n = 0;
+  for (size_t i = 0; i < count; i++)
+    if (sessions[i].rec.outcome == TRAFFIC_SERVED)
+      v[n++] = sessions[i].rec.queue_us;
+  print_latency("  queue", v, n);
+  n = 0;
+  for (size_t i = 0; i < count; i++)
+    if (sessions[i].rec.outcome == TRAFFIC_SERVED)
+      v[n++] = sessions[i].rec.negotiate_us;
+  print_latency("  negotiate", v, n);
+  n = 0;
+  for (size_t i = 0; i < count; i++)
+    if (sessions[i].rec.outcome == TRAFFIC_SERVED)
+      v[n++] = sessions[i].rec.wait_us + sessions[i].rec.queue_us +
+               sessions[i].rec.negotiate_us + sessions[i].rec.serve_us;
+  print_latency("  connection", v, n);
+
+  printf("replayed\n");
+  n = 0;
+  for (size_t i = 0; i < count; i++)
+    if (!sessions[i].failed && sessions[i].rec.outcome != TRAFFIC_SILENT)
+      v[n++] = sessions[i].negotiate_us;
+  print_latency("  connect and negotiate", v, n);
+  n = 0;
+  for (size_t i = 0; i < count; i++)
+    if (!sessions[i].failed && sessions[i].rec.outcome != TRAFFIC_SILENT)
+      v[n++] = sessions[i].total_us;
+  print_latency("  session", v, n);
+  for (size_t i = 0; i < count; i++)
+    v[i] = sessions[i].lag_us;
+  print_latency("  start lag", v, count);
+  free(v);
+}
+
+static void usage(void) {
+  puts("    Usage:\n\n"
+       "        traffic_replay <options> TRACE\n\n"
+       "    Options:\n\n"
+       "        --endpoint/-e IP:PORT   broker to replay against\n"
+       "        --speed/-x N            replay N times faster (default 1)\n"
+       "        --max-inflight/-n N     sessions open at once (default 1024)\n"
+       "        --app-id/-i value       claim this appId instead of the "
+       "recorded ones\n"
+       "        --attester/-a value     rats-tls attester (default "
+       "nullattester)\n"
+       "        --verifier/-v value     rats-tls verifier (default "
+       "nullverifier)\n"
+       "        --tls/-t value          rats-tls TLS wrapper (default "
+       "openssl)\n"
+       "        --crypto/-c value       rats-tls crypto wrapper (default "
+       "openssl)\n"
+       "        --mutual/-m             mutual attestation\n"
+       "        --log-level/-l value    set the log level\n"
+       "        --help/-h               show the usage\n");
+}
+
+int main(int argc, char **argv) {
+  const char *endpoint = NULL;
+  double speed = 1;
+  long max_inflight = DEFAULT_INFLIGHT;
+
+  char *const short_options = "e:x:n:i:a:v:t:c:ml:h";
+  struct option long_options[] = {
+      {"endpoint", required_argument, NULL, 'e'},
+      {"speed", required_argument, NULL, 'x'},
+      {"max-inflight", required_argument, NULL, 'n'},
+      {"app-id", required_argument, NULL, 'i'},
+      {"attester", required_argument, NULL, 'a'},
+      {"verifier", required_argument, NULL, 'v'},
+      {"tls", required_argument, NULL, 't'},
+      {"crypto", required_argument, NULL, 'c'},
+      {"mutual", no_argument, NULL, 'm'},
+      {"log-level", required_argument, NULL, 'l'},
+      {"help", no_argument, NULL, 'h'},
+      {0, 0, 0, 0}};
+  int opt;
+  while ((opt = getopt_long(argc, argv, short_options, long_options, NULL)) !=
+         -1) {
+    switch (opt) {
+    case 'e':
+      endpoint = optarg;
+      break;
+    case 'x':
+      speed = atof(optarg);
+      break;
+    case 'n':
+      max_inflight = atol(optarg);
+      break;
+    case 'i':
+      opts.app_id = optarg;
+      break;
+    case 'a':
+      opts.attester_type = optarg;
+      break;
+    case 'v':
+      opts.verifier_type = optarg;
+      break;
+    case 't':
+      opts.tls_type = optarg;
+      break;
+    case 'c':
+      opts.crypto_type = optarg;
+      break;
+    case 'm':
+      opts.mutual = true;
+      break;
+    case 'l':
+      if (log_level_parse(optarg) >= 0)
+        app_log_level = log_level_parse(optarg);
+      break;
+    case 'h':
+      usage();
+      return 0;
+    default:
+      return 1;
+    }
+  }
+  if (optind != argc - 1 || endpoint == NULL || speed <= 0 ||
+      max_inflight <= 0) {
+    usage();
+    return 1;
+  }
+
+  char ip[INET_ADDRSTRLEN];
+  const char *colon = strchr(endpoint, ':');
+  if (colon == NULL || colon - endpoint >= (long)sizeof(ip)) {
+    LOG_ERROR("Invalid endpoint %s, expected IP:PORT", endpoint);
+    return 1;
+  }
+  memcpy(ip, endpoint, colon - endpoint);
+  ip[colon - endpoint] = '\0';
+  opts.broker.sin_family = AF_INET;
+  opts.broker.sin_port = htons(atoi(colon + 1));
+  if (inet_pton(AF_INET, ip, &opts.broker.sin_addr) != 1) {
+    LOG_ERROR("Invalid endpoint %s, expected IP:PORT", endpoint);
+    return 1;
+  }
+
+  FILE *f = fopen(argv[optind], "rb");
+  uint64_t start_unix_us;
+  if (f == NULL || traffic_trace_read_header(f, &start_unix_us)) {
+    LOG_ERROR("%s is not a traffic recording", argv[optind]);
+    return 1;
+  }
+  size_t count = 0, capacity = 1024;
+  struct session *sessions = malloc(capacity * sizeof(struct session));
+  int ret;
+  while (sessions != NULL &&
+         (ret = traffic_trace_read(f, &sessions[count].rec)) == 1) {
+    if (++count == capacity) {
+      capacity *= 2;
+      struct session *grown = realloc(sessions, capacity * sizeof(*sessions));
+      if (grown == NULL)
+        free(sessions);
+      sessions = grown;
+    }
+  }
+  fclose(f);
+  if (sessions == NULL || ret < 0) {
+    LOG_ERROR("Failed to read %s", argv[optind]);
+    return 1;
+  }
+  qsort(sessions, count, sizeof(*sessions), compare_arrivals);
+  LOG_INFO("Replaying %zu connections at %gx", count, speed);
+
+  sem_init(&inflight, 0, max_inflight);
+  uint64_t begin = now_us();
+  uint64_t first_us = count > 0 ? sessions[0].rec.accept_us : 0; // earliest
+  for (size_t i = 0; i < count; i++) {
+    struct session *s = &sessions[i];
+    uint64_t due = begin + (uint64_t)((s->rec.accept_us - first_us) / speed);
+    uint64_t now = now_us();
+    if (due > now)
+      usleep(due - now);
+    sem_wait(&inflight);
+    now = now_us();
+    s->lag_us = now > due ? now - due : 0;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, session_main, s) != 0) {
+      s->failed = true;
+      sem_post(&inflight);
+      pthread_mutex_lock(&done_lock);
+      done++;
+      pthread_mutex_unlock(&done_lock);
+      continue;
+    }
+    pthread_detach(tid);
+  }
+
+  pthread_mutex_lock(&done_lock);
+  while (done < count)
+    pthread_cond_wait(&done_cond, &done_lock);
+  pthread_mutex_unlock(&done_lock);
+
+  report(sessions, count, (now_us() - begin) / 1e6);
+  free(sessions);
+  return 0;
+}
@@ -0,0 +1,82 @@
+// Micro-benchmark of a verdict cache hit against the constant-time allow-list
+// scan it short-circuits, for allow-lists of growing length. A hit hashes the
+// measurement and compares up to PROBE_MAX entries; the scan compares every
+// listed digest over the full width.
+//
+//   make -C common/bench verdict_bench && ./common/bench/verdict_bench [iterations]
+
+#include "broker_config.h"
+#include "hex.h"
+#include "verdict_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DIGEST_SIZE 32 // SM3, as in CSV measurements
+
+static const size_t list_sizes[] = {1, 4, 16, 64, 256, 1024};
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void digest_of(uint8_t *out, size_t n) {
+  for (size_t i = 0; i < DIGEST_SIZE; i++)
+    out[i] = (uint8_t)(n * 131 + i * 7 + 1);
+}
+
+// keep the compiler from discarding the benchmarked work
+static volatile unsigned sink;
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 200000;
+  struct verdict_cache *cache = verdict_cache_new(4096);
+  if (cache == NULL)
+    return 1;
+
+  for (size_t s = 0; s < sizeof(list_sizes) / sizeof(list_sizes[0]); s++) {
+    size_t count = list_sizes[s];
+    struct broker_config *cfg = broker_config_new();
+    uint8_t digest[DIGEST_SIZE];
+    char hex[2 * DIGEST_SIZE + 1];
+    for (size_t i = 0; i < count; i++) {
+      digest_of(digest, i);
+      hex_encode(hex, digest, sizeof(digest));
+      if (cfg == NULL || broker_config_set(cfg, "measurement", hex)) {
+        fprintf(stderr, "failed to build an allow-list of %zu\n", count);
+        return 1;
+      }
+    }
+    broker_config_seal(cfg);
+
+    // the last listed one: the scan costs the same for any digest
+    digest_of(digest, count - 1);
+    int verdict;
+    if (!broker_config_has_measurement(cfg, digest, sizeof(digest))) {
+      fprintf(stderr, "setup failed at %zu measurements\n", count);
+      return 1;
+    }
+    verdict_cache_put(cache, cfg->measurement_tag, digest, sizeof(digest), -1,
+                      VERDICT_CACHE_DEFAULT_TTL);
+
+    double start = now_ns();
+    for (long i = 0; i < iterations; i++)
+      sink += broker_config_has_measurement(cfg, digest, sizeof(digest));
+    double t_scan = (now_ns() - start) / iterations;
+
+    start = now_ns();
+    for (long i = 0; i < iterations; i++)
+      sink += verdict_cache_get(cache, cfg->measurement_tag, digest,
+                                sizeof(digest), &verdict);
+    double t_hit = (now_ns() - start) / iterations;
+
+    printf("%5zu measurements: allow-list scan %8.1f ns  cache hit %6.1f ns\n",
+           count, t_scan, t_hit);
+    broker_config_free(cfg);
+  }
+  return 0;
+}
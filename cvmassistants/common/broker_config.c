@@ -0,0 +1,649 @@
+#include "broker_config.h"
+#include "collateral_cache.h"
+#include "hex.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <libgen.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <time.h>
+#include <unistd.h>
+#include <rats-tls/api.h>
+#include <rats-tls/log.h>
+
+#define APP_SECRET_PREFIX "secret."
+
+// Current snapshot and the two reader counters used for grace periods.
+// Readers register in readers[reader_slot & 1]; the publisher flips the slot
+// and waits for the previous one to drain, twice, so that every reader which
+// may have seen the old snapshot is gone before it is freed.
+static _Atomic(struct broker_config *) current_config;
+static atomic_uint reader_slot;
+static atomic_uint readers[2];
+static pthread_mutex_t publish_lock = PTHREAD_MUTEX_INITIALIZER;
+// measurement_tag of the last sealed config, see broker_config_seal()
+static atomic_uint_fast64_t generation;
+
+struct broker_config *broker_config_new(void) {
+  struct broker_config *cfg = calloc(1, sizeof(struct broker_config));
+  if (cfg != NULL)
+    cfg->cluster_replicas = 1;
+  return cfg;
+}
+
+// secrets and keys don't outlive their snapshot in freed heap
+static void free_secret(char *secret) {
+  if (secret == NULL)
+    return;
+  explicit_bzero(secret, strlen(secret));
+  free(secret);
+}
+
+void broker_config_free(struct broker_config *cfg) {
+  if (cfg == NULL)
+    return;
+  for (size_t i = 0; i < cfg->app_secret_count; i++) {
+    free(cfg->app_secrets[i].app_id);
+    free_secret(cfg->app_secrets[i].secret);
+  }
+  free(cfg->app_secrets);
+  free(cfg->measurements);
+  free_secret(cfg->wrap_key);
+  free_secret(cfg->default_secret.secret);
+  free(cfg->bundle_path);
+  secret_bundle_close(cfg->bundle);
+  free(cfg->collateral_dir);
+  free(cfg->collateral_seed);
+  free(cfg->collateral_url);
+  for (size_t i = 0; i < cfg->collateral_chip_count; i++)
+    free(cfg->collateral_chips[i]);
+  free(cfg->collateral_chips);
+  for (size_t i = 0; i < cfg->cluster_node_count; i++) {
+    free(cfg->cluster_nodes[i].id);
+    free(cfg->cluster_nodes[i].address);
+  }
+  free(cfg->cluster_nodes);
+  free(cfg->cluster_self);
+  explicit_bzero(cfg->bundle_key, sizeof(cfg->bundle_key));
+  explicit_bzero(cfg->cluster_key, sizeof(cfg->cluster_key));
+  free(cfg);
+}
+
+static int add_measurement(struct broker_config *cfg, const char *hex) {
+  size_t hex_len = strlen(hex);
+  if (hex_len == 0 || hex_len % 2 != 0 ||
+      hex_len / 2 > BROKER_MEASUREMENT_MAX) {
+    RTLS_ERR("invalid measurement length %zu\n", hex_len);
+    return -1;
+  }
+
+  struct broker_measurement m;
+  memset(&m, 0, sizeof(m));
+  m.len = hex_len / 2;
+  if (hex_decode(m.digest, hex, hex_len) < 0) {
+    RTLS_ERR("invalid hex digit in measurement '%s'\n", hex);
+    return -1;
+  }
+
+  struct broker_measurement *list =
+      realloc(cfg->measurements,
+              (cfg->measurement_count + 1) * sizeof(struct broker_measurement));
+  if (list == NULL)
+    return -1;
+  list[cfg->measurement_count++] = m;
+  cfg->measurements = list;
+  return 0;
+}
+
+static int add_app_secret(struct broker_config *cfg, const char *app_id,
+                          const char *secret) {
+  if (*app_id == '\0') {
+    RTLS_ERR("empty appId in secret mapping\n");
+    return -1;
+  }
+
+  struct broker_app_secret *list =
+      realloc(cfg->app_secrets,
+              (cfg->app_secret_count + 1) * sizeof(struct broker_app_secret));
+  if (list == NULL)
+    return -1;
+  cfg->app_secrets = list;
+
+  struct broker_app_secret *entry = &list[cfg->app_secret_count];
+  entry->app_id = strdup(app_id);
+  entry->secret = strdup(secret);
+  entry->secret_len = strlen(secret);
+  if (entry->app_id == NULL || entry->secret == NULL) {
+    free(entry->app_id);
+    free_secret(entry->secret);
+    return -1;
+  }
+  cfg->app_secret_count++;
+  return 0;
+}
+
+static int open_bundle(struct broker_config *cfg, const char *path) {
+  struct secret_bundle *bundle = secret_bundle_open(path);
+  if (bundle == NULL) {
+    RTLS_ERR("failed to open secret bundle %s\n", path);
+    return -1;
+  }
+  char *copy = strdup(path);
+  if (copy == NULL) {
+    secret_bundle_close(bundle);
+    return -1;
+  }
+  secret_bundle_close(cfg->bundle);
+  free(cfg->bundle_path);
+  cfg->bundle = bundle;
+  cfg->bundle_path = copy;
+  return 0;
+}
+
+static int add_collateral_chip(struct broker_config *cfg, const char *chip_id) {
+  if (!collateral_chip_id_valid(chip_id)) {
+    RTLS_ERR("invalid chip id '%s'\n", chip_id);
+    return -1;
+  }
+
+  char **list = realloc(cfg->collateral_chips,
+                        (cfg->collateral_chip_count + 1) * sizeof(char *));
+  if (list == NULL)
+    return -1;
+  cfg->collateral_chips = list;
+  list[cfg->collateral_chip_count] = strdup(chip_id);
+  if (list[cfg->collateral_chip_count] == NULL)
+    return -1;
+  cfg->collateral_chip_count++;
+  return 0;
+}
+
+static int add_cluster_node(struct broker_config *cfg, const char *value) {
+  const char *space = strpbrk(value, " \t");
+  const char *address = space;
+  while (address != NULL && (*address == ' ' || *address == '\t'))
+    address++;
+  if (space == NULL || space == value || *address == '\0') {
+    RTLS_ERR("cluster_node needs '<id> <host>:<port>'\n");
+    return -1;
+  }
+
+  struct broker_cluster_node *list =
+      realloc(cfg->cluster_nodes, (cfg->cluster_node_count + 1) *
+                                      sizeof(struct broker_cluster_node));
+  if (list == NULL)
+    return -1;
+  cfg->cluster_nodes = list;
+
+  struct broker_cluster_node *node = &list[cfg->cluster_node_count];
+  node->id = strndup(value, space - value);
+  node->address = strdup(address);
+  if (node->id == NULL || node->address == NULL) {
+    free(node->id);
+    free(node->address);
+    return -1;
+  }
+  cfg->cluster_node_count++;
+  return 0;
+}
+
+static int parse_number(double *field, const char *value) {
+  char *end;
+  double v = strtod(value, &end);
+  if (end == value || *end != '\0' || v < 0)
+    return -1;
+  *field = v;
+  return 0;
+}
+
+static int replace_string(char **field, const char *value) {
+  char *copy = strdup(value);
+  if (copy == NULL)
+    return -1;
+  free(*field);
+  *field = copy;
+  return 0;
+}
+
+static int replace_secret(char **field, const char *value) {
+  char *copy = strdup(value);
+  if (copy == NULL)
+    return -1;
+  free_secret(*field);
+  *field = copy;
+  return 0;
+}
+
+int broker_config_set(struct broker_config *cfg, const char *key,
+                      const char *value) {
+  if (!strcmp(key, "measurement"))
+    return add_measurement(cfg, value);
+  if (!strcmp(key, "wrap_key"))
+    return replace_secret(&cfg->wrap_key, value);
+  if (!strcmp(key, "secret")) {
+    cfg->default_secret.secret_len = strlen(value);
+    return replace_secret(&cfg->default_secret.secret, value);
+  }
+  if (!strcmp(key, "bundle"))
+    return open_bundle(cfg, value);
+  if (!strcmp(key, "bundle_key")) {
+    if (secret_bundle_load_key(value, cfg->bundle_key)) {
+      RTLS_ERR("failed to read bundle key %s\n", value);
+      return -1;
+    }
+    cfg->has_bundle_key = true;
+    return 0;
+  }
+  if (!strncmp(key, APP_SECRET_PREFIX, strlen(APP_SECRET_PREFIX)))
+    return add_app_secret(cfg, key + strlen(APP_SECRET_PREFIX), value);
+  if (!strcmp(key, "ip_rate"))
+    return parse_number(&cfg->ip_rate, value);
+  if (!strcmp(key, "ip_burst"))
+    return parse_number(&cfg->ip_burst, value);
+  if (!strcmp(key, "app_rate"))
+    return parse_number(&cfg->app_rate, value);
+  if (!strcmp(key, "app_burst"))
+    return parse_number(&cfg->app_burst, value);
+  if (!strcmp(key, "max_queue_wait_ms")) {
+    double ms;
+    if (parse_number(&ms, value))
+      return -1;
+    cfg->max_queue_wait_ms = (unsigned)ms;
+    return 0;
+  }
+  if (!strcmp(key, "verify_cache_ttl")) {
+    double seconds;
+    if (parse_number(&seconds, value) || seconds < 1)
+      return -1;
+    cfg->verify_cache_ttl = (unsigned)seconds;
+    return 0;
+  }
+  if (!strcmp(key, "collateral_dir"))
+    return replace_string(&cfg->collateral_dir, value);
+  if (!strcmp(key, "collateral_seed"))
+    return replace_string(&cfg->collateral_seed, value);
+  if (!strcmp(key, "collateral_url"))
+    return replace_string(&cfg->collateral_url, value);
+  if (!strcmp(key, "collateral_ttl")) {
+    double seconds;
+    if (parse_number(&seconds, value) || seconds < 1)
+      return -1;
+    cfg->collateral_ttl = (unsigned)seconds;
+    return 0;
+  }
+  if (!strcmp(key, "collateral_chip"))
+    return add_collateral_chip(cfg, value);
+  if (!strcmp(key, "cluster_node"))
+    return add_cluster_node(cfg, value);
+  if (!strcmp(key, "cluster_self"))
+    return replace_string(&cfg->cluster_self, value);
+  if (!strcmp(key, "cluster_replicas")) {
+    double k;
+    if (parse_number(&k, value))
+      return -1;
+    cfg->cluster_replicas = (unsigned)k;
+    return 0;
+  }
+  if (!strcmp(key, "cluster_key")) {
+    if (secret_bundle_load_key(value, cfg->cluster_key)) {
+      RTLS_ERR("failed to read cluster key %s\n", value);
+      return -1;
+    }
+    cfg->has_cluster_key = true;
+    return 0;
+  }
+  if (!strcmp(key, "require_app_id")) {
+    if (!strcasecmp(value, "true"))
+      cfg->require_app_id = true;
+    else if (!strcasecmp(value, "false"))
+      cfg->require_app_id = false;
+    else
+      return -1;
+    return 0;
+  }
+
+  RTLS_ERR("unknown config key '%s'\n", key);
+  return -1;
+}
+
+static int compare_app_secrets(const void *a, const void *b) {
+  const struct broker_app_secret *sa = a;
+  const struct broker_app_secret *sb = b;
+  return strcmp(sa->app_id, sb->app_id);
+}
+
+int broker_config_seal(struct broker_config *cfg) {
+  // a new generation per sealed config: verdicts cached under an older
+  // allow-list can never match again, whatever the lists contain
+  cfg->measurement_tag = atomic_fetch_add(&generation, 1) + 1;
+
+  if (cfg->app_secret_count == 0)
+    return 0;
+  qsort(cfg->app_secrets, cfg->app_secret_count,
+        sizeof(struct broker_app_secret), compare_app_secrets);
+  for (size_t i = 1; i < cfg->app_secret_count; i++) {
+    if (!strcmp(cfg->app_secrets[i - 1].app_id, cfg->app_secrets[i].app_id)) {
+      RTLS_ERR("duplicate secret for appId '%s'\n", cfg->app_secrets[i].app_id);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static char *trim(char *s) {
+  while (isspace((unsigned char)*s))
+    s++;
+  char *end = s + strlen(s);
+  while (end > s && isspace((unsigned char)end[-1]))
+    *--end = '\0';
+  return s;
+}
+
+static struct broker_config *parse_file(FILE *file, const char *path) {
+  struct broker_config *cfg = broker_config_new();
+  char *line = NULL;
+  size_t line_cap = 0;
+  unsigned line_no = 0;
+  bool failed = (cfg == NULL);
+
+  while (!failed && getline(&line, &line_cap, file) != -1) {
+    line_no++;
+    char *entry = trim(line);
+    if (*entry == '\0' || *entry == '#')
+      continue;
+
+    char *eq = strchr(entry, '=');
+    if (eq == NULL) {
+      RTLS_ERR("%s:%u: expected 'key = value'\n", path, line_no);
+      failed = true;
+      break;
+    }
+    *eq = '\0';
+    if (broker_config_set(cfg, trim(entry), trim(eq + 1))) {
+      RTLS_ERR("%s:%u: invalid setting\n", path, line_no);
+      failed = true;
+    }
+  }
+  free(line);
+  fclose(file);
+
+  if (!failed && broker_config_seal(cfg))
+    failed = true;
+  if (failed) {
+    broker_config_free(cfg);
+    return NULL;
+  }
+  return cfg;
+}
+
+struct broker_config *broker_config_load(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    RTLS_ERR("failed to open config %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  return parse_file(file, path);
+}
+
+struct broker_config *broker_config_parse(const char *text, size_t len,
+                                          const char *name) {
+  // fmemopen() may refuse an empty buffer
+  if (len == 0) {
+    text = "\n";
+    len = 1;
+  }
+  FILE *file = fmemopen((void *)text, len, "r");
+  if (file == NULL)
+    return NULL;
+  return parse_file(file, name);
+}
+
+bool broker_config_has_measurement(const struct broker_config *cfg,
+                                   const uint8_t *digest, size_t len) {
+  if (len == 0 || len > BROKER_MEASUREMENT_MAX)
+    return false;
+
+  // compare against every entry over the full digest width, without early
+  // exit, so that timing reveals neither the entry nor a matching prefix
+  uint8_t padded[BROKER_MEASUREMENT_MAX] = {0};
+  memcpy(padded, digest, len);
+  bool found = false;
+  for (size_t i = 0; i < cfg->measurement_count; i++) {
+    const struct broker_measurement *m = &cfg->measurements[i];
+    found |= (m->len == len) & ct_equal(m->digest, padded, sizeof(padded));
+  }
+  return found;
+}
+
+int broker_config_find_secret(const struct broker_config *cfg,
+                              const char *app_id, struct broker_secret *out) {
+  memset(out, 0, sizeof(*out));
+
+  if (app_id != NULL && *app_id != '\0') {
+    struct broker_app_secret key = {.app_id = (char *)app_id};
+    const struct broker_app_secret *found =
+        cfg->app_secret_count == 0
+            ? NULL
+            : bsearch(&key, cfg->app_secrets, cfg->app_secret_count,
+                      sizeof(struct broker_app_secret), compare_app_secrets);
+    if (found != NULL) {
+      out->data = (const uint8_t *)found->secret;
+      out->len = found->secret_len;
+      return 0;
+    }
+    if (cfg->bundle != NULL &&
+        !secret_bundle_find(cfg->bundle, app_id, &out->entry)) {
+      out->sealed = out->entry.flags & SECRET_BUNDLE_ENTRY_SEALED;
+      out->data = out->entry.blob;
+      out->len = secret_bundle_plain_len(&out->entry);
+      return 0;
+    }
+  }
+
+  if (cfg->require_app_id || cfg->default_secret.secret == NULL)
+    return -1;
+  out->data = (const uint8_t *)cfg->default_secret.secret;
+  out->len = cfg->default_secret.secret_len;
+  return 0;
+}
+
+int broker_secret_unseal(const struct broker_config *cfg,
+                         const struct broker_secret *secret, uint8_t *out) {
+  if (!cfg->has_bundle_key) {
+    RTLS_ERR("sealed bundle entry but no bundle_key configured\n");
+    return -1;
+  }
+  return secret_bundle_unseal(&secret->entry, cfg->bundle_key, out);
+}
+
+const struct broker_config *broker_config_get(unsigned *slot) {
+  unsigned s = atomic_load(&reader_slot) & 1;
+  atomic_fetch_add(&readers[s], 1);
+  *slot = s;
+  return atomic_load(&current_config);
+}
+
+void broker_config_put(unsigned slot) { atomic_fetch_sub(&readers[slot], 1); }
+
+static void wait_for_readers(void) {
+  const struct timespec pause = {.tv_sec = 0, .tv_nsec = 1000 * 1000};
+
+  for (int i = 0; i < 2; i++) {
+    unsigned old = atomic_fetch_xor(&reader_slot, 1) & 1;
+    while (atomic_load(&readers[old]) != 0)
+      nanosleep(&pause, NULL);
+  }
+}
+
+void broker_config_publish(struct broker_config *cfg) {
+  pthread_mutex_lock(&publish_lock);
+  struct broker_config *old = atomic_exchange(&current_config, cfg);
+  if (old != NULL)
+    wait_for_readers();
+  pthread_mutex_unlock(&publish_lock);
+  broker_config_free(old);
+}
+
+int broker_config_reload(const char *path) {
+  struct broker_config *cfg = broker_config_load(path);
+  if (cfg == NULL) {
+    RTLS_ERR("failed to reload %s, keeping current configuration\n", path);
+    return -1;
+  }
+  size_t measurements = cfg->measurement_count;
+  size_t app_secrets = cfg->app_secret_count;
+  broker_config_publish(cfg);
+  RTLS_INFO("configuration reloaded from %s: %zu measurements, %zu app "
+            "secrets\n",
+            path, measurements, app_secrets);
+  return 0;
+}
+
+struct config_watcher {
+  char *path;
+  char *name;
+  char bundle_name[256];
+  int signal_fd;
+  int inotify_fd;
+};
+
+// Follow the bundle of the current snapshot so that renaming a new bundle into
+// place is picked up like a config change.
+static void watch_bundle(struct config_watcher *w) {
+  char dir[4096], name[4096];
+  unsigned slot;
+
+  const struct broker_config *cfg = broker_config_get(&slot);
+  bool has_bundle = cfg != NULL && cfg->bundle_path != NULL;
+  if (has_bundle) {
+    snprintf(dir, sizeof(dir), "%s", cfg->bundle_path);
+    snprintf(name, sizeof(name), "%s", cfg->bundle_path);
+  }
+  broker_config_put(slot);
+
+  w->bundle_name[0] = '\0';
+  if (!has_bundle || w->inotify_fd < 0)
+    return;
+  snprintf(w->bundle_name, sizeof(w->bundle_name), "%s", basename(name));
+  inotify_add_watch(w->inotify_fd, dirname(dir), IN_CLOSE_WRITE | IN_MOVED_TO);
+}
+
+static bool inotify_names_config(struct config_watcher *w) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  bool match = false;
+
+  ssize_t len = read(w->inotify_fd, buf, sizeof(buf));
+  for (char *p = buf; len > 0 && p < buf + len;) {
+    const struct inotify_event *ev = (const struct inotify_event *)p;
+    if (ev->len > 0 &&
+        (!strcmp(ev->name, w->name) || !strcmp(ev->name, w->bundle_name)))
+      match = true;
+    p += sizeof(struct inotify_event) + ev->len;
+  }
+  return match;
+}
+
+static void *config_watcher_main(void *arg) {
+  struct config_watcher *w = arg;
+  struct pollfd fds[2] = {
+      {.fd = w->signal_fd, .events = POLLIN},
+      {.fd = w->inotify_fd, .events = POLLIN},
+  };
+  nfds_t nfds = w->inotify_fd < 0 ? 1 : 2;
+
+  watch_bundle(w);
+  for (;;) {
+    if (poll(fds, nfds, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      RTLS_ERR("config watcher poll failed: %s\n", strerror(errno));
+      break;
+    }
+
+    bool reload = false;
+    if (fds[0].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      if (read(w->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        RTLS_INFO("SIGHUP received\n");
+        reload = true;
+      }
+    }
+    if (nfds > 1 && (fds[1].revents & POLLIN) && inotify_names_config(w))
+      reload = true;
+
+    if (reload && !broker_config_reload(w->path))
+      watch_bundle(w);
+  }
+  return NULL;
+}
+
+int broker_config_start_watcher(const char *path) {
+  struct config_watcher *w = calloc(1, sizeof(struct config_watcher));
+  if (w == NULL)
+    return -1;
+  w->signal_fd = -1;
+  w->inotify_fd = -1;
+
+  char *dir_copy = strdup(path);
+  char *name_copy = strdup(path);
+  w->path = strdup(path);
+  if (dir_copy == NULL || name_copy == NULL || w->path == NULL)
+    goto err;
+  w->name = strdup(basename(name_copy));
+  if (w->name == NULL)
+    goto err;
+
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGHUP);
+  if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0)
+    goto err;
+  w->signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+  if (w->signal_fd < 0) {
+    RTLS_ERR("failed to create signalfd: %s\n", strerror(errno));
+    goto err;
+  }
+
+  // Watch the directory rather than the file: editors and atomic publishers
+  // replace the file, which would silently drop a watch on the old inode.
+  w->inotify_fd = inotify_init1(IN_CLOEXEC);
+  if (w->inotify_fd >= 0 &&
+      inotify_add_watch(w->inotify_fd, dirname(dir_copy),
+                        IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    close(w->inotify_fd);
+    w->inotify_fd = -1;
+  }
+  if (w->inotify_fd < 0)
+    RTLS_WARN("inotify unavailable for %s, reloading on SIGHUP only\n", path);
+
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, config_watcher_main, w) != 0) {
+    RTLS_ERR("failed to start config watcher thread\n");
+    goto err;
+  }
+  pthread_detach(tid);
+  free(dir_copy);
+  free(name_copy);
+  return 0;
+
+err:
+  if (w->signal_fd >= 0)
+    close(w->signal_fd);
+  if (w->inotify_fd >= 0)
+    close(w->inotify_fd);
+  free(dir_copy);
+  free(name_copy);
+  free(w->path);
+  free(w->name);
+  free(w);
+  return -1;
+}
@@ -0,0 +1,166 @@
+#ifndef CONKER_BROKER_CONFIG_H
+#define CONKER_BROKER_CONFIG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "secret_bundle.h"
+
+// Largest measurement digest accepted in the allow-list (SHA-512 sized).
+#define BROKER_MEASUREMENT_MAX 64
+
+// -----------------------------------------------------------------------------
+// Broker configuration file
+//
+// Line based "key = value" format, '#' starts a comment:
+//
+//   measurement = <hex digest>     allowed measurement, may be repeated
+//   wrap_key = <key>               key served by key_broker_server
+//   secret = <payload>             default secret of secret_broker_server
+//   secret.<appId> = <payload>     secret served to clients claiming <appId>
+//   bundle = <path>                secret bundle looked up after secret.<appId>
+//   bundle_key = <path>            key file unsealing encrypted bundle entries
+//   require_app_id = true|false    refuse clients without a matching appId
+//   ip_rate, ip_burst              handshakes per second (and burst) allowed
+//                                  per source address, 0 disables
+//   app_rate, app_burst            same, per appId claim
+//   max_queue_wait_ms              drop connections queued longer than this
+//   verify_cache_ttl = <seconds>   reuse of a measurement verdict, see
+//                                  verdict_cache.h
+//   collateral_dir = <dir>         where the verifier reads HSK/CEK certs
+//   collateral_seed = <dir>        local copies loaded before any download
+//   collateral_url = <url>|off     certificate service, the chip id is appended
+//   collateral_ttl = <seconds>     refresh age of cached certificates
+//   collateral_chip = <chip id>    chip to prefetch, may be repeated
+//   cluster_node = <id> <host>:<port>  cluster member, may be repeated
+//   cluster_self = <id>            which cluster_node this broker is
+//   cluster_replicas = <k>         copies of each secret besides the primary
+//   cluster_key = <path>           key file shared by the cluster members
+//
+// The cluster_* keys are read once at startup, see cluster.h.
+//
+// A parsed file is an immutable snapshot. Readers pin the current snapshot
+// with broker_config_get()/broker_config_put() without taking any lock; a
+// reload publishes a new snapshot and frees the old one only once every
+// reader that could still see it has released it.
+// -----------------------------------------------------------------------------
+
+struct broker_measurement {
+  size_t len;
+  uint8_t digest[BROKER_MEASUREMENT_MAX];
+};
+
+struct broker_app_secret {
+  char *app_id;
+  char *secret;
+  size_t secret_len;
+};
+
+struct broker_cluster_node {
+  char *id;
+  char *address;
+};
+
+struct broker_config {
+  // digests zero-padded to BROKER_MEASUREMENT_MAX, see
+  // broker_config_has_measurement()
+  struct broker_measurement *measurements;
+  size_t measurement_count;
+  // generation of the allow-list, set by broker_config_seal(): increases
+  // with every sealed config, never 0
+  uint64_t measurement_tag;
+  // sorted by app_id, see broker_config_find_secret()
+  struct broker_app_secret *app_secrets;
+  size_t app_secret_count;
+  char *wrap_key;
+  // served when no appId mapping applies, app_id is always NULL
+  struct broker_app_secret default_secret;
+  char *bundle_path;
+  struct secret_bundle *bundle;
+  uint8_t bundle_key[SECRET_BUNDLE_KEY_SIZE];
+  bool has_bundle_key;
+  bool require_app_id;
+  double ip_rate;
+  double ip_burst;
+  double app_rate;
+  double app_burst;
+  unsigned max_queue_wait_ms;
+  unsigned verify_cache_ttl; // 0 selects the default
+  // see collateral_cache.h, NULL/0 select the defaults
+  char *collateral_dir;
+  char *collateral_seed;
+  char *collateral_url;
+  unsigned collateral_ttl;
+  char **collateral_chips;
+  size_t collateral_chip_count;
+  struct broker_cluster_node *cluster_nodes;
+  size_t cluster_node_count;
+  char *cluster_self;
+  unsigned cluster_replicas;
+  uint8_t cluster_key[SECRET_BUNDLE_KEY_SIZE];
+  bool has_cluster_key;
+};
+
+// Secret resolved for a client. data points into the snapshot (or the mapped
+// bundle) and stays valid while the snapshot is pinned; sealed entries must be
+// decrypted with broker_secret_unseal() first.
+struct broker_secret {
+  const uint8_t *data;
+  size_t len;
+  bool sealed;
+  struct secret_bundle_entry entry;
+};
+
+struct broker_config *broker_config_new(void);
+void broker_config_free(struct broker_config *cfg);
+
+// Apply one "key = value" setting, returns 0 on success and -1 on an unknown
+// key or malformed value.
+int broker_config_set(struct broker_config *cfg, const char *key,
+                      const char *value);
+
+// Sort the lookup tables of a snapshot built with broker_config_set() and tag
+// its allow-list; must be called before publishing. Returns -1 on duplicate
+// appIds.
+int broker_config_seal(struct broker_config *cfg);
+
+// Parse and seal a configuration file into a new snapshot, NULL on error.
+struct broker_config *broker_config_load(const char *path);
+
+// Same for configuration text held in memory, name is used in messages.
+struct broker_config *broker_config_parse(const char *text, size_t len,
+                                          const char *name);
+
+// Constant-time check of a measurement against the whole allow-list.
+bool broker_config_has_measurement(const struct broker_config *cfg,
+                                   const uint8_t *digest, size_t len);
+
+// Resolve the secret to serve for app_id (may be NULL): secret.<appId> first,
+// then the bundle, then the default secret unless require_app_id is set.
+// Returns -1 when nothing may be served.
+int broker_config_find_secret(const struct broker_config *cfg,
+                              const char *app_id, struct broker_secret *out);
+
+// Decrypt a sealed secret into out, which holds at least secret->len bytes.
+int broker_secret_unseal(const struct broker_config *cfg,
+                         const struct broker_secret *secret, uint8_t *out);
+
+// Pin the current snapshot. The returned pointer stays valid until the
+// matching broker_config_put(slot).
+const struct broker_config *broker_config_get(unsigned *slot);
+void broker_config_put(unsigned slot);
+
+// Atomically replace the current snapshot and free the previous one after a
+// grace period. Takes ownership of cfg.
+void broker_config_publish(struct broker_config *cfg);
+
+// Load path and publish it, keeping the current snapshot on parse errors.
+int broker_config_reload(const char *path);
+
+// Start a thread reloading path on SIGHUP or when the file is rewritten or
+// renamed into place. Must be called before any other thread is created so
+// that SIGHUP stays blocked everywhere else.
+int broker_config_start_watcher(const char *path);
+
+#endif
@@ -0,0 +1,1112 @@
+#include "broker_server.h"
+#include "admission.h"
+#include "collateral_cache.h"
+#include "conn_poller.h"
+#include "frame.h"
+#include "handle_pool.h"
+#include "hex.h"
+#include "log.h"
+#include "metrics.h"
+#include "store_admin.h"
+#include "tls_conf.h"
+#include "trace.h"
+#include "traffic_trace.h"
+#include "verdict_cache.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <rats-tls/log.h>
+
+#define DEFAULT_PORT 1234
+#define DEFAULT_IP "127.0.0.1"
+#define DEFAULT_WORKERS 4
+#define DEFAULT_MAX_PENDING 64
+#define DEFAULT_ROTATE_S 3600
+#define DEFAULT_VERIFY_CACHE 0 // see bench/verdict_bench.c
+#define MAX_WAITING 4096 // connections whose client has not spoken yet
+#define RATE_LIMITER_SIZE 4096
+#define REQUEST_MAX 256
+#define PIPELINE_MAX 32 // framed requests answered together
+#define IDLE_TIMEOUT_S 5
+#define HANDSHAKE_TIMEOUT_S 10 // per read or write, covers quote generation
+#define APP_ID_CLAIM "appId"
+
+#define COMMON_SHORT_OPTIONS "a:v:t:c:ml:i:p:Dhw:f:S:A:W:Q:M:R:T:C:"
+
+struct broker_options {
+  char *attester_type;
+  char *verifier_type;
+  char *tls_type;
+  char *crypto_type;
+  bool mutual;
+  rats_tls_log_level_t log_level;
+  char *ip;
+  int port;
+  bool debug_enclave;
+  char *white_measure;
+  char *config_path;
+  char *store_dir;
+  char *admin_socket;
+  int workers;
+  int max_pending;
+  char *metrics_socket;
+  int rotate_s;
+  char *record_path;
+  int verify_cache;
+};
+
+static const struct broker_server *server;
+
+// admission control, see serve()
+static struct conn_poller *waiting_conns;
+static struct conn_queue *pending_conns;
+static struct rate_limiter *ip_limiter;
+static struct rate_limiter *app_limiter;
+static struct verdict_cache *verdicts; // NULL without --verify-cache
+static atomic_uint_fast64_t shed_conns;
+
+// rats-tls handles, created before the socket listens, see handles_init()
+static struct handle_pool *handles;
+static atomic_bool ready;
+
+// appId claimed by the client being negotiated, set by call_back(). A
+// handshake can complete without the callback, e.g. on a resumed session:
+// client_verified tells whether it ran for this connection, both are reset
+// before each negotiation.
+static __thread char client_app_id[BROKER_APP_ID_MAX];
+static __thread bool client_verified;
+
+// --record-traffic: when each connection was accepted and spoke first,
+// indexed by fd, and the record of the connection this worker serves
+struct conn_times {
+  uint64_t accept_us;
+  uint64_t ready_us;
+};
+static struct conn_times *conn_times;
+static size_t conn_times_size;
+static __thread struct traffic_record *recording;
+
+static const char *format_hex_buffer(char *buffer, size_t max_size,
+                                     const uint8_t *data, size_t size) {
+  if (size * 2 >= max_size)
+    return "DEADBEEF";
+
+  hex_encode(buffer, data, size);
+  return buffer;
+}
+
+static bool app_allowed(const struct broker_config *cfg, const char *app_id) {
+  if (app_id[0] == '\0' ||
+      rate_limiter_allow(app_limiter, app_id, strlen(app_id), cfg->app_rate,
+                         cfg->app_burst))
+    return true;
+  RTLS_ERR("appId '%s' rate limited\n", app_id);
+  return false;
+}
+
+// Allow-list check, run by call_back() on the connection worker
+static int verify_evidence(rtls_evidence_t *ev, const char *app_id) {
+
+  // you could compare custom claims here
+  printf("verify_callback called, claims %p, claims_size %zu, args %p\n",
+         ev->custom_claims, ev->custom_claims_length, (void *)ev);
+  for (size_t i = 0; i < ev->custom_claims_length; ++i) {
+    printf("custom_claims[%zu] -> name: '%s' value_size: %zu value: '%.*s'\n",
+           i, ev->custom_claims[i].name, ev->custom_claims[i].value_size,
+           (int)ev->custom_claims[i].value_size, ev->custom_claims[i].value);
+  }
+
+  char hex_buffer[1024];
+  printf("csv_vm_measure is %s\n",
+         format_hex_buffer(hex_buffer, sizeof(hex_buffer), ev->csv.measure,
+                           ev->csv.measure_sz));
+  printf("csv_vm_id is %s\n", ev->csv.vm_id);
+  printf("csv_policy is %s\n", ev->csv.policy);
+  printf("csv_vm_version is %s\n", ev->csv.vm_version);
+
+  unsigned slot;
+  const struct broker_config *cfg = broker_config_get(&slot);
+  int verdict = 0;
+  if (!app_allowed(cfg, app_id)) {
+    // not a verdict on the measurement, nothing to cache
+  } else if (cfg->measurement_count == 0) {
+    RTLS_ERR("white measure unset\n");
+  } else {
+    if (broker_config_has_measurement(cfg, ev->csv.measure,
+                                      ev->csv.measure_sz)) {
+      RTLS_INFO("csv_vm_measure match the white_list\n");
+      verdict = -1;
+    } else {
+      RTLS_ERR("unmatch csv_vm_measure white_list\n");
+    }
+    if (verdicts != NULL)
+      verdict_cache_put(verdicts, cfg->measurement_tag, ev->csv.measure,
+                        ev->csv.measure_sz, verdict,
+                        cfg->verify_cache_ttl ? cfg->verify_cache_ttl
+                                              : VERDICT_CACHE_DEFAULT_TTL);
+  }
+  broker_config_put(slot);
+  return verdict;
+}
+
+// A measurement checked recently is decided without the allow-list scan. The
+// appId rate limit still applies. Returns false on a miss.
+static bool verify_cached(const rtls_evidence_t *ev, const char *app_id,
+                          int *verdict) {
+  if (verdicts == NULL)
+    return false;
+
+  unsigned slot;
+  const struct broker_config *cfg = broker_config_get(&slot);
+  bool hit = cfg->measurement_count > 0 &&
+             !verdict_cache_get(verdicts, cfg->measurement_tag,
+                                ev->csv.measure, ev->csv.measure_sz, verdict);
+  if (hit) {
+    RTLS_DEBUG("csv_vm_measure verdict from the cache\n");
+    if (!app_allowed(cfg, app_id))
+      *verdict = 0;
+  }
+  broker_config_put(slot);
+  return hit;
+}
+
+static int call_back(void *args) {
+  rtls_evidence_t *ev = (rtls_evidence_t *)args;
+
+  // rats-tls has checked the quote already, on this worker inside
+  // rats_tls_negotiate(); what is left is the claims and the allow-list
+  client_verified = true;
+  client_app_id[0] = '\0';
+  for (size_t i = 0; i < ev->custom_claims_length; ++i) {
+    if (!strcmp(ev->custom_claims[i].name, APP_ID_CLAIM) &&
+        ev->custom_claims[i].value_size < sizeof(client_app_id)) {
+      memcpy(client_app_id, ev->custom_claims[i].value,
+             ev->custom_claims[i].value_size);
+      client_app_id[ev->custom_claims[i].value_size] = '\0';
+    }
+  }
+
+  int verdict;
+  uint64_t start_us = recording != NULL ? traffic_trace_now_us() : 0;
+  TRACE(verify_start);
+  if (!verify_cached(ev, client_app_id, &verdict))
+    verdict = verify_evidence(ev, client_app_id);
+  TRACE(verify_end, verdict);
+  if (recording != NULL)
+    recording->verify_us = traffic_trace_now_us() - start_us;
+  return verdict;
+}
+
+struct pending_reply {
+  uint32_t request_id;
+  uint8_t type;
+  const uint8_t *data;
+  size_t len;
+  size_t off;
+};
+
+struct broker_conn {
+  rats_tls_handle handle;
+  struct arena *arena;
+  bool framed;
+  uint8_t version; // 0 until HELLO
+  uint32_t max_payload; // split replies at this, agreed in HELLO
+  uint16_t flags;       // agreed in HELLO
+  struct pending_reply replies[PIPELINE_MAX];
+  size_t reply_count;
+};
+
+// per worker, reused by every connection it serves
+struct worker {
+  rats_tls_handle handle; // taken from the pool for each connection
+  struct arena arena;
+  uint8_t *in;  // frame reader buffer
+  uint8_t *out; // one encoded frame
+};
+
+static int transmit(rats_tls_handle handle, const void *data, size_t len) {
+  TRACE(transmit, len);
+  if (recording != NULL)
+    recording->bytes_out += len;
+  rats_tls_err_t ret = rats_tls_transmit(handle, (void *)data, &len);
+  if (ret != RATS_TLS_ERR_NONE) {
+    RTLS_ERR("Failed to transmit %#x\n", ret);
+    return -1;
+  }
+  return 0;
+}
+
+static int queue_reply(struct broker_conn *conn, uint32_t request_id,
+                       uint8_t type, const void *data, size_t len) {
+  if (conn->reply_count == PIPELINE_MAX)
+    return -1;
+  // the handler's data may go away when it returns
+  uint8_t *copy = arena_alloc(conn->arena, len);
+  if (copy == NULL)
+    return -1;
+  memcpy(copy, data, len);
+  conn->replies[conn->reply_count++] =
+      (struct pending_reply){request_id, type, copy, len, 0};
+  return 0;
+}
+
+static void queue_error(struct broker_conn *conn, uint32_t request_id,
+                        const char *msg) {
+  queue_reply(conn, request_id, FRAME_ERROR, msg, strlen(msg));
+}
+
+int broker_reply(struct broker_request *req, const void *data, size_t len) {
+  if (!req->conn->framed)
+    return transmit(req->handle, data, len);
+  return queue_reply(req->conn, req->request_id, FRAME_REPLY, data, len);
+}
+
+// Send everything queued, one piece of each reply per round so that short
+// replies complete before long ones.
+static int flush_replies(struct broker_conn *conn, uint8_t *out) {
+  while (conn->reply_count > 0) {
+    for (size_t i = 0; i < conn->reply_count;) {
+      struct pending_reply *p = &conn->replies[i];
+      size_t prefix = p->type == FRAME_REPLY && p->off == 0 &&
+                              (conn->flags & FRAME_FLAG_SIZED)
+                          ? FRAME_SIZE_PREFIX
+                          : 0;
+      size_t n = p->len - p->off;
+      if (n > conn->max_payload - prefix)
+        n = conn->max_payload - prefix;
+      bool last = p->off + n == p->len;
+
+      // errors before HELLO go out in the oldest version
+      uint8_t version = conn->version ? conn->version : FRAME_VERSION_MIN;
+      uint16_t flags = (last ? 0 : FRAME_FLAG_MORE) |
+                       (prefix ? FRAME_FLAG_SIZED : 0);
+      struct frame_header h = {version, p->type, flags, p->request_id,
+                               prefix + n};
+      frame_encode_header(out, &h);
+      if (prefix)
+        frame_encode_size(out + FRAME_HEADER_SIZE, p->len);
+      size_t head = FRAME_HEADER_SIZE + prefix;
+      if (prefix + n <= FRAME_PAYLOAD_MAX) {
+        // one transmit, the header does not get a record of its own
+        memcpy(out + head, p->data + p->off, n);
+        if (transmit(conn->handle, out, head + n))
+          return -1;
+      } else if (transmit(conn->handle, out, head) ||
+                 transmit(conn->handle, p->data + p->off, n)) {
+        return -1;
+      }
+      p->off += n;
+
+      if (last) {
+        conn->reply_count--;
+        memmove(p, p + 1, (conn->reply_count - i) * sizeof(*p));
+      } else {
+        i++;
+      }
+    }
+  }
+  return 0;
+}
+
+static void dispatch(struct broker_conn *conn, uint32_t request_id,
+                     const uint8_t *command, size_t len) {
+  char *name = arena_alloc(conn->arena, len + 1);
+  if (name == NULL)
+    return;
+  memcpy(name, command, len);
+  name[len] = '\0';
+
+  RTLS_INFO("Client: %s\n", name);
+  if (recording != NULL)
+    recording->requests++;
+
+  for (const struct broker_handler *h = server->handlers; h->command != NULL;
+       h++) {
+    if (!strcmp(name, h->command)) {
+      // no per-app lookup for a client whose claims were not verified
+      const char *app_id = client_verified ? client_app_id : "";
+      struct broker_request req = {conn->handle, name,       app_id,
+                                   conn->arena,  request_id, conn};
+      if (recording != NULL && recording->command[0] == '\0')
+        snprintf(recording->command, sizeof(recording->command), "%s",
+                 h->command);
+      size_t queued = conn->reply_count;
+      TRACE(request_start, request_id, name);
+      h->serve(&req);
+      bool unanswered = conn->framed && conn->reply_count == queued;
+      TRACE(request_end, request_id, unanswered);
+      if (unanswered)
+        queue_error(conn, request_id, "request failed");
+      return;
+    }
+  }
+  RTLS_ERR("unknow command");
+  if (conn->framed)
+    queue_error(conn, request_id, "unknown command");
+}
+
+// Returns -1 once the session is over.
+static int handle_frame(struct broker_conn *conn, const struct frame_header *h,
+                        const uint8_t *payload) {
+  if (h->type == FRAME_HELLO) {
+    uint8_t min_version, max_version, hello[FRAME_HELLO_SIZE];
+    uint16_t flags;
+    uint32_t max_payload;
+    if (conn->version != 0 ||
+        frame_decode_hello(payload, h->length, &min_version, &max_version,
+                           &flags, &max_payload) ||
+        min_version > FRAME_VERSION_MAX || max_version < FRAME_VERSION_MIN) {
+      queue_error(conn, h->request_id, "no common protocol version");
+      return -1;
+    }
+    conn->version =
+        max_version < FRAME_VERSION_MAX ? max_version : FRAME_VERSION_MAX;
+    conn->max_payload =
+        max_payload < FRAME_BATCH_MAX ? max_payload : FRAME_BATCH_MAX;
+    // of the payload encodings, only the size prefix is implemented
+    conn->flags = flags & FRAME_FLAG_SIZED;
+    frame_encode_hello(hello, conn->version, conn->version, conn->flags,
+                       conn->max_payload);
+    queue_reply(conn, h->request_id, FRAME_HELLO, hello, sizeof(hello));
+    return 0;
+  }
+
+  if (conn->version == 0) {
+    queue_error(conn, h->request_id, "HELLO expected");
+    return -1;
+  }
+  switch (h->type) {
+  case FRAME_REQUEST:
+    if (h->flags != 0)
+      queue_error(conn, h->request_id, "unsupported request flags");
+    else
+      dispatch(conn, h->request_id, payload, h->length);
+    return 0;
+  case FRAME_BYE:
+    return -1;
+  default:
+    queue_error(conn, h->request_id, "unexpected frame");
+    return 0;
+  }
+}
+
+static int receive(void *ctx, void *buf, size_t *len) {
+  rats_tls_err_t ret = rats_tls_receive(ctx, buf, len);
+  if (ret != RATS_TLS_ERR_NONE) {
+    RTLS_DEBUG("Failed to receive %#x\n", ret);
+    return -1;
+  }
+  TRACE(receive, *len);
+  if (recording != NULL)
+    recording->bytes_in += *len;
+  return 0;
+}
+
+static void serve_framed(struct worker *w, struct broker_conn *conn,
+                         struct frame_reader *reader) {
+  for (;;) {
+    struct frame_header h;
+    const uint8_t *payload;
+    if (frame_read(reader, &h, &payload) <= 0)
+      return;
+
+    // what the client sent together is answered together
+    bool done = false;
+    for (;;) {
+      done = handle_frame(conn, &h, payload) != 0;
+      if (done || conn->reply_count == PIPELINE_MAX || !frame_buffered(reader))
+        break;
+      frame_read(reader, &h, &payload);
+    }
+    if (flush_replies(conn, w->out) || done)
+      return;
+    arena_reset(&w->arena);
+  }
+}
+
+// Serve one attested client on the worker's handle
+static void serve_client(struct worker *w, int connd) {
+  uint64_t start_us = recording != NULL ? traffic_trace_now_us() : 0;
+  // nothing from the previous connection on this worker, see client_verified
+  client_app_id[0] = '\0';
+  client_verified = false;
+  // the poller hands the connection over on its first byte: a client that
+  // stops after it must not hold the worker. The same bound applies to a
+  // bare command after the handshake
+  struct timeval timeout = {HANDSHAKE_TIMEOUT_S, 0};
+  setsockopt(connd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(connd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  TRACE(negotiate_start, connd);
+  rats_tls_err_t ret = rats_tls_negotiate(w->handle, connd);
+  TRACE(negotiate_end, connd, ret);
+  if (recording != NULL) {
+    recording->negotiate_us = traffic_trace_now_us() - start_us;
+    snprintf(recording->app_id, sizeof(recording->app_id), "%s",
+             client_app_id);
+  }
+  if (ret != RATS_TLS_ERR_NONE) {
+    RTLS_ERR("Failed to negotiate %#x\n", ret);
+    if (recording != NULL)
+      recording->outcome = TRAFFIC_NEGOTIATE_FAILED;
+    return;
+  }
+
+  RTLS_DEBUG("Client connected successfully\n");
+
+  struct broker_conn conn = {.handle = w->handle,
+                             .arena = &w->arena,
+                             .max_payload = FRAME_PAYLOAD_MAX};
+  struct frame_reader reader;
+  frame_reader_init(&reader, w->in, receive, w->handle);
+  if (frame_reader_fill(&reader) <= 0) {
+    RTLS_ERR("Failed to receive\n");
+    return;
+  }
+
+  if (frame_is_framed(reader.buf, reader.end)) {
+    // a framed session may stay open for more requests, don't let an idle
+    // one hold the worker
+    timeout.tv_sec = IDLE_TIMEOUT_S;
+    setsockopt(connd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    conn.framed = true;
+    serve_framed(w, &conn, &reader);
+    return;
+  }
+
+  // bare command, as sent before framing
+  size_t len = reader.end < REQUEST_MAX ? reader.end : REQUEST_MAX - 1;
+  dispatch(&conn, 0, reader.buf, strnlen((char *)reader.buf, len));
+}
+
+static void *worker_main(void *arg) {
+  struct worker w;
+
+  w.in = secure_alloc(FRAME_READER_BUFFER);
+  w.out = secure_alloc(FRAME_HEADER_SIZE + FRAME_PAYLOAD_MAX);
+  if (w.in == NULL || w.out == NULL ||
+      arena_init(&w.arena, ARENA_DEFAULT_SIZE)) {
+    RTLS_ERR("Failed to allocate worker buffers\n");
+    exit(1);
+  }
+
+  while (1) {
+    uint64_t waited_ms;
+    int connd = conn_queue_pop(pending_conns, &waited_ms);
+
+    struct traffic_record rec;
+    uint64_t served_us = 0;
+    if (conn_times != NULL && (size_t)connd < conn_times_size) {
+      const struct conn_times *t = &conn_times[connd];
+      memset(&rec, 0, sizeof(rec));
+      rec.accept_us = t->accept_us;
+      rec.wait_us = t->ready_us - t->accept_us;
+      rec.queue_us = traffic_trace_now_us() - t->ready_us;
+      recording = &rec;
+    }
+
+    unsigned slot;
+    unsigned max_wait_ms = broker_config_get(&slot)->max_queue_wait_ms;
+    broker_config_put(slot);
+    // the client has likely given up, don't spend a handshake on it
+    if (max_wait_ms != 0 && waited_ms > max_wait_ms) {
+      RTLS_WARN("dropping connection queued for %lu ms\n",
+                (unsigned long)waited_ms);
+      close(connd);
+      if (recording != NULL)
+        rec.outcome = TRAFFIC_DROPPED;
+    } else {
+      unsigned slot_taken;
+      w.handle = handle_pool_take(handles, &slot_taken);
+      serve_client(&w, connd);
+      close(connd);
+      handle_pool_give(handles, slot_taken);
+      arena_reset(&w.arena);
+      served_us = traffic_trace_now_us();
+    }
+
+    if (recording != NULL) {
+      if (rec.outcome == TRAFFIC_SERVED)
+        rec.serve_us = served_us - rec.accept_us - rec.wait_us - rec.queue_us -
+                       rec.negotiate_us;
+      traffic_trace_write(&rec);
+      recording = NULL;
+    }
+  }
+  return NULL;
+}
+
+static uint64_t read_pending_conns(void *arg) {
+  return conn_queue_depth(pending_conns);
+}
+
+static uint64_t read_waiting_conns(void *arg) {
+  return conn_poller_count(waiting_conns);
+}
+
+static uint64_t read_silent_conns(void *arg) {
+  return conn_poller_timeouts(waiting_conns);
+}
+
+static uint64_t read_verdict_hits(void *arg) {
+  return verdict_cache_hits(verdicts);
+}
+
+static uint64_t read_verdict_misses(void *arg) {
+  return verdict_cache_misses(verdicts);
+}
+
+static uint64_t read_verdict_evictions(void *arg) {
+  return verdict_cache_evictions(verdicts);
+}
+
+static uint64_t read_verdict_entries(void *arg) {
+  return verdict_cache_entries(verdicts);
+}
+
+static uint64_t read_verdict_bytes(void *arg) {
+  return verdict_cache_bytes(verdicts);
+}
+
+static uint64_t read_shed_conns(void *arg) { return atomic_load(&shed_conns); }
+
+static uint64_t read_collateral_chips(void *arg) {
+  return collateral_cache_count();
+}
+
+static uint64_t read_collateral_failures(void *arg) {
+  return collateral_cache_failures();
+}
+
+static uint64_t read_secure_in_use(void *arg) { return secure_in_use(); }
+
+static uint64_t read_secure_lock_failures(void *arg) {
+  return secure_lock_failures();
+}
+
+static uint64_t read_ready(void *arg) { return atomic_load(&ready); }
+
+static uint64_t read_idle_handles(void *arg) {
+  return handle_pool_idle(handles);
+}
+
+static uint64_t read_handle_rotations(void *arg) {
+  return handle_pool_rotations(handles);
+}
+
+static uint64_t read_handle_failures(void *arg) {
+  return handle_pool_failures(handles);
+}
+
+// Metric names are prefixed with the broker name and live as long as the
+// process.
+static void register_metric(const char *suffix, const char *type,
+                            const char *help, metric_read_fn read) {
+  char *name = malloc(strlen(server->name) + strlen(suffix) + 2);
+  if (name == NULL)
+    return;
+  sprintf(name, "%s_%s", server->name, suffix);
+  if (metrics_register(name, type, help, read, NULL))
+    free(name);
+}
+
+// --record-traffic: a connection closed before a worker got it is an
+// arrival all the same
+static void record_unserved(int connd, enum traffic_outcome outcome) {
+  if (conn_times == NULL || (size_t)connd >= conn_times_size)
+    return;
+  struct traffic_record rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.accept_us = conn_times[connd].accept_us;
+  rec.wait_us = traffic_trace_now_us() - rec.accept_us;
+  rec.outcome = outcome;
+  traffic_trace_write(&rec);
+}
+
+// A client has spoken, hand its connection to a worker
+static void queue_ready(int connd, void *arg) {
+  if (conn_times != NULL && (size_t)connd < conn_times_size)
+    conn_times[connd].ready_us = traffic_trace_now_us();
+  if (conn_queue_push(pending_conns, connd)) {
+    RTLS_WARN("all workers busy and queue full, shedding a connection\n");
+    atomic_fetch_add(&shed_conns, 1);
+    record_unserved(connd, TRAFFIC_SHED);
+    close(connd);
+  }
+}
+
+static void record_silent(int connd, void *arg) {
+  record_unserved(connd, TRAFFIC_SILENT);
+}
+
+static int admission_init(const struct broker_options *opts) {
+  waiting_conns =
+      conn_poller_new(MAX_WAITING, IDLE_TIMEOUT_S * 1000, queue_ready,
+                      conn_times != NULL ? record_silent : NULL, NULL);
+  pending_conns = conn_queue_new(opts->max_pending);
+  ip_limiter = rate_limiter_new(RATE_LIMITER_SIZE);
+  app_limiter = rate_limiter_new(RATE_LIMITER_SIZE);
+  if (waiting_conns == NULL || pending_conns == NULL || ip_limiter == NULL ||
+      app_limiter == NULL) {
+    RTLS_ERR("Failed to allocate admission control\n");
+    return -1;
+  }
+  if (opts->verify_cache > 0) {
+    verdicts = verdict_cache_new(opts->verify_cache);
+    if (verdicts == NULL)
+      return -1;
+  }
+
+  if (opts->metrics_socket == NULL)
+    return 0;
+  register_metric("waiting_connections", "gauge",
+                  "Accepted connections whose client has not sent anything "
+                  "yet",
+                  read_waiting_conns);
+  register_metric("silent_connections_total", "counter",
+                  "Connections closed because the client sent nothing in "
+                  "time",
+                  read_silent_conns);
+  register_metric("pending_connections", "gauge",
+                  "Accepted connections waiting for a worker",
+                  read_pending_conns);
+  if (verdicts != NULL) {
+    register_metric("verify_cache_hits_total", "counter",
+                    "Measurements decided from the verdict cache",
+                    read_verdict_hits);
+    register_metric("verify_cache_misses_total", "counter",
+                    "Measurements not in the verdict cache", read_verdict_misses);
+    register_metric("verify_cache_evictions_total", "counter",
+                    "Live verdicts overwritten for lack of room",
+                    read_verdict_evictions);
+    register_metric("verify_cache_entries", "gauge",
+                    "Live verdicts in the cache", read_verdict_entries);
+    register_metric("verify_cache_bytes", "gauge",
+                    "Memory held by the verdict cache",
+                    read_verdict_bytes);
+  }
+  register_metric("shed_connections_total", "counter",
+                  "Connections closed by rate limiting or a full pending "
+                  "queue",
+                  read_shed_conns);
+  register_metric("collateral_chips", "gauge",
+                  "Chips whose attestation collateral is cached",
+                  read_collateral_chips);
+  register_metric("collateral_fetch_failures_total", "counter",
+                  "Collateral refreshes that failed, the cached copy was kept",
+                  read_collateral_failures);
+  register_metric("secure_memory_bytes", "gauge",
+                  "Secret and scratch bytes held in locked memory",
+                  read_secure_in_use);
+  register_metric("secure_lock_failures_total", "counter",
+                  "Secure memory regions that could not be locked",
+                  read_secure_lock_failures);
+  register_metric("ready", "gauge",
+                  "1 once the rats-tls handles are initialized and the "
+                  "broker accepts connections",
+                  read_ready);
+  register_metric("idle_handles", "gauge",
+                  "Initialized rats-tls handles waiting for a connection",
+                  read_idle_handles);
+  register_metric("handle_rotations_total", "counter",
+                  "rats-tls handles renewed with a fresh certificate",
+                  read_handle_rotations);
+  register_metric("handle_failures_total", "counter",
+                  "rats-tls handles that could not be renewed",
+                  read_handle_failures);
+  return metrics_start(opts->metrics_socket);
+}
+
+// Connections are tracked by fd, which the kernel keeps below the open file
+// limit
+static int traffic_init(const char *path) {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) || limit.rlim_cur == RLIM_INFINITY ||
+      limit.rlim_cur > (1 << 20))
+    limit.rlim_cur = 1 << 20;
+  conn_times = calloc(limit.rlim_cur, sizeof(struct conn_times));
+  if (conn_times == NULL) {
+    RTLS_ERR("Failed to allocate the traffic recorder\n");
+    return -1;
+  }
+  conn_times_size = limit.rlim_cur;
+  if (traffic_trace_open(path))
+    return -1;
+  RTLS_INFO("Recording traffic to %s\n", path);
+  return 0;
+}
+
+// One handle per worker and a spare, so that a worker finds a ready handle
+// while another one is renewed. Clients connect only once they are all
+// created: the socket listens after this.
+static int handles_init(const struct broker_options *opts) {
+  static rats_tls_conf_t conf;
+
+  if (tls_conf_init(&conf, opts->log_level, opts->attester_type,
+                    opts->verifier_type, opts->tls_type, opts->crypto_type,
+                    opts->mutual, true))
+    return -1;
+
+  uint64_t start_ms = monotonic_ms();
+  handles = handle_pool_new(&conf, opts->workers + 1, opts->rotate_s,
+                            call_back);
+  if (handles == NULL)
+    return -1;
+  RTLS_INFO("%d rats-tls handles ready in %lu ms\n", opts->workers + 1,
+            (unsigned long)(monotonic_ms() - start_ms));
+  return 0;
+}
+
+static int serve(const struct broker_options *opts) {
+  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  if (sockfd < 0) {
+    RTLS_ERR("Failed to call socket()");
+    return -1;
+  }
+
+  int reuse = 1;
+  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (const void *)&reuse,
+                 sizeof(int)) < 0) {
+    RTLS_ERR("Failed to call setsockopt()");
+    return -1;
+  }
+
+  struct sockaddr_in s_addr;
+  memset(&s_addr, 0, sizeof(s_addr));
+  s_addr.sin_family = AF_INET;
+  s_addr.sin_addr.s_addr = inet_addr(opts->ip);
+  s_addr.sin_port = htons(opts->port);
+
+  // Bind the server socket
+  if (bind(sockfd, (struct sockaddr *)&s_addr, sizeof(s_addr)) == -1) {
+    RTLS_ERR("Failed to call bind()");
+    return -1;
+  }
+
+  // Listen for a new connection. The accept loop only hands connections to
+  // the poller, but a boot storm arrives faster than that: a short backlog
+  // overflows into SYN cookies, which can lose a client's first bytes.
+  if (listen(sockfd, SOMAXCONN) == -1) {
+    RTLS_ERR("Failed to call listen()");
+    return -1;
+  }
+
+  // Each worker serves one client at a time
+  for (int i = 0; i < opts->workers; i++) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, worker_main, NULL) != 0) {
+      RTLS_ERR("Failed to start worker thread\n");
+      return -1;
+    }
+    pthread_detach(tid);
+  }
+
+  atomic_store(&ready, true);
+  RTLS_INFO("Waiting for a connection ...\n");
+  while (1) {
+    // Accept client connections
+    struct sockaddr_in c_addr;
+    socklen_t size = sizeof(c_addr);
+
+    int connd = accept(sockfd, (struct sockaddr *)&c_addr, &size);
+    if (connd < 0) {
+      RTLS_ERR("Failed to call accept()");
+      continue;
+    }
+    TRACE(accept, connd);
+    if (conn_times != NULL && (size_t)connd < conn_times_size)
+      conn_times[connd].accept_us = traffic_trace_now_us();
+
+    // Refuse early, before any handshake work is spent on the client
+    unsigned slot;
+    const struct broker_config *cfg = broker_config_get(&slot);
+    bool allowed =
+        rate_limiter_allow(ip_limiter, &c_addr.sin_addr,
+                           sizeof(c_addr.sin_addr), cfg->ip_rate, cfg->ip_burst);
+    broker_config_put(slot);
+    if (!allowed) {
+      RTLS_DEBUG("rate limited %s\n", inet_ntoa(c_addr.sin_addr));
+      atomic_fetch_add(&shed_conns, 1);
+      record_unserved(connd, TRAFFIC_SHED);
+      close(connd);
+      continue;
+    }
+    // workers only see it once the ClientHello is there, see queue_ready()
+    if (conn_poller_add(waiting_conns, connd)) {
+      RTLS_WARN("too many connections waiting for their client, shedding "
+                "%s\n",
+                inet_ntoa(c_addr.sin_addr));
+      atomic_fetch_add(&shed_conns, 1);
+      record_unserved(connd, TRAFFIC_SHED);
+      close(connd);
+      continue;
+    }
+  }
+  return 0;
+}
+
+static void usage(void) {
+  printf("    Usage:\n\n"
+         "        rats-tls-server <options> [arguments]\n\n"
+         "    Options:\n\n"
+         "        --attester/-a value   set the type of quote attester\n"
+         "        --verifier/-v value   set the type of quote verifier\n"
+         "        --tls/-t value        set the type of tls wrapper\n"
+         "        --crypto/-c value     set the type of crypto wrapper\n"
+         "        --mutual/-m           set to enable mutual attestation\n"
+         "        --log-level/-l        set the log level\n"
+         "        --ip/-i               set the listening ip address\n"
+         "        --port/-p             set the listening tcp port\n"
+         "        --debug-enclave/-D    set to enable enclave debugging\n"
+         "        --help/-h             show the usage\n"
+         "        --white-measure/-w    set the white measure hash hex\n"
+         "        --config/-f           load measurements and %s from a\n"
+         "                              config file, reloaded on SIGHUP/change\n"
+         "        --store/-S            persist provisioned %s in this "
+         "directory\n"
+         "        --admin-socket/-A     provisioning socket of the store\n"
+         "        --workers/-W          number of concurrent handshakes\n"
+         "        --max-pending/-Q      connections queued for a worker before "
+         "shedding\n"
+         "        --metrics-socket/-M   serve queue depths and counters on this "
+         "socket\n"
+         "        --rotate-cert/-R      renew each rats-tls handle and its "
+         "certificate\n"
+         "                              after this many seconds, 0 never "
+         "(default %d)\n"
+         "        --record-traffic/-T   record arrivals, appIds, sizes and "
+         "latencies\n"
+         "                              of connections to this file, for "
+         "traffic_replay\n"
+         "        --verify-cache/-C     measurement verdicts to cache, only "
+         "worth it\n"
+         "                              for long allow-lists, 0 disables the "
+         "cache\n"
+         "                              (default %d)\n"
+         "%s\n",
+         server->config_help, server->store_help, DEFAULT_ROTATE_S,
+         DEFAULT_VERIFY_CACHE,
+         server->extra_usage != NULL ? server->extra_usage : "");
+}
+
+static int parse_options(int argc, char **argv, struct broker_options *opts) {
+  // clang-format off
+  static const struct option common_options[] = {
+    { "attester", required_argument, NULL, 'a' },
+    { "verifier", required_argument, NULL, 'v' },
+    { "tls", required_argument, NULL, 't' },
+    { "crypto", required_argument, NULL, 'c' },
+    { "mutual", no_argument, NULL, 'm' },
+    { "log-level", required_argument, NULL, 'l' },
+    { "ip", required_argument, NULL, 'i' },
+    { "port", required_argument, NULL, 'p' },
+    { "debug-enclave", no_argument, NULL, 'D' },
+    { "white-measure", required_argument, NULL, 'w' },
+    { "config", required_argument, NULL, 'f' },
+    { "store", required_argument, NULL, 'S' },
+    { "admin-socket", required_argument, NULL, 'A' },
+    { "workers", required_argument, NULL, 'W' },
+    { "max-pending", required_argument, NULL, 'Q' },
+    { "metrics-socket", required_argument, NULL, 'M' },
+    { "rotate-cert", required_argument, NULL, 'R' },
+    { "record-traffic", required_argument, NULL, 'T' },
+    { "verify-cache", required_argument, NULL, 'C' },
+    { "help", no_argument, NULL, 'h' },
+  };
+  // clang-format on
+  size_t common_count = sizeof(common_options) / sizeof(common_options[0]);
+  size_t extra_count = 0;
+  while (server->extra_options != NULL &&
+         server->extra_options[extra_count].name != NULL)
+    extra_count++;
+
+  char short_options[128];
+  if (snprintf(short_options, sizeof(short_options), "%s%s",
+               COMMON_SHORT_OPTIONS,
+               server->extra_short_options != NULL
+                   ? server->extra_short_options
+                   : "") >= (int)sizeof(short_options))
+    return -1;
+  struct option *long_options =
+      calloc(common_count + extra_count + 1, sizeof(struct option));
+  if (long_options == NULL)
+    return -1;
+  memcpy(long_options, common_options, sizeof(common_options));
+  if (extra_count > 0)
+    memcpy(long_options + common_count, server->extra_options,
+           extra_count * sizeof(struct option));
+
+  int opt;
+  do {
+    opt = getopt_long(argc, argv, short_options, long_options, NULL);
+    switch (opt) {
+    case 'a':
+      opts->attester_type = optarg;
+      break;
+    case 'v':
+      opts->verifier_type = optarg;
+      break;
+    case 't':
+      opts->tls_type = optarg;
+      break;
+    case 'c':
+      opts->crypto_type = optarg;
+      break;
+    case 'm':
+      opts->mutual = true;
+      break;
+    case 'l': {
+      int level = log_level_parse(optarg);
+      if (level >= 0)
+        opts->log_level = level;
+      break;
+    }
+    case 'i':
+      opts->ip = optarg;
+      break;
+    case 'p':
+      opts->port = atoi(optarg);
+      break;
+    case 'D':
+      opts->debug_enclave = true;
+      break;
+    case 'w':
+      opts->white_measure = optarg;
+      break;
+    case 'f':
+      opts->config_path = optarg;
+      break;
+    case 'S':
+      opts->store_dir = optarg;
+      break;
+    case 'A':
+      opts->admin_socket = optarg;
+      break;
+    case 'W':
+      opts->workers = atoi(optarg);
+      break;
+    case 'Q':
+      opts->max_pending = atoi(optarg);
+      break;
+    case 'M':
+      opts->metrics_socket = optarg;
+      break;
+    case 'R':
+      opts->rotate_s = atoi(optarg);
+      break;
+    case 'T':
+      opts->record_path = optarg;
+      break;
+    case 'C':
+      opts->verify_cache = atoi(optarg);
+      break;
+    case -1:
+      break;
+    case 'h':
+      usage();
+      exit(1);
+    default:
+      if (opt == '?' || server->parse_option == NULL)
+        exit(1);
+      server->parse_option(opt, optarg);
+      break;
+    }
+  } while (opt != -1);
+
+  free(long_options);
+  return 0;
+}
+
+int broker_server_main(const struct broker_server *srv, int argc,
+                       char **argv) {
+  printf("    - Welcome to RATS-TLS sample server program\n");
+  server = srv;
+
+  struct broker_options opts = {
+      .attester_type = "",
+      .verifier_type = "",
+      .tls_type = "",
+      .crypto_type = "",
+      .log_level = RATS_TLS_LOG_LEVEL_INFO,
+      .ip = DEFAULT_IP,
+      .port = DEFAULT_PORT,
+      .white_measure = "",
+      .workers = DEFAULT_WORKERS,
+      .max_pending = DEFAULT_MAX_PENDING,
+      .rotate_s = DEFAULT_ROTATE_S,
+      .verify_cache = DEFAULT_VERIFY_CACHE,
+  };
+  if (parse_options(argc, argv, &opts))
+    return -1;
+
+  global_log_level = opts.log_level;
+  app_log_level = opts.log_level;
+
+  if (opts.workers <= 0 || opts.max_pending <= 0) {
+    RTLS_ERR("workers and max-pending must be positive\n");
+    return -1;
+  }
+  if (opts.rotate_s < 0 || opts.verify_cache < 0) {
+    RTLS_ERR("rotate-cert and verify-cache must not be negative\n");
+    return -1;
+  }
+
+  struct broker_config *cfg;
+  if (opts.config_path != NULL) {
+    cfg = broker_config_load(opts.config_path);
+    if (cfg == NULL)
+      return -1;
+    if (broker_config_start_watcher(opts.config_path))
+      return -1;
+  } else {
+    cfg = broker_config_new();
+    if (cfg == NULL ||
+        (server->default_config != NULL && server->default_config(cfg)))
+      return -1;
+    if (strlen(opts.white_measure) &&
+        broker_config_set(cfg, "measurement", opts.white_measure))
+      return -1;
+    broker_config_seal(cfg);
+  }
+  broker_config_publish(cfg);
+
+  // keep verifier collateral local so that handshakes don't download it
+  if (collateral_cache_start())
+    return -1;
+
+  struct secret_store *store = NULL;
+  if (opts.store_dir != NULL) {
+    store = secret_store_open(opts.store_dir);
+    if (store == NULL)
+      return -1;
+  }
+  if (server->start != NULL) {
+    if (server->start(store, opts.admin_socket))
+      return -1;
+  } else if (store != NULL && opts.admin_socket != NULL &&
+             store_admin_start(store, NULL, opts.admin_socket)) {
+    return -1;
+  }
+
+  // keep secret scratch memory out of swap, wiped when released
+  if (secure_pool_init(SECURE_POOL_DEFAULT_SIZE))
+    RTLS_WARN("Failed to map the secure memory pool\n");
+  else if (secure_lock_failures() > 0)
+    RTLS_WARN("Secure memory pool is not locked, raise RLIMIT_MEMLOCK\n");
+
+  if (opts.record_path != NULL && traffic_init(opts.record_path))
+    return -1;
+
+  if (handles_init(&opts) || admission_init(&opts))
+    return -1;
+
+  return serve(&opts);
+}
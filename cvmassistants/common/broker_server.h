@@ -0,0 +1,79 @@
+#ifndef CONKER_BROKER_SERVER_H
+#define CONKER_BROKER_SERVER_H
+
+#include <getopt.h>
+#include <stddef.h>
+#include <rats-tls/api.h>
+
+#include "broker_config.h"
+#include "secret_store.h"
+#include "secure_mem.h"
+
+// -----------------------------------------------------------------------------
+// Server engine shared by the brokers.
+//
+// broker_server_main() parses the common command line, publishes the
+// configuration, starts the collateral cache, the store and its admin socket,
+// admission control and metrics, then accepts attested clients on a pool of
+// workers. Clients speak the framed protocol of frame.h, or send one bare
+// command; the handler registered for a command answers it through
+// broker_reply().
+//
+// A broker only supplies its handlers and, when it needs them, extra options
+// and a start hook. Everything else (threading, verification, rate limiting,
+// memory for secrets) lives here, once.
+// -----------------------------------------------------------------------------
+
+#define BROKER_APP_ID_MAX 256
+
+struct broker_conn;
+
+struct broker_request {
+  rats_tls_handle handle;
+  const char *command;
+  const char *app_id;  // verified appId claim of the client, "" when none
+  struct arena *arena; // scratch memory, wiped once the reply is sent
+  uint32_t request_id; // 0 for a bare command
+  struct broker_conn *conn;
+};
+
+struct broker_handler {
+  const char *command;
+  void (*serve)(struct broker_request *req);
+};
+
+struct broker_server {
+  const char *name; // prefix of the metrics, e.g. "key_broker"
+  const struct broker_handler *handlers; // ended by an entry without command
+
+  // tail of the --config and --store usage lines, what they hold
+  const char *config_help;
+  const char *store_help;
+
+  // broker specific options, appended to the common ones; extra_options is
+  // ended by a zeroed entry and parse_option() gets their values
+  const char *extra_short_options;
+  const struct option *extra_options;
+  const char *extra_usage;
+  void (*parse_option)(int opt, char *arg);
+
+  // Called on the configuration built from the command line when there is
+  // no --config file, to add the broker's defaults. Returns -1 on error.
+  int (*default_config)(struct broker_config *cfg);
+
+  // Called once the configuration is published, with the store (NULL
+  // without --store) and the --admin-socket path. Returns -1 to abort
+  // startup. Without a hook the admin socket is served for the store alone.
+  int (*start)(struct secret_store *store, const char *admin_socket);
+};
+
+// Answer req with len bytes. A framed reply is copied and sent once the
+// handler returns, a bare one is sent right away. A request the handler does
+// not answer gets an error frame, or nothing when bare. Returns 0 on success.
+int broker_reply(struct broker_request *req, const void *data, size_t len);
+
+// Run the broker, only returns on startup errors.
+int broker_server_main(const struct broker_server *server, int argc,
+                       char **argv);
+
+#endif
@@ -0,0 +1,863 @@
+#include "cluster.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <rats-tls/api.h>
+#include <rats-tls/log.h>
+
+#define SESSION_NONCE_SIZE 16 // sent by each side
+#define SESSION_ID_SIZE (2 * SESSION_NONCE_SIZE)
+#define NONCE_SIZE 12
+#define TAG_SIZE 16
+#define AAD_SIZE (SESSION_ID_SIZE + 8 + 1)
+#define RECORD_OVERHEAD (NONCE_SIZE + TAG_SIZE)
+#define PLAIN_HEADER_SIZE (1 + 1 + 2 + 4)
+#define PEER_TIMEOUT_S 5
+#define PEER_CONNS_MAX 128 // accepted peer connections served at once
+#define RETRY_MAX_S 30
+
+enum cluster_op {
+  OP_PUT = 1, // replica write, stored locally only
+  OP_DELETE,
+  OP_FORWARD_PUT, // write received by a non-owner, stored and replicated
+  OP_FORWARD_DELETE,
+  OP_GET,
+  OP_OK = 0x80,
+  OP_NOT_FOUND,
+  OP_ERROR,
+};
+
+struct node {
+  char *id;
+  char *host;
+  char *port;
+};
+
+struct vnode {
+  uint64_t hash;
+  size_t node;
+};
+
+struct repl_op {
+  uint8_t op;
+  char *key;
+  uint8_t *value;
+  size_t len;
+  struct repl_op *next;
+};
+
+struct peer {
+  struct cluster *cluster;
+  size_t node;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  struct repl_op *head;
+  struct repl_op *tail;
+  size_t depth;
+};
+
+// one end of an authenticated peer connection
+struct channel {
+  int fd;
+  const uint8_t *key;
+  uint8_t session[SESSION_ID_SIZE]; // listener's nonce, then connector's
+  uint64_t sent;     // records sealed, two per frame
+  uint64_t received; // records opened
+  bool listener;
+};
+
+struct frame {
+  uint8_t op;
+  uint8_t for_op; // in a reply, the op of the request it answers
+  char key[SECRET_STORE_KEY_MAX + 1];
+  const uint8_t *value;
+  size_t value_len;
+  uint8_t *plain; // owns value
+  size_t plain_len;
+};
+
+struct cluster {
+  struct secret_store *store;
+  struct node *nodes;
+  size_t node_count;
+  size_t self;
+  unsigned replicas;
+  uint8_t key[SECRET_BUNDLE_KEY_SIZE];
+  struct vnode *ring;
+  size_t ring_len;
+  struct peer *peers; // indexed like nodes, peers[self] is unused
+  int listen_fd;
+  atomic_uint_fast64_t backlog;
+  atomic_uint_fast64_t dropped;
+  atomic_uint peer_conns;
+};
+
+struct peer_conn {
+  struct cluster *cluster;
+  int fd;
+};
+
+static uint64_t hash_bytes(const void *data, size_t len) {
+  const uint8_t *p = data;
+  uint64_t h = 1469598103934665603ull; // FNV-1a
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ p[i]) * 1099511628211ull;
+  // FNV alone clusters similar keys, finish with a splitmix64 round
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ull;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebull;
+  return h ^ (h >> 31);
+}
+
+static int compare_vnodes(const void *a, const void *b) {
+  const struct vnode *va = a;
+  const struct vnode *vb = b;
+  if (va->hash != vb->hash)
+    return va->hash < vb->hash ? -1 : 1;
+  return va->node < vb->node ? -1 : va->node > vb->node;
+}
+
+// Owners of key in preference order, returns how many were found.
+static size_t find_owners(const struct cluster *c, const char *key,
+                          size_t owners[CLUSTER_REPLICAS_MAX + 1]) {
+  uint64_t h = hash_bytes(key, strlen(key));
+  size_t lo = 0, hi = c->ring_len;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (c->ring[mid].hash < h)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  size_t want = c->replicas + 1 < c->node_count ? c->replicas + 1
+                                                : c->node_count;
+  size_t count = 0;
+  for (size_t i = 0; i < c->ring_len && count < want; i++) {
+    size_t node = c->ring[(lo + i) % c->ring_len].node;
+    bool seen = false;
+    for (size_t j = 0; j < count; j++)
+      seen |= owners[j] == node;
+    if (!seen)
+      owners[count++] = node;
+  }
+  return count;
+}
+
+static bool is_owner(const struct cluster *c, const size_t *owners,
+                     size_t count) {
+  for (size_t i = 0; i < count; i++)
+    if (owners[i] == c->self)
+      return true;
+  return false;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+  uint8_t *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+  const uint8_t *p = buf;
+  while (len > 0) {
+    ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static void make_aad(const struct channel *ch, bool from_listener,
+                     uint64_t counter, uint8_t aad[AAD_SIZE]) {
+  uint64_t le = htole64(counter);
+  memcpy(aad, ch->session, SESSION_ID_SIZE);
+  memcpy(aad + SESSION_ID_SIZE, &le, 8);
+  aad[SESSION_ID_SIZE + 8] = from_listener;
+}
+
+// Seal len bytes of plain into out as nonce | tag | ciphertext, under the
+// next record counter of this direction.
+static int seal_record(struct channel *ch, const uint8_t *plain, size_t len,
+                       uint8_t *out) {
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  uint8_t *nonce = out, *tag = nonce + NONCE_SIZE, *cipher = tag + TAG_SIZE;
+  uint8_t aad[AAD_SIZE];
+  int out_len, ret = -1;
+  make_aad(ch, ch->listener, ch->sent, aad);
+  if (ctx != NULL && RAND_bytes(nonce, NONCE_SIZE) == 1 &&
+      EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, ch->key, nonce) == 1 &&
+      EVP_EncryptUpdate(ctx, NULL, &out_len, aad, AAD_SIZE) == 1 &&
+      EVP_EncryptUpdate(ctx, cipher, &out_len, plain, (int)len) == 1 &&
+      EVP_EncryptFinal_ex(ctx, cipher + out_len, &out_len) == 1 &&
+      EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, TAG_SIZE, tag) == 1) {
+    ch->sent++;
+    ret = 0;
+  }
+  EVP_CIPHER_CTX_free(ctx);
+  return ret;
+}
+
+// Read a record of len plaintext bytes and open it into plain.
+static int open_record(struct channel *ch, uint8_t *in, size_t len,
+                       uint8_t *plain) {
+  if (read_all(ch->fd, in, RECORD_OVERHEAD + len))
+    return -1;
+
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  uint8_t *nonce = in, *tag = nonce + NONCE_SIZE, *cipher = tag + TAG_SIZE;
+  uint8_t aad[AAD_SIZE];
+  int out_len, ret = -1;
+  make_aad(ch, !ch->listener, ch->received, aad);
+  if (ctx != NULL &&
+      EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, ch->key, nonce) == 1 &&
+      EVP_DecryptUpdate(ctx, NULL, &out_len, aad, AAD_SIZE) == 1 &&
+      EVP_DecryptUpdate(ctx, plain, &out_len, cipher, (int)len) == 1 &&
+      EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_SIZE, tag) == 1 &&
+      EVP_DecryptFinal_ex(ctx, plain + out_len, &out_len) == 1) {
+    ch->received++;
+    ret = 0;
+  } else {
+    RTLS_ERR("rejected unauthenticated cluster frame\n");
+  }
+  EVP_CIPHER_CTX_free(ctx);
+  return ret;
+}
+
+static int send_frame(struct channel *ch, uint8_t op, uint8_t for_op,
+                      const char *key, const uint8_t *value,
+                      size_t value_len) {
+  size_t key_len = key != NULL ? strlen(key) : 0;
+  size_t body_len = key_len + value_len;
+  size_t frame_len = 2 * RECORD_OVERHEAD + PLAIN_HEADER_SIZE + body_len;
+  uint8_t *frame = malloc(frame_len);
+  uint8_t *body = malloc(body_len + 1);
+  int ret = -1;
+  if (frame == NULL || body == NULL)
+    goto out;
+
+  uint8_t header[PLAIN_HEADER_SIZE];
+  uint16_t key_le = htole16((uint16_t)key_len);
+  uint32_t value_le = htole32((uint32_t)value_len);
+  header[0] = op;
+  header[1] = for_op;
+  memcpy(header + 2, &key_le, 2);
+  memcpy(header + 4, &value_le, 4);
+  if (key_len > 0)
+    memcpy(body, key, key_len);
+  if (value_len > 0)
+    memcpy(body + key_len, value, value_len);
+
+  uint8_t *body_record = frame + RECORD_OVERHEAD + PLAIN_HEADER_SIZE;
+  if (seal_record(ch, header, PLAIN_HEADER_SIZE, frame) == 0 &&
+      seal_record(ch, body, body_len, body_record) == 0)
+    ret = write_all(ch->fd, frame, frame_len);
+
+out:
+  if (body != NULL) {
+    explicit_bzero(body, body_len);
+    free(body);
+  }
+  free(frame);
+  return ret;
+}
+
+static void frame_free(struct frame *f) {
+  if (f->plain != NULL) {
+    explicit_bzero(f->plain, f->plain_len);
+    free(f->plain);
+  }
+  memset(f, 0, sizeof(*f));
+}
+
+// The header record is fixed-size and opened first, nothing is allocated
+// for the body before its sizes are authenticated.
+static int recv_frame(struct channel *ch, struct frame *f) {
+  memset(f, 0, sizeof(*f));
+  uint8_t header_record[RECORD_OVERHEAD + PLAIN_HEADER_SIZE];
+  uint8_t header[PLAIN_HEADER_SIZE];
+  if (open_record(ch, header_record, PLAIN_HEADER_SIZE, header))
+    return -1;
+
+  uint16_t key_le;
+  uint32_t value_le;
+  memcpy(&key_le, header + 2, 2);
+  memcpy(&value_le, header + 4, 4);
+  size_t key_len = le16toh(key_le), value_len = le32toh(value_le);
+  if (key_len > SECRET_STORE_KEY_MAX || value_len > SECRET_STORE_VALUE_MAX)
+    return -1;
+
+  size_t plain_len = key_len + value_len;
+  uint8_t *record = malloc(RECORD_OVERHEAD + plain_len);
+  uint8_t *plain = malloc(plain_len + 1);
+  int ret = -1;
+  if (record == NULL || plain == NULL ||
+      open_record(ch, record, plain_len, plain))
+    goto out;
+
+  f->op = header[0];
+  f->for_op = header[1];
+  memcpy(f->key, plain, key_len);
+  f->key[key_len] = '\0';
+  f->value = plain + key_len;
+  f->value_len = value_len;
+  f->plain = plain;
+  f->plain_len = plain_len;
+  plain = NULL;
+  ret = 0;
+
+out:
+  if (plain != NULL) {
+    explicit_bzero(plain, plain_len);
+    free(plain);
+  }
+  free(record);
+  return ret;
+}
+
+static void set_timeouts(int fd) {
+  struct timeval tv = {.tv_sec = PEER_TIMEOUT_S};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static int channel_connect(struct cluster *c, size_t node, struct channel *ch) {
+  struct addrinfo hints = {.ai_family = AF_UNSPEC,
+                           .ai_socktype = SOCK_STREAM};
+  struct addrinfo *res = NULL;
+  if (getaddrinfo(c->nodes[node].host, c->nodes[node].port, &hints, &res))
+    return -1;
+
+  int fd = -1;
+  for (struct addrinfo *ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                ai->ai_protocol);
+    if (fd < 0)
+      continue;
+    // the send timeout also bounds connect()
+    set_timeouts(fd);
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(res);
+  if (fd < 0)
+    return -1;
+
+  memset(ch, 0, sizeof(*ch));
+  ch->fd = fd;
+  ch->key = c->key;
+  // our nonce makes the session fresh for us, whatever the listener sends
+  uint8_t *nonce = ch->session + SESSION_NONCE_SIZE;
+  if (RAND_bytes(nonce, SESSION_NONCE_SIZE) != 1 ||
+      write_all(fd, nonce, SESSION_NONCE_SIZE) ||
+      read_all(fd, ch->session, SESSION_NONCE_SIZE)) {
+    close(fd);
+    ch->fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+static void channel_close(struct channel *ch) {
+  if (ch->fd >= 0)
+    close(ch->fd);
+  ch->fd = -1;
+}
+
+// Send a request and read its reply, which must answer that op and key.
+static int exchange(struct channel *ch, uint8_t op, const char *key,
+                    const uint8_t *value, size_t len, struct frame *reply) {
+  if (send_frame(ch, op, 0, key, value, len) || recv_frame(ch, reply))
+    return -1;
+  if (reply->for_op != op || strcmp(reply->key, key)) {
+    RTLS_ERR("cluster reply does not match its request\n");
+    frame_free(reply);
+    return -1;
+  }
+  return 0;
+}
+
+// One request/reply exchange with node over a fresh connection.
+static int request(struct cluster *c, size_t node, uint8_t op, const char *key,
+                   const uint8_t *value, size_t len, struct frame *reply) {
+  struct channel ch;
+  if (channel_connect(c, node, &ch))
+    return -1;
+  int ret = exchange(&ch, op, key, value, len, reply);
+  channel_close(&ch);
+  return ret;
+}
+
+static void repl_op_free(struct repl_op *op) {
+  if (op->value != NULL) {
+    explicit_bzero(op->value, op->len);
+    free(op->value);
+  }
+  free(op->key);
+  free(op);
+}
+
+static void enqueue(struct cluster *c, size_t node, uint8_t op,
+                    const char *key, const uint8_t *value, size_t len) {
+  struct peer *peer = &c->peers[node];
+  struct repl_op *r = calloc(1, sizeof(struct repl_op));
+  if (r != NULL) {
+    r->op = op;
+    r->key = strdup(key);
+    r->len = len;
+    if (len > 0 && (r->value = malloc(len)) != NULL)
+      memcpy(r->value, value, len);
+  }
+  if (r == NULL || r->key == NULL || (len > 0 && r->value == NULL)) {
+    if (r != NULL)
+      repl_op_free(r);
+    atomic_fetch_add(&c->dropped, 1);
+    RTLS_ERR("out of memory, not replicating '%s' to %s\n", key,
+             c->nodes[node].id);
+    return;
+  }
+
+  pthread_mutex_lock(&peer->lock);
+  if (peer->depth >= CLUSTER_REPLICATION_QUEUE_MAX) {
+    pthread_mutex_unlock(&peer->lock);
+    repl_op_free(r);
+    atomic_fetch_add(&c->dropped, 1);
+    RTLS_WARN("replication queue of %s full, dropping '%s'\n",
+              c->nodes[node].id, key);
+    return;
+  }
+  if (peer->tail != NULL)
+    peer->tail->next = r;
+  else
+    peer->head = r;
+  peer->tail = r;
+  peer->depth++;
+  atomic_fetch_add(&c->backlog, 1);
+  pthread_cond_signal(&peer->not_empty);
+  pthread_mutex_unlock(&peer->lock);
+}
+
+// Ships a peer's queue in order over one long-lived connection, retrying the
+// head until the peer acknowledges it.
+static void *replicator_main(void *arg) {
+  struct peer *peer = arg;
+  struct cluster *c = peer->cluster;
+  struct channel ch = {.fd = -1};
+  unsigned backoff = 1;
+  time_t last_used = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&peer->lock);
+    while (peer->head == NULL)
+      pthread_cond_wait(&peer->not_empty, &peer->lock);
+    struct repl_op *r = peer->head;
+    pthread_mutex_unlock(&peer->lock);
+
+    // the peer drops connections idle for PEER_TIMEOUT_S, don't race it
+    if (ch.fd >= 0 && time(NULL) - last_used >= PEER_TIMEOUT_S - 1)
+      channel_close(&ch);
+
+    struct frame reply;
+    if ((ch.fd < 0 && channel_connect(c, peer->node, &ch)) ||
+        exchange(&ch, r->op, r->key, r->value, r->len, &reply)) {
+      channel_close(&ch);
+      sleep(backoff);
+      backoff = backoff * 2 > RETRY_MAX_S ? RETRY_MAX_S : backoff * 2;
+      continue;
+    }
+    backoff = 1;
+    last_used = time(NULL);
+    if (reply.op != OP_OK)
+      RTLS_ERR("%s refused replicated write of '%s'\n",
+               c->nodes[peer->node].id, r->key);
+    frame_free(&reply);
+
+    pthread_mutex_lock(&peer->lock);
+    peer->head = r->next;
+    if (peer->head == NULL)
+      peer->tail = NULL;
+    peer->depth--;
+    pthread_mutex_unlock(&peer->lock);
+    atomic_fetch_sub(&c->backlog, 1);
+    repl_op_free(r);
+  }
+  return NULL;
+}
+
+int cluster_put(struct cluster *c, const char *key, const uint8_t *value,
+                size_t len) {
+  size_t owners[CLUSTER_REPLICAS_MAX + 1];
+  size_t count = find_owners(c, key, owners);
+
+  if (is_owner(c, owners, count)) {
+    if (secret_store_put(c->store, key, value, len))
+      return -1;
+    for (size_t i = 0; i < count; i++)
+      if (owners[i] != c->self)
+        enqueue(c, owners[i], OP_PUT, key, value, len);
+    return 0;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    struct frame reply;
+    if (request(c, owners[i], OP_FORWARD_PUT, key, value, len, &reply))
+      continue;
+    bool ok = reply.op == OP_OK;
+    frame_free(&reply);
+    if (ok)
+      return 0;
+  }
+  RTLS_ERR("no owner of '%s' accepted the write\n", key);
+  return -1;
+}
+
+int cluster_delete(struct cluster *c, const char *key) {
+  size_t owners[CLUSTER_REPLICAS_MAX + 1];
+  size_t count = find_owners(c, key, owners);
+
+  if (is_owner(c, owners, count)) {
+    if (secret_store_delete(c->store, key))
+      return -1;
+    for (size_t i = 0; i < count; i++)
+      if (owners[i] != c->self)
+        enqueue(c, owners[i], OP_DELETE, key, NULL, 0);
+    return 0;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    struct frame reply;
+    if (request(c, owners[i], OP_FORWARD_DELETE, key, NULL, 0, &reply))
+      continue;
+    bool ok = reply.op == OP_OK;
+    frame_free(&reply);
+    if (ok)
+      return 0;
+  }
+  RTLS_ERR("no owner of '%s' accepted the delete\n", key);
+  return -1;
+}
+
+uint8_t *cluster_get(struct cluster *c, const char *key, size_t *len) {
+  size_t owners[CLUSTER_REPLICAS_MAX + 1];
+  size_t count = find_owners(c, key, owners);
+
+  if (is_owner(c, owners, count)) {
+    uint8_t *value = secret_store_get(c->store, key, len);
+    if (value != NULL)
+      return value;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    struct frame reply;
+    if (owners[i] == c->self ||
+        request(c, owners[i], OP_GET, key, NULL, 0, &reply))
+      continue;
+    uint8_t *value = NULL;
+    // same shape as secret_store_get(): NUL terminated copy
+    if (reply.op == OP_OK && (value = malloc(reply.value_len + 1)) != NULL) {
+      memcpy(value, reply.value, reply.value_len);
+      value[reply.value_len] = '\0';
+      *len = reply.value_len;
+    }
+    frame_free(&reply);
+    if (value != NULL)
+      return value;
+  }
+  return NULL;
+}
+
+static uint8_t serve_request(struct cluster *c, const struct frame *f,
+                             struct frame *reply_value) {
+  size_t owners[CLUSTER_REPLICAS_MAX + 1];
+  size_t count;
+
+  switch (f->op) {
+  case OP_PUT:
+    return secret_store_put(c->store, f->key, f->value, f->value_len)
+               ? OP_ERROR
+               : OP_OK;
+  case OP_DELETE:
+    return secret_store_delete(c->store, f->key) ? OP_ERROR : OP_OK;
+  case OP_FORWARD_PUT:
+  case OP_FORWARD_DELETE:
+    // only owners take forwarded writes, so they cannot bounce around
+    count = find_owners(c, f->key, owners);
+    if (!is_owner(c, owners, count))
+      return OP_ERROR;
+    if (f->op == OP_FORWARD_PUT)
+      return cluster_put(c, f->key, f->value, f->value_len) ? OP_ERROR
+                                                             : OP_OK;
+    return cluster_delete(c, f->key) ? OP_ERROR : OP_OK;
+  case OP_GET:
+    reply_value->plain =
+        secret_store_get(c->store, f->key, &reply_value->plain_len);
+    reply_value->value = reply_value->plain;
+    reply_value->value_len = reply_value->plain_len;
+    return reply_value->plain != NULL ? OP_OK : OP_NOT_FOUND;
+  default:
+    return OP_ERROR;
+  }
+}
+
+static void *peer_conn_main(void *arg) {
+  struct peer_conn *conn = arg;
+  struct cluster *c = conn->cluster;
+  struct channel ch = {.fd = conn->fd, .key = c->key, .listener = true};
+  free(conn);
+
+  // the connector's nonce is read after ours is sent, so it is fresh too
+  if (RAND_bytes(ch.session, SESSION_NONCE_SIZE) != 1 ||
+      write_all(ch.fd, ch.session, SESSION_NONCE_SIZE) ||
+      read_all(ch.fd, ch.session + SESSION_NONCE_SIZE, SESSION_NONCE_SIZE)) {
+    channel_close(&ch);
+    atomic_fetch_sub(&c->peer_conns, 1);
+    return NULL;
+  }
+
+  // replication connections stay open, idle ones time out and reconnect
+  struct frame f;
+  while (recv_frame(&ch, &f) == 0) {
+    struct frame value = {0};
+    uint8_t op = serve_request(c, &f, &value);
+    int ret =
+        send_frame(&ch, op, f.op, f.key, value.value, value.value_len);
+    frame_free(&value);
+    frame_free(&f);
+    if (ret)
+      break;
+  }
+  channel_close(&ch);
+  atomic_fetch_sub(&c->peer_conns, 1);
+  return NULL;
+}
+
+static void *peer_accept_main(void *arg) {
+  struct cluster *c = arg;
+
+  for (;;) {
+    int fd = accept(c->listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EINTR)
+        RTLS_ERR("cluster accept failed: %s\n", strerror(errno));
+      continue;
+    }
+    // a thread per connection, so their number is bounded before anyone
+    // has authenticated
+    if (atomic_fetch_add(&c->peer_conns, 1) >= PEER_CONNS_MAX) {
+      atomic_fetch_sub(&c->peer_conns, 1);
+      RTLS_WARN("too many cluster connections, refusing one\n");
+      close(fd);
+      continue;
+    }
+    set_timeouts(fd);
+
+    struct peer_conn *conn = malloc(sizeof(struct peer_conn));
+    pthread_t tid;
+    if (conn == NULL) {
+      atomic_fetch_sub(&c->peer_conns, 1);
+      close(fd);
+      continue;
+    }
+    conn->cluster = c;
+    conn->fd = fd;
+    if (pthread_create(&tid, NULL, peer_conn_main, conn) != 0) {
+      atomic_fetch_sub(&c->peer_conns, 1);
+      close(fd);
+      free(conn);
+      continue;
+    }
+    pthread_detach(tid);
+  }
+  return NULL;
+}
+
+static int listen_on(struct cluster *c) {
+  const struct node *self = &c->nodes[c->self];
+  struct addrinfo hints = {.ai_family = AF_UNSPEC,
+                           .ai_socktype = SOCK_STREAM,
+                           .ai_flags = AI_PASSIVE};
+  struct addrinfo *res = NULL;
+  if (getaddrinfo(self->host, self->port, &hints, &res)) {
+    RTLS_ERR("cannot resolve %s:%s\n", self->host, self->port);
+    return -1;
+  }
+
+  int fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC,
+                  res->ai_protocol);
+  int reuse = 1;
+  if (fd < 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0 ||
+      bind(fd, res->ai_addr, res->ai_addrlen) < 0 ||
+      listen(fd, SOMAXCONN) < 0) {
+    RTLS_ERR("failed to listen on %s:%s: %s\n", self->host, self->port,
+             strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    freeaddrinfo(res);
+    return -1;
+  }
+  freeaddrinfo(res);
+  c->listen_fd = fd;
+  return 0;
+}
+
+// "<host>:<port>", the last colon splits so that the host may be an IPv6
+// literal in brackets
+static int parse_address(struct node *node, const char *address) {
+  const char *colon = strrchr(address, ':');
+  if (colon == NULL || colon == address || colon[1] == '\0')
+    return -1;
+  const char *host = address;
+  size_t host_len = colon - address;
+  if (host[0] == '[' && host[host_len - 1] == ']') {
+    host++;
+    host_len -= 2;
+  }
+  node->host = strndup(host, host_len);
+  node->port = strdup(colon + 1);
+  return node->host == NULL || node->port == NULL ? -1 : 0;
+}
+
+static int build_ring(struct cluster *c) {
+  c->ring_len = c->node_count * CLUSTER_VNODES;
+  c->ring = calloc(c->ring_len, sizeof(struct vnode));
+  if (c->ring == NULL)
+    return -1;
+  for (size_t n = 0; n < c->node_count; n++) {
+    for (unsigned v = 0; v < CLUSTER_VNODES; v++) {
+      char point[SECRET_STORE_KEY_MAX + 16];
+      int len = snprintf(point, sizeof(point), "%s#%u", c->nodes[n].id, v);
+      c->ring[n * CLUSTER_VNODES + v] =
+          (struct vnode){hash_bytes(point, len), n};
+    }
+  }
+  qsort(c->ring, c->ring_len, sizeof(struct vnode), compare_vnodes);
+  return 0;
+}
+
+struct cluster *cluster_start(const struct broker_config *cfg,
+                              struct secret_store *store) {
+  if (cfg->cluster_self == NULL || !cfg->has_cluster_key) {
+    RTLS_ERR("cluster needs cluster_self and cluster_key\n");
+    return NULL;
+  }
+  if (cfg->cluster_replicas > CLUSTER_REPLICAS_MAX) {
+    RTLS_ERR("at most %d cluster replicas\n", CLUSTER_REPLICAS_MAX);
+    return NULL;
+  }
+
+  struct cluster *c = calloc(1, sizeof(struct cluster));
+  if (c == NULL)
+    return NULL;
+  c->store = store;
+  c->replicas = cfg->cluster_replicas;
+  c->self = cfg->cluster_node_count;
+  c->listen_fd = -1;
+  memcpy(c->key, cfg->cluster_key, sizeof(c->key));
+  c->nodes = calloc(cfg->cluster_node_count, sizeof(struct node));
+  c->peers = calloc(cfg->cluster_node_count, sizeof(struct peer));
+  if (c->nodes == NULL || c->peers == NULL)
+    goto err;
+
+  for (size_t i = 0; i < cfg->cluster_node_count; i++) {
+    const struct broker_cluster_node *n = &cfg->cluster_nodes[i];
+    for (size_t j = 0; j < i; j++) {
+      if (!strcmp(c->nodes[j].id, n->id)) {
+        RTLS_ERR("duplicate cluster node '%s'\n", n->id);
+        goto err;
+      }
+    }
+    c->node_count++;
+    c->nodes[i].id = strdup(n->id);
+    if (c->nodes[i].id == NULL || parse_address(&c->nodes[i], n->address)) {
+      RTLS_ERR("invalid address '%s' of cluster node '%s'\n", n->address,
+               n->id);
+      goto err;
+    }
+    if (!strcmp(n->id, cfg->cluster_self))
+      c->self = i;
+  }
+  if (c->self == c->node_count) {
+    RTLS_ERR("cluster_self '%s' is not a cluster_node\n", cfg->cluster_self);
+    goto err;
+  }
+  if (build_ring(c) || listen_on(c))
+    goto err;
+
+  pthread_t tid;
+  for (size_t i = 0; i < c->node_count; i++) {
+    struct peer *peer = &c->peers[i];
+    peer->cluster = c;
+    peer->node = i;
+    pthread_mutex_init(&peer->lock, NULL);
+    pthread_cond_init(&peer->not_empty, NULL);
+    if (i == c->self)
+      continue;
+    if (pthread_create(&tid, NULL, replicator_main, peer) != 0)
+      goto err_running;
+    pthread_detach(tid);
+  }
+  if (pthread_create(&tid, NULL, peer_accept_main, c) != 0)
+    goto err_running;
+  pthread_detach(tid);
+
+  RTLS_INFO("cluster node %s of %zu, %u replicas, peers on %s:%s\n",
+            c->nodes[c->self].id, c->node_count, c->replicas,
+            c->nodes[c->self].host, c->nodes[c->self].port);
+  return c;
+
+err_running:
+  // threads already started reference c, it can no longer be freed
+  RTLS_ERR("failed to start cluster threads\n");
+  return NULL;
+err:
+  if (c->listen_fd >= 0)
+    close(c->listen_fd);
+  for (size_t i = 0; i < c->node_count; i++) {
+    free(c->nodes[i].id);
+    free(c->nodes[i].host);
+    free(c->nodes[i].port);
+  }
+  free(c->nodes);
+  free(c->peers);
+  free(c->ring);
+  explicit_bzero(c->key, sizeof(c->key));
+  free(c);
+  return NULL;
+}
+
+uint64_t cluster_replication_backlog(struct cluster *c) {
+  return atomic_load(&c->backlog);
+}
+
+uint64_t cluster_replication_dropped(struct cluster *c) {
+  return atomic_load(&c->dropped);
+}
@@ -0,0 +1,73 @@
+#ifndef CONKER_CLUSTER_H
+#define CONKER_CLUSTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "broker_config.h"
+#include "secret_store.h"
+
+// -----------------------------------------------------------------------------
+// Broker cluster: secrets sharded by appId over N broker nodes.
+//
+// Every node knows the full membership (cluster_node entries of the config)
+// and builds the same consistent-hash ring from it, CLUSTER_VNODES points per
+// node. The owners of an appId are the first cluster_replicas + 1 distinct
+// nodes found walking the ring from the appId's hash; the first one is its
+// primary.
+//
+//  - writes accepted by an owner are made durable in its local store and then
+//    replicated asynchronously to the other owners; a node that does not own
+//    the appId forwards the write to the owners, first one that accepts wins;
+//  - reads are answered from the local store when this node is an owner and
+//    has the key, otherwise forwarded to the other owners in ring order.
+//
+// Peers talk over TCP. Each side opens a connection with a random 16-byte
+// nonce, and the two make the session id, so neither side can be fed a
+// recorded connection. A frame is two records, each AES-256-GCM sealed with
+// the shared cluster_key, with the session id, a per-direction record counter
+// and the direction as additional data, so records can neither be forged,
+// reordered nor replayed into another connection:
+//
+//   header: nonce[12] | tag[16] | op | for_op | key_len (le16)
+//           | value_len (le32)
+//   body:   nonce[12] | tag[16] | key | value
+//
+// The header has a fixed size and is authenticated before anything is
+// allocated for the body. A reply carries the op (for_op) and key of the
+// request it answers, and the requesting side checks both.
+//
+// Replication queues live in memory: writes that have not reached a peer when
+// the node stops are only repaired by a later write of the same appId. A read
+// that misses on one owner still falls through to the others.
+//
+// Membership is read once at startup, changing it needs a restart of every
+// node.
+// -----------------------------------------------------------------------------
+
+#define CLUSTER_VNODES 64
+#define CLUSTER_REPLICAS_MAX 7
+#define CLUSTER_REPLICATION_QUEUE_MAX 65536
+
+struct cluster;
+
+// Build the ring from cfg, listen for peers on this node's address and start
+// a replication thread per peer. Returns NULL on error (logged).
+struct cluster *cluster_start(const struct broker_config *cfg,
+                              struct secret_store *store);
+
+int cluster_put(struct cluster *cluster, const char *key, const uint8_t *value,
+                size_t len);
+int cluster_delete(struct cluster *cluster, const char *key);
+
+// Value of key from the local store or an owner, NULL when no owner has it.
+// The caller wipes and frees it.
+uint8_t *cluster_get(struct cluster *cluster, const char *key, size_t *len);
+
+// Writes waiting to be replicated, over all peers.
+uint64_t cluster_replication_backlog(struct cluster *cluster);
+
+// Writes dropped because a peer's queue was full.
+uint64_t cluster_replication_dropped(struct cluster *cluster);
+
+#endif
@@ -0,0 +1,342 @@
+#include "collateral_cache.h"
+#include "broker_config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <curl/curl.h>
+#include <rats-tls/api.h>
+#include <rats-tls/log.h>
+
+// an HSK/CEK certificate pair is a few KiB, anything larger is not one
+#define COLLATERAL_MAX_SIZE (64 * 1024)
+#define REFRESH_INTERVAL_S 60
+#define FETCH_TIMEOUT_S 30
+
+struct collateral {
+  char chip_id[COLLATERAL_CHIP_ID_MAX + 1];
+  uint8_t *data; // NULL until first loaded or fetched
+  size_t len;
+  time_t fetched; // wall clock, comparable with file mtimes
+  struct collateral *next;
+};
+
+// settings copied out of the config snapshot so that it is not pinned while
+// fetching
+struct collateral_settings {
+  char *dir;
+  char *seed;
+  char *url;
+  unsigned ttl;
+  char **chips;
+  size_t chip_count;
+};
+
+struct fetch_buffer {
+  uint8_t *data;
+  size_t len;
+};
+
+// only the refresher touches the list, the counters are read by metrics
+static struct collateral *cache;
+static atomic_size_t cache_count;
+static atomic_uint_fast64_t fetch_failures;
+
+bool collateral_chip_id_valid(const char *chip_id) {
+  size_t len = strlen(chip_id);
+  if (len == 0 || len > COLLATERAL_CHIP_ID_MAX)
+    return false;
+  for (size_t i = 0; i < len; i++) {
+    char c = chip_id[i];
+    if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+          (c >= 'A' && c <= 'Z') || c == '_' || c == '-'))
+      return false;
+  }
+  return true;
+}
+
+size_t collateral_cache_count(void) { return atomic_load(&cache_count); }
+
+uint64_t collateral_cache_failures(void) {
+  return atomic_load(&fetch_failures);
+}
+
+static void free_settings(struct collateral_settings *s) {
+  free(s->dir);
+  free(s->seed);
+  free(s->url);
+  for (size_t i = 0; i < s->chip_count; i++)
+    free(s->chips[i]);
+  free(s->chips);
+  memset(s, 0, sizeof(*s));
+}
+
+static int load_settings(struct collateral_settings *s) {
+  unsigned slot;
+  const struct broker_config *cfg = broker_config_get(&slot);
+  memset(s, 0, sizeof(*s));
+  s->dir = strdup(cfg->collateral_dir ? cfg->collateral_dir
+                                      : COLLATERAL_DEFAULT_DIR);
+  s->seed = cfg->collateral_seed ? strdup(cfg->collateral_seed) : NULL;
+  s->url = strdup(cfg->collateral_url ? cfg->collateral_url
+                                      : COLLATERAL_DEFAULT_URL);
+  s->ttl = cfg->collateral_ttl ? cfg->collateral_ttl : COLLATERAL_DEFAULT_TTL;
+  s->chips = calloc(cfg->collateral_chip_count + 1, sizeof(char *));
+  bool failed = s->dir == NULL || s->url == NULL || s->chips == NULL ||
+                (cfg->collateral_seed != NULL && s->seed == NULL);
+  for (size_t i = 0; !failed && i < cfg->collateral_chip_count; i++) {
+    s->chips[i] = strdup(cfg->collateral_chips[i]);
+    failed = s->chips[i] == NULL;
+    s->chip_count++;
+  }
+  broker_config_put(slot);
+
+  if (failed) {
+    free_settings(s);
+    return -1;
+  }
+  return 0;
+}
+
+static struct collateral *find_or_add(const char *chip_id) {
+  for (struct collateral *c = cache; c != NULL; c = c->next)
+    if (!strcmp(c->chip_id, chip_id))
+      return c;
+
+  struct collateral *c = calloc(1, sizeof(struct collateral));
+  if (c == NULL)
+    return NULL;
+  strcpy(c->chip_id, chip_id);
+  c->next = cache;
+  cache = c;
+  atomic_fetch_add(&cache_count, 1);
+  return c;
+}
+
+static void replace_data(struct collateral *c, uint8_t *data, size_t len,
+                         time_t fetched) {
+  free(c->data);
+  c->data = data;
+  c->len = len;
+  c->fetched = fetched;
+}
+
+static int read_file(const char *path, uint8_t **data, size_t *len,
+                     time_t *mtime) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  struct stat st;
+  uint8_t *buf = NULL;
+  if (fstat(fd, &st) < 0 || st.st_size == 0 ||
+      st.st_size > COLLATERAL_MAX_SIZE ||
+      (buf = malloc(st.st_size)) == NULL) {
+    close(fd);
+    return -1;
+  }
+  ssize_t n = pread(fd, buf, st.st_size, 0);
+  close(fd);
+  if (n != st.st_size) {
+    free(buf);
+    return -1;
+  }
+  *data = buf;
+  *len = st.st_size;
+  *mtime = st.st_mtime;
+  return 0;
+}
+
+// Take every <chip id>/hsk_cek.cert under dir that is newer than what the
+// memory tier holds.
+static void adopt_dir(const char *dir) {
+  DIR *d = opendir(dir);
+  if (d == NULL)
+    return;
+
+  struct dirent *ent;
+  while ((ent = readdir(d)) != NULL) {
+    if (!collateral_chip_id_valid(ent->d_name))
+      continue;
+
+    char path[PATH_MAX];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s/%s", dir, ent->d_name,
+             COLLATERAL_FILE);
+    if (stat(path, &st) < 0)
+      continue;
+
+    struct collateral *c = find_or_add(ent->d_name);
+    if (c == NULL || (c->data != NULL && st.st_mtime <= c->fetched))
+      continue;
+
+    uint8_t *data;
+    size_t len;
+    time_t mtime;
+    if (read_file(path, &data, &len, &mtime) == 0)
+      replace_data(c, data, len, mtime);
+  }
+  closedir(d);
+}
+
+static size_t fetch_write(char *ptr, size_t size, size_t nmemb, void *arg) {
+  struct fetch_buffer *buf = arg;
+  size_t n = size * nmemb;
+  if (buf->len + n > COLLATERAL_MAX_SIZE)
+    return 0;
+  uint8_t *grown = realloc(buf->data, buf->len + n);
+  if (grown == NULL)
+    return 0;
+  memcpy(grown + buf->len, ptr, n);
+  buf->data = grown;
+  buf->len += n;
+  return n;
+}
+
+static int fetch(const char *url_prefix, const char *chip_id, uint8_t **data,
+                 size_t *len) {
+  char url[PATH_MAX];
+  if (snprintf(url, sizeof(url), "%s%s", url_prefix, chip_id) >=
+      (int)sizeof(url))
+    return -1;
+
+  CURL *curl = curl_easy_init();
+  if (curl == NULL)
+    return -1;
+  struct fetch_buffer buf = {NULL, 0};
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+#if LIBCURL_VERSION_NUM >= 0x075500
+  curl_easy_setopt(curl, CURLOPT_PROTOCOLS_STR, "http,https,file");
+#else
+  curl_easy_setopt(curl, CURLOPT_PROTOCOLS,
+                   CURLPROTO_HTTP | CURLPROTO_HTTPS | CURLPROTO_FILE);
+#endif
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)FETCH_TIMEOUT_S);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, fetch_write);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buf);
+  CURLcode res = curl_easy_perform(curl);
+  curl_easy_cleanup(curl);
+
+  if (res != CURLE_OK || buf.len == 0) {
+    RTLS_WARN("failed to fetch collateral for chip %s: %s\n", chip_id,
+              res != CURLE_OK ? curl_easy_strerror(res) : "empty response");
+    free(buf.data);
+    return -1;
+  }
+  *data = buf.data;
+  *len = buf.len;
+  return 0;
+}
+
+static int mkdir_if_missing(const char *path) {
+  return mkdir(path, 0755) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+// Make <dir>/<chip id>/hsk_cek.cert match the memory tier; the verifier may
+// read it at any time, so it is replaced with a rename.
+static void sync_to_disk(const char *dir, struct collateral *c) {
+  char chip_dir[PATH_MAX], path[PATH_MAX], tmp[PATH_MAX];
+  if (snprintf(chip_dir, sizeof(chip_dir), "%s/%s", dir, c->chip_id) >=
+          (int)sizeof(chip_dir) ||
+      snprintf(path, sizeof(path), "%s/%s", chip_dir, COLLATERAL_FILE) >=
+          (int)sizeof(path) ||
+      snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+    RTLS_ERR("collateral path too long under %s\n", dir);
+    return;
+  }
+
+  struct stat st;
+  if (stat(path, &st) == 0 && st.st_mtime >= c->fetched &&
+      (size_t)st.st_size == c->len)
+    return;
+
+  if (mkdir_if_missing(dir) || mkdir_if_missing(chip_dir)) {
+    RTLS_ERR("failed to create %s: %s\n", chip_dir, strerror(errno));
+    return;
+  }
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    RTLS_ERR("failed to write %s: %s\n", tmp, strerror(errno));
+    return;
+  }
+  bool ok = write(fd, c->data, c->len) == (ssize_t)c->len && fsync(fd) == 0;
+  close(fd);
+  if (!ok || rename(tmp, path) < 0) {
+    RTLS_ERR("failed to install %s: %s\n", path, strerror(errno));
+    unlink(tmp);
+    return;
+  }
+  // the file is now the newest copy, don't adopt it back on the next pass
+  if (stat(path, &st) == 0)
+    c->fetched = st.st_mtime;
+}
+
+// Fetch what is missing and, unless missing_only, what is due for refresh.
+static void refresh_pass(bool missing_only) {
+  struct collateral_settings s;
+  if (load_settings(&s))
+    return;
+
+  if (s.seed != NULL)
+    adopt_dir(s.seed);
+  adopt_dir(s.dir);
+  for (size_t i = 0; i < s.chip_count; i++)
+    find_or_add(s.chips[i]);
+
+  bool online = strcmp(s.url, "off") != 0;
+  time_t now = time(NULL);
+  for (struct collateral *c = cache; c != NULL; c = c->next) {
+    // refresh ahead of expiry so that no handshake finds it stale
+    bool due = c->data == NULL ||
+               (!missing_only && now - c->fetched >= s.ttl / 4 * 3);
+    if (online && due) {
+      uint8_t *data;
+      size_t len;
+      if (fetch(s.url, c->chip_id, &data, &len) == 0) {
+        replace_data(c, data, len, now);
+        RTLS_INFO("refreshed collateral for chip %s\n", c->chip_id);
+      } else {
+        atomic_fetch_add(&fetch_failures, 1);
+      }
+    }
+    if (c->data != NULL)
+      sync_to_disk(s.dir, c);
+  }
+  free_settings(&s);
+}
+
+static void *refresher_main(void *arg) {
+  for (;;) {
+    refresh_pass(false);
+    sleep(REFRESH_INTERVAL_S);
+  }
+  return NULL;
+}
+
+int collateral_cache_start(void) {
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+  // before listening, only what no copy exists of: an offline host must not
+  // wait FETCH_TIMEOUT_S per adopted chip that is merely old
+  refresh_pass(true);
+
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, refresher_main, NULL) != 0) {
+    RTLS_ERR("failed to start collateral refresher\n");
+    return -1;
+  }
+  pthread_detach(tid);
+  RTLS_INFO("collateral cache holds %zu chips\n", collateral_cache_count());
+  return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef CONKER_COLLATERAL_CACHE_H
+#define CONKER_COLLATERAL_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// -----------------------------------------------------------------------------
+// Attestation collateral cache for the brokers.
+//
+// The rats-tls CSV verifier checks a quote against the HSK/CEK certificate of
+// the chip that produced it. It reads it from <collateral_dir>/<chip
+// id>/hsk_cek.cert, and only when that file is missing downloads it from the
+// Hygon KDS inline, inside rats_tls_negotiate().
+//
+// The cache keeps those files present and current so that handshakes never
+// hit the network:
+//
+//  - memory tier: one entry per chip id, loaded from collateral_seed (a local
+//    directory with the same layout, e.g. exported from another host or a
+//    stand-in service) and from certificates already in collateral_dir;
+//  - disk tier: collateral_dir itself, rewritten atomically from memory when a
+//    file is missing or a newer certificate has been fetched;
+//  - a background thread refetches entries from collateral_url once they
+//    reach three quarters of collateral_ttl, keeps serving the previous copy
+//    when the service is unreachable, and prefetches collateral_chip entries.
+//
+// Settings come from the current broker_config snapshot on every pass, so
+// they follow reloads.
+// -----------------------------------------------------------------------------
+
+#define COLLATERAL_DEFAULT_DIR "/opt/csv/hsk_cek"
+#define COLLATERAL_DEFAULT_URL "https://cert.hygon.cn/hsk_cek?snumber="
+#define COLLATERAL_DEFAULT_TTL (24 * 3600)
+#define COLLATERAL_FILE "hsk_cek.cert"
+#define COLLATERAL_CHIP_ID_MAX 64
+
+// Chip ids become path components and URL parameters: [A-Za-z0-9_-] only.
+bool collateral_chip_id_valid(const char *chip_id);
+
+// Fetch the collateral of chips without any copy synchronously, then start
+// the refresher thread, which renews stale copies right away. Returns -1
+// only when the thread cannot be started; collateral errors are logged.
+int collateral_cache_start(void);
+
+// Chips held in the memory tier.
+size_t collateral_cache_count(void);
+
+// Fetches that failed, the previous certificate was kept.
+uint64_t collateral_cache_failures(void);
+
+#endif
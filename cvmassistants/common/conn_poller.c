@@ -0,0 +1,176 @@
+#include "conn_poller.h"
+#include "admission.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <rats-tls/api.h>
+#include <rats-tls/log.h>
+
+#define EVENTS_MAX 64
+#define TICK_MS 250 // longest epoll wait, picks up entries added meanwhile
+
+// Entries share one timeout, so in arrival order they are also in deadline
+// order and the oldest is always at the head of the list.
+struct poll_entry {
+  int fd;
+  uint64_t deadline_ms;
+  struct poll_entry *prev;
+  struct poll_entry *next; // also links the free list
+};
+
+struct conn_poller {
+  int epfd;
+  pthread_mutex_t lock;
+  struct poll_entry *entries;
+  struct poll_entry *free_list;
+  struct poll_entry *head;
+  struct poll_entry *tail;
+  size_t count;
+  unsigned timeout_ms;
+  conn_ready_fn ready;
+  conn_timeout_fn timed_out;
+  void *arg;
+  atomic_uint_fast64_t timeouts;
+};
+
+// Called with the lock held. Returns the fd the entry held.
+static int release(struct conn_poller *p, struct poll_entry *e) {
+  int fd = e->fd;
+  epoll_ctl(p->epfd, EPOLL_CTL_DEL, fd, NULL);
+  if (e->prev != NULL)
+    e->prev->next = e->next;
+  else
+    p->head = e->next;
+  if (e->next != NULL)
+    e->next->prev = e->prev;
+  else
+    p->tail = e->prev;
+  e->fd = -1;
+  e->next = p->free_list;
+  p->free_list = e;
+  p->count--;
+  return fd;
+}
+
+static void *poller_main(void *arg) {
+  struct conn_poller *p = arg;
+  struct epoll_event events[EVENTS_MAX];
+
+  for (;;) {
+    pthread_mutex_lock(&p->lock);
+    uint64_t now = monotonic_ms();
+    int wait_ms = TICK_MS;
+    if (p->head != NULL && p->head->deadline_ms < now + TICK_MS)
+      wait_ms = p->head->deadline_ms > now ? p->head->deadline_ms - now : 0;
+    pthread_mutex_unlock(&p->lock);
+
+    int n = epoll_wait(p->epfd, events, EVENTS_MAX, wait_ms);
+    for (int i = 0; i < n; i++) {
+      struct poll_entry *e = events[i].data.ptr;
+      pthread_mutex_lock(&p->lock);
+      int fd = e->fd >= 0 ? release(p, e) : -1;
+      pthread_mutex_unlock(&p->lock);
+      if (fd >= 0)
+        p->ready(fd, p->arg);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    now = monotonic_ms();
+    while (p->head != NULL && p->head->deadline_ms <= now) {
+      int fd = release(p, p->head);
+      atomic_fetch_add(&p->timeouts, 1);
+      if (p->timed_out != NULL) {
+        pthread_mutex_unlock(&p->lock);
+        p->timed_out(fd, p->arg);
+        pthread_mutex_lock(&p->lock);
+      }
+      close(fd);
+    }
+    pthread_mutex_unlock(&p->lock);
+  }
+  return NULL;
+}
+
+struct conn_poller *conn_poller_new(size_t capacity, unsigned timeout_ms,
+                                    conn_ready_fn ready,
+                                    conn_timeout_fn timed_out, void *arg) {
+  if (capacity == 0)
+    return NULL;
+
+  struct conn_poller *p = calloc(1, sizeof(struct conn_poller));
+  if (p == NULL)
+    return NULL;
+  p->entries = calloc(capacity, sizeof(struct poll_entry));
+  p->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (p->entries == NULL || p->epfd < 0)
+    goto err;
+  for (size_t i = 0; i < capacity; i++) {
+    p->entries[i].fd = -1;
+    p->entries[i].next = i + 1 < capacity ? &p->entries[i + 1] : NULL;
+  }
+  p->free_list = p->entries;
+  p->timeout_ms = timeout_ms;
+  p->ready = ready;
+  p->timed_out = timed_out;
+  p->arg = arg;
+  pthread_mutex_init(&p->lock, NULL);
+
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, poller_main, p) != 0) {
+    RTLS_ERR("Failed to start the connection poller\n");
+    goto err;
+  }
+  pthread_detach(tid);
+  return p;
+
+err:
+  if (p->epfd >= 0)
+    close(p->epfd);
+  free(p->entries);
+  free(p);
+  return NULL;
+}
+
+int conn_poller_add(struct conn_poller *p, int fd) {
+  pthread_mutex_lock(&p->lock);
+  struct poll_entry *e = p->free_list;
+  if (e == NULL) {
+    pthread_mutex_unlock(&p->lock);
+    return -1;
+  }
+  // registered under the lock so that the poller cannot expire the entry
+  // before epoll knows it
+  struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
+                           .data.ptr = e};
+  if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    pthread_mutex_unlock(&p->lock);
+    return -1;
+  }
+  p->free_list = e->next;
+  e->fd = fd;
+  e->deadline_ms = monotonic_ms() + p->timeout_ms;
+  e->prev = p->tail;
+  e->next = NULL;
+  if (p->tail != NULL)
+    p->tail->next = e;
+  else
+    p->head = e;
+  p->tail = e;
+  p->count++;
+  pthread_mutex_unlock(&p->lock);
+  return 0;
+}
+
+size_t conn_poller_count(struct conn_poller *p) {
+  pthread_mutex_lock(&p->lock);
+  size_t count = p->count;
+  pthread_mutex_unlock(&p->lock);
+  return count;
+}
+
+uint64_t conn_poller_timeouts(struct conn_poller *p) {
+  return atomic_load(&p->timeouts);
+}
@@ -0,0 +1,43 @@
+#ifndef CONKER_CONN_POLLER_H
+#define CONKER_CONN_POLLER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// -----------------------------------------------------------------------------
+// Event loop holding accepted connections until their client has spoken.
+//
+// rats_tls_negotiate() blocks its thread until the handshake is over, and a
+// TLS server cannot act before the ClientHello arrives. Workers therefore
+// only get a connection once it is readable: until then it is a small entry
+// in an epoll set served by a single thread, so thousands of slow or silent
+// clients cost no worker and no rats-tls handle. A connection that sends
+// nothing within the timeout is closed.
+// -----------------------------------------------------------------------------
+
+// Called on the poller thread with a readable connection, or one the client
+// closed; the callee owns fd.
+typedef void (*conn_ready_fn)(int fd, void *arg);
+
+// Called on the poller thread with a connection that timed out, just before
+// the poller closes it.
+typedef void (*conn_timeout_fn)(int fd, void *arg);
+
+struct conn_poller;
+
+// timed_out may be NULL.
+struct conn_poller *conn_poller_new(size_t capacity, unsigned timeout_ms,
+                                    conn_ready_fn ready,
+                                    conn_timeout_fn timed_out, void *arg);
+
+// Wait for fd to become readable. Returns -1 when capacity connections are
+// already waiting; the caller keeps fd then.
+int conn_poller_add(struct conn_poller *p, int fd);
+
+// Connections waiting for their first bytes.
+size_t conn_poller_count(struct conn_poller *p);
+
+// Connections closed because their client sent nothing in time.
+uint64_t conn_poller_timeouts(struct conn_poller *p);
+
+#endif
@@ -0,0 +1,187 @@
+#include "frame.h"
+
+#include <string.h>
+
+static void put_be16(uint8_t *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static void put_be64(uint8_t *p, uint64_t v) {
+  put_be32(p, v >> 32);
+  put_be32(p + 4, v);
+}
+
+static uint16_t get_be16(const uint8_t *p) { return (uint16_t)p[0] << 8 | p[1]; }
+
+static uint32_t get_be32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+static uint64_t get_be64(const uint8_t *p) {
+  return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+void frame_encode_header(uint8_t *out, const struct frame_header *h) {
+  memcpy(out, FRAME_MAGIC, 2);
+  out[2] = h->version;
+  out[3] = h->type;
+  put_be16(out + 4, h->flags);
+  put_be32(out + 6, h->request_id);
+  put_be32(out + 10, h->length);
+}
+
+int frame_decode_header(const uint8_t *in, struct frame_header *h) {
+  if (memcmp(in, FRAME_MAGIC, 2))
+    return -1;
+  h->version = in[2];
+  h->type = in[3];
+  h->flags = get_be16(in + 4);
+  h->request_id = get_be32(in + 6);
+  h->length = get_be32(in + 10);
+  return 0;
+}
+
+void frame_encode_size(uint8_t *out, uint64_t len) { put_be64(out, len); }
+
+uint64_t frame_decode_size(const uint8_t *in) { return get_be64(in); }
+
+bool frame_is_framed(const uint8_t *data, size_t len) {
+  return len >= 2 && !memcmp(data, FRAME_MAGIC, 2);
+}
+
+void frame_encode_hello(uint8_t *out, uint8_t min_version, uint8_t max_version,
+                        uint16_t flags, uint32_t max_payload) {
+  out[0] = min_version;
+  out[1] = max_version;
+  put_be16(out + 2, flags);
+  put_be32(out + 4, max_payload);
+}
+
+int frame_decode_hello(const uint8_t *in, size_t len, uint8_t *min_version,
+                       uint8_t *max_version, uint16_t *flags,
+                       uint32_t *max_payload) {
+  if (len < FRAME_HELLO_MIN_SIZE || in[0] > in[1])
+    return -1;
+  *min_version = in[0];
+  *max_version = in[1];
+  *flags = get_be16(in + 2);
+  *max_payload = len >= FRAME_HELLO_SIZE ? get_be32(in + 4) : 0;
+  if (*max_payload < FRAME_PAYLOAD_MAX)
+    *max_payload = FRAME_PAYLOAD_MAX;
+  return 0;
+}
+
+void frame_reader_init(struct frame_reader *r, uint8_t *buf, frame_recv_fn recv,
+                       void *ctx) {
+  r->buf = buf;
+  r->start = 0;
+  r->end = 0;
+  r->recv = recv;
+  r->ctx = ctx;
+  r->max_payload = FRAME_PAYLOAD_MAX;
+}
+
+long frame_reader_fill(struct frame_reader *r) {
+  // keep the partial frame at the front so that a whole one always fits
+  if (r->start > 0) {
+    memmove(r->buf, r->buf + r->start, r->end - r->start);
+    r->end -= r->start;
+    r->start = 0;
+  }
+  size_t len = FRAME_READER_BUFFER - r->end;
+  if (len == 0 || r->recv(r->ctx, r->buf + r->end, &len))
+    return -1;
+  r->end += len;
+  return (long)len;
+}
+
+// Length of the complete frame at the front of the buffer, 0 when more bytes
+// are needed, -1 when the frame can never be accepted.
+static long complete_frame(const struct frame_reader *r) {
+  size_t have = r->end - r->start;
+  if (have < FRAME_HEADER_SIZE)
+    return have >= 2 && !frame_is_framed(r->buf + r->start, have) ? -1 : 0;
+
+  struct frame_header h;
+  if (frame_decode_header(r->buf + r->start, &h) ||
+      h.length > FRAME_PAYLOAD_MAX)
+    return -1;
+  return have >= FRAME_HEADER_SIZE + h.length ? FRAME_HEADER_SIZE + h.length
+                                              : 0;
+}
+
+bool frame_buffered(const struct frame_reader *r) {
+  return complete_frame(r) > 0;
+}
+
+int frame_read(struct frame_reader *r, struct frame_header *h,
+               const uint8_t **payload) {
+  long len;
+  while ((len = complete_frame(r)) == 0) {
+    long got = frame_reader_fill(r);
+    if (got < 0)
+      return -1;
+    if (got == 0)
+      return r->start == r->end ? 0 : -1;
+  }
+  if (len < 0)
+    return -1;
+
+  frame_decode_header(r->buf + r->start, h);
+  *payload = r->buf + r->start + FRAME_HEADER_SIZE;
+  r->start += len;
+  return 1;
+}
+
+int frame_read_header(struct frame_reader *r, struct frame_header *h) {
+  while (r->end - r->start < FRAME_HEADER_SIZE) {
+    if (r->end - r->start >= 2 &&
+        !frame_is_framed(r->buf + r->start, r->end - r->start))
+      return -1;
+    long got = frame_reader_fill(r);
+    if (got < 0)
+      return -1;
+    if (got == 0)
+      return r->start == r->end ? 0 : -1;
+  }
+  if (frame_decode_header(r->buf + r->start, h) || h->length > r->max_payload)
+    return -1;
+  r->start += FRAME_HEADER_SIZE;
+  return 1;
+}
+
+int frame_read_payload(struct frame_reader *r, void *dest, size_t len) {
+  size_t buffered = r->end - r->start;
+  size_t n = buffered < len ? buffered : len;
+  if (dest != NULL)
+    memcpy(dest, r->buf + r->start, n);
+  r->start += n;
+
+  for (size_t off = n; off < len;) {
+    size_t got = len - off;
+    if (dest != NULL) {
+      if (r->recv(r->ctx, (uint8_t *)dest + off, &got))
+        return -1;
+    } else {
+      // r->start == r->end here, the whole buffer is free
+      r->start = r->end = 0;
+      if (got > FRAME_READER_BUFFER)
+        got = FRAME_READER_BUFFER;
+      if (r->recv(r->ctx, r->buf, &got))
+        return -1;
+    }
+    if (got == 0)
+      return -1;
+    off += got;
+  }
+  return 0;
+}
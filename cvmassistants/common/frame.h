@@ -0,0 +1,132 @@
+#ifndef CONKER_FRAME_H
+#define CONKER_FRAME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// -----------------------------------------------------------------------------
+// Framed broker protocol, spoken inside the rats-tls session.
+//
+// Every message is a frame, integers in network byte order:
+//
+//   magic "CK" | version u8 | type u8 | flags u16 | request_id u32 |
+//   length u32 | payload[length]
+//
+// The client opens with HELLO (request id 0, payload: lowest and highest
+// version it speaks, the flags it can accept as a u16 and optionally the
+// largest payload it takes in one frame as a u32) and may send its REQUEST
+// frames right behind it without waiting. The server answers HELLO with the
+// version it picked, the flags and the payload limit it will use, or ERROR
+// and closes. Bytes at the end of a HELLO that a side does not know are
+// ignored, so it can grow without a version change.
+//
+// A REQUEST payload is the command name. Its answer is one or more REPLY
+// frames, or an ERROR frame with a message, carrying the same request id.
+// Replies longer than the payload limit, FRAME_PAYLOAD_MAX unless both sides
+// agreed on more (up to FRAME_BATCH_MAX), are split, FRAME_FLAG_MORE set on all
+// but the last piece, and pieces of different replies are interleaved so
+// that a small reply is not held up behind a large one. BYE ends the session.
+//
+// A server that does not see the magic treats the first bytes as a bare
+// command and answers with the unframed payload, as before framing.
+// -----------------------------------------------------------------------------
+
+#define FRAME_MAGIC "CK"
+#define FRAME_VERSION_MIN 1
+#define FRAME_VERSION_MAX 1
+#define FRAME_HEADER_SIZE 14
+#define FRAME_PAYLOAD_MAX (16 * 1024) // every side accepts this much
+#define FRAME_BATCH_MAX (1024 * 1024)  // most a HELLO may agree on
+
+enum frame_type {
+  FRAME_HELLO = 1,
+  FRAME_REQUEST = 2,
+  FRAME_REPLY = 3,
+  FRAME_ERROR = 4,
+  FRAME_BYE = 5,
+};
+
+#define FRAME_FLAG_MORE 0x0001 // further frames complete this payload
+// Payload encodings, only used once both sides offered them in HELLO.
+// Version 1 defines the bits but no implementation offers them yet.
+#define FRAME_FLAG_COMPRESSED 0x0002
+#define FRAME_FLAG_DELTA 0x0004
+// Also agreed in HELLO: the first frame of a reply starts with the length of
+// the whole reply, so that the receiver sizes its buffer once.
+#define FRAME_FLAG_SIZED 0x0008
+#define FRAME_SIZE_PREFIX 8 // u64
+
+struct frame_header {
+  uint8_t version;
+  uint8_t type;
+  uint16_t flags;
+  uint32_t request_id;
+  uint32_t length;
+};
+
+void frame_encode_header(uint8_t *out, const struct frame_header *h);
+
+// Returns -1 when in does not start with the frame magic.
+int frame_decode_header(const uint8_t *in, struct frame_header *h);
+
+// Whether the first len bytes of a session can start a frame.
+bool frame_is_framed(const uint8_t *data, size_t len);
+
+void frame_encode_size(uint8_t *out, uint64_t len);
+uint64_t frame_decode_size(const uint8_t *in);
+
+// HELLO payloads: min version, max version, flags, payload limit. A HELLO
+// of FRAME_HELLO_MIN_SIZE bytes has no limit, which decodes as
+// FRAME_PAYLOAD_MAX; a smaller limit is raised to it.
+#define FRAME_HELLO_SIZE 8
+#define FRAME_HELLO_MIN_SIZE 4
+void frame_encode_hello(uint8_t *out, uint8_t min_version, uint8_t max_version,
+                        uint16_t flags, uint32_t max_payload);
+int frame_decode_hello(const uint8_t *in, size_t len, uint8_t *min_version,
+                       uint8_t *max_version, uint16_t *flags,
+                       uint32_t *max_payload);
+
+// Reading whole frames from a stream transport. recv reads at most *len
+// bytes into buf and sets *len to what it got, 0 at end of stream; it
+// returns non-zero on error.
+typedef int (*frame_recv_fn)(void *ctx, void *buf, size_t *len);
+
+struct frame_reader {
+  uint8_t *buf; // FRAME_HEADER_SIZE + FRAME_PAYLOAD_MAX bytes
+  size_t start;
+  size_t end;
+  frame_recv_fn recv;
+  void *ctx;
+  uint32_t max_payload; // for frame_read_header(), FRAME_PAYLOAD_MAX at init
+};
+
+#define FRAME_READER_BUFFER (FRAME_HEADER_SIZE + FRAME_PAYLOAD_MAX)
+
+void frame_reader_init(struct frame_reader *r, uint8_t *buf, frame_recv_fn recv,
+                       void *ctx);
+
+// Receive once more into the buffer. Returns the bytes added, 0 at end of
+// stream, -1 on error.
+long frame_reader_fill(struct frame_reader *r);
+
+// Next frame, its payload valid until the next call. Returns 1 for a frame,
+// 0 at end of stream between frames, -1 on error, bad magic or a payload
+// larger than FRAME_PAYLOAD_MAX.
+int frame_read(struct frame_reader *r, struct frame_header *h,
+               const uint8_t **payload);
+
+// Whether frame_read() can return a frame without receiving.
+bool frame_buffered(const struct frame_reader *r);
+
+// Frames larger than the buffer, up to r->max_payload: read the header, then
+// hand the payload to frame_read_payload(), which copies what is buffered and
+// receives the rest straight into dest, as much per receive as the
+// transport returns. Same return values as frame_read().
+int frame_read_header(struct frame_reader *r, struct frame_header *h);
+
+// Read the len payload bytes following a header into dest, or drop them when
+// dest is NULL. Returns -1 on error or end of stream.
+int frame_read_payload(struct frame_reader *r, void *dest, size_t len);
+
+#endif
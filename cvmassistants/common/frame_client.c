@@ -0,0 +1,222 @@
+#include "frame_client.h"
+#include "frame.h"
+#include "log.h"
+#include "secure_mem.h"
+#include "trace.h"
+
+#include <string.h>
+#include <time.h>
+
+#define REQUEST_ID 1
+#define COMMAND_MAX 64
+#define PROGRESS_INTERVAL_S 1.0
+
+static int send_request(rats_tls_handle handle, const char *command) {
+  uint8_t out[3 * FRAME_HEADER_SIZE + FRAME_HELLO_SIZE + COMMAND_MAX];
+  size_t command_len = strlen(command);
+  size_t n = 0;
+
+  if (command_len > COMMAND_MAX) {
+    LOG_ERROR("Command %s too long", command);
+    return -1;
+  }
+
+  // frames sent before the broker answers HELLO use the lowest version
+  struct frame_header h = {FRAME_VERSION_MIN, FRAME_HELLO, 0, 0,
+                           FRAME_HELLO_SIZE};
+  frame_encode_header(out + n, &h);
+  n += FRAME_HEADER_SIZE;
+  // the whole reply is received in place, frames need not fit a buffer
+  frame_encode_hello(out + n, FRAME_VERSION_MIN, FRAME_VERSION_MAX,
+                     FRAME_FLAG_SIZED, FRAME_BATCH_MAX);
+  n += FRAME_HELLO_SIZE;
+
+  h = (struct frame_header){FRAME_VERSION_MIN, FRAME_REQUEST, 0, REQUEST_ID,
+                            command_len};
+  frame_encode_header(out + n, &h);
+  n += FRAME_HEADER_SIZE;
+  memcpy(out + n, command, command_len);
+  n += command_len;
+
+  h = (struct frame_header){FRAME_VERSION_MIN, FRAME_BYE, 0, 0, 0};
+  frame_encode_header(out + n, &h);
+  n += FRAME_HEADER_SIZE;
+
+  TRACE(transmit, n);
+  rats_tls_err_t ret = rats_tls_transmit(handle, out, &n);
+  if (ret != RATS_TLS_ERR_NONE) {
+    LOG_ERROR("Failed to send request %#x", ret);
+    return -1;
+  }
+  return 0;
+}
+
+static int receive(void *ctx, void *buf, size_t *len) {
+  rats_tls_err_t ret = rats_tls_receive(ctx, buf, len);
+  if (ret != RATS_TLS_ERR_NONE) {
+    LOG_ERROR("Failed to receive %#x", ret);
+    return -1;
+  }
+  TRACE(receive, *len);
+  return 0;
+}
+
+// Make room for len more bytes after used, keeping the reply in locked
+// memory; the old buffer is wiped. While more frames follow, reserve at least
+// twice what has arrived so that a long reply is moved a few times only.
+static char *grow(char *buf, size_t *size, size_t used, size_t len, bool more,
+                  size_t max_len) {
+  if (used + len + 1 <= *size) // +1 for null terminator
+    return buf;
+  size_t new_size = used + len + 1;
+  if (more && new_size < 2 * (used + len))
+    new_size = 2 * (used + len);
+  if (new_size > max_len + 1)
+    new_size = max_len + 1;
+  char *grown = secure_alloc(new_size);
+  if (grown == NULL)
+    return NULL;
+  if (used > 0)
+    memcpy(grown, buf, used);
+  secure_free(buf);
+  *size = new_size;
+  return grown;
+}
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *receive_reply(rats_tls_handle handle, size_t max_len,
+                           size_t *len) {
+  // reader buffer, then room for the payload of HELLO and ERROR frames
+  uint8_t *in = secure_alloc(FRAME_READER_BUFFER + FRAME_PAYLOAD_MAX);
+  if (in == NULL) {
+    LOG_ERROR("Failed to allocate receive buffer");
+    return NULL;
+  }
+  uint8_t *small = in + FRAME_READER_BUFFER;
+  struct frame_reader reader;
+  frame_reader_init(&reader, in, receive, handle);
+
+  char *buf = NULL;
+  size_t size = 0;
+  size_t received = 0;
+  uint64_t total = 0; // announced length, 0 while unknown
+  unsigned frames = 0;
+  double start = now_s(), last_progress = start;
+  bool complete = false;
+  while (!complete) {
+    struct frame_header h;
+    if (frame_read_header(&reader, &h) <= 0) {
+      LOG_ERROR("Connection closed before the reply was received");
+      goto fail;
+    }
+
+    if (h.type == FRAME_ERROR || h.type == FRAME_HELLO) {
+      if (h.length > FRAME_PAYLOAD_MAX ||
+          frame_read_payload(&reader, small, h.length))
+        goto fail;
+    }
+    if (h.type == FRAME_ERROR) {
+      LOG_ERROR("Broker refused the request: %.*s", (int)h.length, small);
+      goto fail;
+    }
+    if (h.type == FRAME_HELLO) {
+      uint8_t version, max_version;
+      uint16_t flags;
+      uint32_t max_payload;
+      if (frame_decode_hello(small, h.length, &version, &max_version, &flags,
+                             &max_payload) ||
+          version < FRAME_VERSION_MIN || version > FRAME_VERSION_MAX) {
+        LOG_ERROR("Broker answered with an unsupported protocol version");
+        goto fail;
+      }
+      reader.max_payload =
+          max_payload < FRAME_BATCH_MAX ? max_payload : FRAME_BATCH_MAX;
+      LOG_DEBUG("Using protocol version %u, frames up to %u bytes", version,
+                reader.max_payload);
+      continue;
+    }
+    if (h.type != FRAME_REPLY || h.request_id != REQUEST_ID) {
+      if (frame_read_payload(&reader, NULL, h.length))
+        goto fail;
+      continue;
+    }
+
+    size_t length = h.length;
+    bool more = h.flags & FRAME_FLAG_MORE;
+    if (h.flags & FRAME_FLAG_SIZED) {
+      // the whole reply is announced, allocate it once
+      if (received != 0 || length < FRAME_SIZE_PREFIX ||
+          frame_read_payload(&reader, small, FRAME_SIZE_PREFIX))
+        goto fail;
+      length -= FRAME_SIZE_PREFIX;
+      total = frame_decode_size(small);
+      if (total > max_len) {
+        LOG_ERROR("Reply exceeds maximum allowed size (%zu)", max_len);
+        goto fail;
+      }
+      buf = grow(buf, &size, 0, total, false, max_len);
+      if (buf == NULL) {
+        LOG_ERROR("Failed to allocate memory for the reply");
+        goto fail;
+      }
+    }
+
+    if (received + length > max_len) {
+      LOG_ERROR("Reply exceeds maximum allowed size (%zu)", max_len);
+      goto fail;
+    }
+    char *grown = grow(buf, &size, received, length, more, max_len);
+    if (grown == NULL) {
+      LOG_ERROR("Failed to allocate memory for the reply");
+      goto fail;
+    }
+    buf = grown;
+    if (frame_read_payload(&reader, buf + received, length)) {
+      LOG_ERROR("Connection closed before the reply was received");
+      goto fail;
+    }
+    received += length;
+    frames++;
+    complete = !more;
+
+    double now = now_s();
+    if (!complete && now - last_progress >= PROGRESS_INTERVAL_S) {
+      if (total != 0)
+        LOG_INFO("Received %zu of %zu bytes, %.1f MB/s", received,
+                 (size_t)total, received / (now - start) / 1e6);
+      else
+        LOG_INFO("Received %zu bytes so far, %.1f MB/s", received,
+                 received / (now - start) / 1e6);
+      last_progress = now;
+    }
+  }
+
+  char *grown = grow(buf, &size, received, 0, false, max_len);
+  if (grown == NULL) {
+    LOG_ERROR("Failed to allocate memory for the reply");
+    goto fail;
+  }
+  buf = grown;
+  buf[received] = '\0';
+  *len = received;
+  LOG_DEBUG("Received %zu bytes in %u frames", received, frames);
+  secure_free(in);
+  return buf;
+
+fail:
+  secure_free(buf);
+  secure_free(in);
+  return NULL;
+}
+
+char *frame_client_call(rats_tls_handle handle, const char *command,
+                        size_t max_len, size_t *len) {
+  if (send_request(handle, command))
+    return NULL;
+  return receive_reply(handle, max_len, len);
+}
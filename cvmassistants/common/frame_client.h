@@ -0,0 +1,17 @@
+#ifndef CONKER_FRAME_CLIENT_H
+#define CONKER_FRAME_CLIENT_H
+
+#include <stddef.h>
+#include <rats-tls/api.h>
+
+// Client side of the framed protocol (frame.h) for agents asking a broker
+// for one thing: HELLO, the request and BYE go out in one transmit, then the
+// reply is collected frame by frame.
+//
+// Returns the reply NUL terminated in locked memory, release it with
+// secure_free(), and its length in *len. NULL when the broker answered with
+// an error, the session broke off or the reply exceeds max_len bytes.
+char *frame_client_call(rats_tls_handle handle, const char *command,
+                        size_t max_len, size_t *len);
+
+#endif
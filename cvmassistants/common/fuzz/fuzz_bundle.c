@@ -0,0 +1,30 @@
+// Secret bundle validation and lookups, on the input as the mapped file.
+
+#include "../secret_bundle.c"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  struct secret_bundle bundle = {.base = data, .size = size};
+  if (validate(&bundle))
+    return 0;
+
+  static const uint8_t key[SECRET_BUNDLE_KEY_SIZE];
+  static uint8_t plain[1 << 16];
+  for (uint32_t i = 0; i < bundle.count; i++) {
+    struct secret_bundle_entry entry, found;
+    entry_at(&bundle, i, &entry);
+
+    char app_id[256];
+    if (entry.app_id_len < sizeof(app_id)) {
+      memcpy(app_id, entry.app_id, entry.app_id_len);
+      app_id[entry.app_id_len] = '\0';
+      // an embedded NUL makes a different, shorter appId
+      if (secret_bundle_find(&bundle, app_id, &found) == 0 &&
+          strlen(app_id) == entry.app_id_len && found.blob != entry.blob)
+        abort();
+    }
+    if ((entry.flags & SECRET_BUNDLE_ENTRY_SEALED) &&
+        secret_bundle_plain_len(&entry) <= sizeof(plain))
+      secret_bundle_unseal(&entry, key, plain);
+  }
+  return 0;
+}
@@ -0,0 +1,36 @@
+// Agent side: frame_client_call() against an arbitrary broker reply stream,
+// first input byte picks the receive split. Every secure allocation must be
+// released whatever the broker sends.
+
+#include "frame_client.h"
+#include "log.h"
+#include "secure_mem.h"
+#include "transport_stub.h"
+
+#include <stdlib.h>
+
+#define REPLY_MAX (256 * 1024)
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  static bool initialized;
+  if (!initialized) {
+    app_log_level = LOG_LEVEL_NONE;
+    secure_pool_init(SECURE_POOL_DEFAULT_SIZE);
+    initialized = true;
+  }
+  if (size < 1)
+    return 0;
+  transport_stub_feed(data + 1, size - 1, data[0]);
+
+  uint64_t in_use = secure_in_use();
+  size_t len = 0;
+  char *reply = frame_client_call(NULL, "getSecret", REPLY_MAX, &len);
+  if (reply != NULL) {
+    if (len > REPLY_MAX || reply[len] != '\0')
+      abort();
+    secure_free(reply);
+  }
+  if (secure_in_use() != in_use)
+    abort();
+  return 0;
+}
@@ -0,0 +1,25 @@
+// Configuration parser, including the hex measurements and the lookups a
+// parsed snapshot serves.
+
+#include "broker_config.h"
+
+#include <stdlib.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  struct broker_config *cfg =
+      broker_config_parse((const char *)data, size, "fuzz");
+  if (cfg == NULL)
+    return 0;
+
+  static const char *app_ids[] = {"", "a", "my-app", "zzzz"};
+  for (size_t i = 0; i < sizeof(app_ids) / sizeof(app_ids[0]); i++) {
+    struct broker_secret secret;
+    broker_config_find_secret(cfg, app_ids[i], &secret);
+  }
+  uint8_t digest[BROKER_MEASUREMENT_MAX] = {0};
+  broker_config_has_measurement(cfg, digest, 32);
+  broker_config_has_measurement(cfg, digest, sizeof(digest));
+
+  broker_config_free(cfg);
+  return 0;
+}
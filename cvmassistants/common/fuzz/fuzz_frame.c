@@ -0,0 +1,46 @@
+// Frame reader and HELLO decoder on arbitrary streams. The first input byte
+// picks how the stream is split across receives.
+
+#include "frame.h"
+#include "transport_stub.h"
+
+#include <rats-tls/api.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int receive(void *ctx, void *buf, size_t *len) {
+  return rats_tls_receive(ctx, buf, len) != RATS_TLS_ERR_NONE;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  static uint8_t buf[FRAME_READER_BUFFER];
+  if (size < 1)
+    return 0;
+  transport_stub_feed(data + 1, size - 1, data[0]);
+
+  struct frame_reader reader;
+  frame_reader_init(&reader, buf, receive, NULL);
+  struct frame_header h;
+  const uint8_t *payload;
+  while (frame_read(&reader, &h, &payload) > 0) {
+    if (h.length > FRAME_PAYLOAD_MAX ||
+        payload + h.length > buf + FRAME_READER_BUFFER)
+      abort();
+
+    // what was decoded encodes back to the same header
+    uint8_t encoded[FRAME_HEADER_SIZE];
+    frame_encode_header(encoded, &h);
+    if (memcmp(encoded, payload - FRAME_HEADER_SIZE, FRAME_HEADER_SIZE))
+      abort();
+
+    uint8_t min_version, max_version;
+    uint16_t flags;
+    uint32_t max_payload;
+    if (h.type == FRAME_HELLO &&
+        !frame_decode_hello(payload, h.length, &min_version, &max_version,
+                            &flags, &max_payload) &&
+        (min_version > max_version || max_payload < FRAME_PAYLOAD_MAX))
+      abort();
+  }
+  return 0;
+}
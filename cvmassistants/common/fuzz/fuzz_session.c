@@ -0,0 +1,53 @@
+// Broker side: a whole client session, framed or bare, through the real
+// serve_client() of broker_server.c with a few test handlers. The first input
+// byte picks the receive split.
+
+#include "../broker_server.c"
+#include "transport_stub.h"
+
+static void serve_echo(struct broker_request *req) {
+  broker_reply(req, req->command, strlen(req->command));
+}
+
+// spans several frames
+static void serve_large(struct broker_request *req) {
+  static uint8_t reply[3 * FRAME_PAYLOAD_MAX + 17];
+  broker_reply(req, reply, sizeof(reply));
+}
+
+static void serve_nothing(struct broker_request *req) {}
+
+static const struct broker_handler fuzz_handlers[] = {
+    {"echo", serve_echo},
+    {"large", serve_large},
+    {"nothing", serve_nothing},
+    {NULL, NULL},
+};
+
+static const struct broker_server fuzz_server = {
+    .name = "fuzz",
+    .handlers = fuzz_handlers,
+};
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  static struct worker w;
+  if (server == NULL) {
+    server = &fuzz_server;
+    secure_pool_init(SECURE_POOL_DEFAULT_SIZE);
+    w.in = secure_alloc(FRAME_READER_BUFFER);
+    w.out = secure_alloc(FRAME_HEADER_SIZE + FRAME_PAYLOAD_MAX);
+    if (w.in == NULL || w.out == NULL ||
+        arena_init(&w.arena, ARENA_DEFAULT_SIZE))
+      abort();
+  }
+  if (size < 1)
+    return 0;
+  transport_stub_feed(data + 1, size - 1, data[0]);
+
+  uint64_t in_use = secure_in_use();
+  serve_client(&w, -1);
+  arena_reset(&w.arena);
+  if (secure_in_use() != in_use)
+    abort();
+  return 0;
+}
@@ -0,0 +1,21 @@
+#ifndef CONKER_TRANSPORT_STUB_H
+#define CONKER_TRANSPORT_STUB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// -----------------------------------------------------------------------------
+// In-memory stand-in for rats-tls, linked instead of librats_tls by the
+// fuzzers and the parser benchmark. The handshake always succeeds; receives
+// return the bytes given to transport_stub_feed(), at most chunk at a time
+// (0: all that is left) so that frames arrive split at every boundary, then
+// end of stream. Transmits are counted and dropped.
+// -----------------------------------------------------------------------------
+
+void transport_stub_feed(const uint8_t *data, size_t len, size_t chunk);
+
+// Bytes transmitted and receive calls since the last feed.
+size_t transport_stub_sent(void);
+size_t transport_stub_receives(void);
+
+#endif
@@ -0,0 +1,278 @@
+#include "handle_pool.h"
+#include "admission.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <rats-tls/log.h>
+
+#define RETRY_S 1 // after rats_tls_init() failed in the background
+
+enum slot_state { SLOT_EMPTY, SLOT_IDLE, SLOT_IN_USE, SLOT_REPLACING };
+
+struct slot {
+  rats_tls_handle handle;
+  uint64_t expires_ms; // monotonic_ms(), UINT64_MAX without rotation
+  enum slot_state state;
+};
+
+struct handle_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t available; // a slot became idle
+  pthread_cond_t changed;   // wakes the refill thread
+  const rats_tls_conf_t *conf;
+  rats_tls_callback_t cb;
+  uint64_t rotate_ms;
+  struct slot *slots;
+  size_t size;
+  unsigned *idle; // stack of idle slot indexes
+  size_t idle_count;
+  atomic_uint_fast64_t rotations;
+  atomic_uint_fast64_t failures;
+};
+
+struct warm_up {
+  struct handle_pool *pool;
+  struct slot *slot;
+  rats_tls_err_t err;
+};
+
+static rats_tls_err_t create_handle(struct handle_pool *pool,
+                                    rats_tls_handle *handle) {
+  rats_tls_err_t ret = rats_tls_init(pool->conf, handle);
+  if (ret != RATS_TLS_ERR_NONE)
+    return ret;
+  ret = rats_tls_set_verification_callback(handle, pool->cb);
+  if (ret != RATS_TLS_ERR_NONE)
+    rats_tls_cleanup(*handle);
+  return ret;
+}
+
+static uint64_t expiry_ms(struct handle_pool *pool, uint64_t now) {
+  return pool->rotate_ms == 0 ? UINT64_MAX : now + pool->rotate_ms;
+}
+
+static void push_idle(struct handle_pool *pool, unsigned i) {
+  pool->slots[i].state = SLOT_IDLE;
+  pool->idle[pool->idle_count++] = i;
+  pthread_cond_signal(&pool->available);
+}
+
+// The slot the refill thread should work on next: an empty one, else the
+// idle one expired first. Returns -1 when there is none and sets wake_ms to
+// when the next handle expires.
+static int next_refill(struct handle_pool *pool, uint64_t now, uint64_t *wake_ms) {
+  int expired = -1;
+  *wake_ms = UINT64_MAX;
+  for (size_t i = 0; i < pool->size; i++) {
+    struct slot *s = &pool->slots[i];
+    if (s->state == SLOT_EMPTY)
+      return i;
+    if (s->state == SLOT_IDLE && s->expires_ms <= now &&
+        (expired < 0 || s->expires_ms < pool->slots[expired].expires_ms))
+      expired = i;
+    else if (s->state != SLOT_REPLACING && s->expires_ms > now &&
+             s->expires_ms < *wake_ms) // expired in use: see give()
+      *wake_ms = s->expires_ms;
+  }
+  return expired;
+}
+
+static void wait_until(struct handle_pool *pool, uint64_t wake_ms) {
+  if (wake_ms == UINT64_MAX) {
+    pthread_cond_wait(&pool->changed, &pool->lock);
+    return;
+  }
+  struct timespec ts = {wake_ms / 1000, (wake_ms % 1000) * 1000000};
+  pthread_cond_timedwait(&pool->changed, &pool->lock, &ts);
+}
+
+// Refill thread: replaces handles cleaned up when given back expired, and
+// idle ones that expired, one at a time so that the others keep serving.
+static void *refill_main(void *arg) {
+  struct handle_pool *pool = arg;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    uint64_t wake_ms;
+    int i = next_refill(pool, monotonic_ms(), &wake_ms);
+    if (i < 0) {
+      wait_until(pool, wake_ms);
+      continue;
+    }
+
+    struct slot *s = &pool->slots[i];
+    rats_tls_handle old = NULL;
+    if (s->state == SLOT_IDLE) {
+      for (size_t k = 0; k < pool->idle_count; k++) {
+        if (pool->idle[k] == (unsigned)i) {
+          pool->idle[k] = pool->idle[--pool->idle_count];
+          break;
+        }
+      }
+      old = s->handle;
+    }
+    s->state = SLOT_REPLACING;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (old != NULL) {
+      rats_tls_cleanup(old);
+      atomic_fetch_add(&pool->rotations, 1);
+    }
+    rats_tls_handle handle;
+    rats_tls_err_t ret = create_handle(pool, &handle);
+    if (ret != RATS_TLS_ERR_NONE) {
+      RTLS_ERR("Failed to renew a rats-tls handle %#x\n", ret);
+      atomic_fetch_add(&pool->failures, 1);
+      sleep(RETRY_S);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (ret != RATS_TLS_ERR_NONE) {
+      s->handle = NULL;
+      s->state = SLOT_EMPTY;
+      continue;
+    }
+    s->handle = handle;
+    s->expires_ms = expiry_ms(pool, monotonic_ms());
+    push_idle(pool, i);
+  }
+  return NULL;
+}
+
+static void *warm_up_main(void *arg) {
+  struct warm_up *w = arg;
+  w->err = create_handle(w->pool, &w->slot->handle);
+  return NULL;
+}
+
+struct handle_pool *handle_pool_new(const rats_tls_conf_t *conf, size_t size,
+                                    unsigned rotate_s, rats_tls_callback_t cb) {
+  if (size == 0)
+    return NULL;
+
+  struct handle_pool *pool = calloc(1, sizeof(struct handle_pool));
+  struct warm_up *warm = calloc(size, sizeof(struct warm_up));
+  pthread_t *threads = calloc(size, sizeof(pthread_t));
+  if (pool == NULL || warm == NULL || threads == NULL)
+    goto err;
+  pool->slots = calloc(size, sizeof(struct slot));
+  pool->idle = calloc(size, sizeof(unsigned));
+  if (pool->slots == NULL || pool->idle == NULL)
+    goto err;
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // monotonic_ms()
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->available, NULL);
+  pthread_cond_init(&pool->changed, &attr);
+  pthread_condattr_destroy(&attr);
+  pool->conf = conf;
+  pool->cb = cb;
+  pool->rotate_ms = (uint64_t)rotate_s * 1000;
+  pool->size = size;
+
+  // evidence generation dominates, create the handles side by side
+  size_t started = 0;
+  for (; started < size; started++) {
+    warm[started] = (struct warm_up){pool, &pool->slots[started], 0};
+    if (pthread_create(&threads[started], NULL, warm_up_main,
+                       &warm[started]) != 0)
+      break;
+  }
+  bool ok = started == size;
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+    if (warm[i].err != RATS_TLS_ERR_NONE) {
+      RTLS_ERR("Failed to initialize rats tls %#x\n", warm[i].err);
+      ok = false;
+    }
+  }
+  if (!ok) {
+    for (size_t i = 0; i < started; i++)
+      if (warm[i].err == RATS_TLS_ERR_NONE)
+        rats_tls_cleanup(pool->slots[i].handle);
+    goto err;
+  }
+
+  // spread the expiry over the period so that handles are renewed one at a
+  // time instead of all together
+  uint64_t now = monotonic_ms();
+  for (size_t i = 0; i < size; i++) {
+    pool->slots[i].expires_ms =
+        expiry_ms(pool, now) - i * pool->rotate_ms / size;
+    push_idle(pool, i);
+  }
+
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, refill_main, pool) != 0) {
+    RTLS_ERR("Failed to start the handle refill thread\n");
+    for (size_t i = 0; i < size; i++)
+      rats_tls_cleanup(pool->slots[i].handle);
+    goto err;
+  }
+  pthread_detach(tid);
+  free(warm);
+  free(threads);
+  return pool;
+
+err:
+  free(warm);
+  free(threads);
+  if (pool != NULL) {
+    free(pool->slots);
+    free(pool->idle);
+  }
+  free(pool);
+  return NULL;
+}
+
+rats_tls_handle handle_pool_take(struct handle_pool *pool, unsigned *slot) {
+  pthread_mutex_lock(&pool->lock);
+  while (pool->idle_count == 0)
+    pthread_cond_wait(&pool->available, &pool->lock);
+  *slot = pool->idle[--pool->idle_count];
+  struct slot *s = &pool->slots[*slot];
+  s->state = SLOT_IN_USE;
+  rats_tls_handle handle = s->handle;
+  pthread_mutex_unlock(&pool->lock);
+  return handle;
+}
+
+void handle_pool_give(struct handle_pool *pool, unsigned slot) {
+  struct slot *s = &pool->slots[slot];
+  rats_tls_handle expired = NULL;
+
+  pthread_mutex_lock(&pool->lock);
+  if (s->expires_ms <= monotonic_ms()) {
+    expired = s->handle;
+    s->handle = NULL;
+    s->state = SLOT_EMPTY;
+    pthread_cond_signal(&pool->changed);
+  } else {
+    push_idle(pool, slot);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  if (expired != NULL) {
+    rats_tls_cleanup(expired);
+    atomic_fetch_add(&pool->rotations, 1);
+  }
+}
+
+size_t handle_pool_idle(struct handle_pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  size_t idle = pool->idle_count;
+  pthread_mutex_unlock(&pool->lock);
+  return idle;
+}
+
+uint64_t handle_pool_rotations(struct handle_pool *pool) {
+  return atomic_load(&pool->rotations);
+}
+
+uint64_t handle_pool_failures(struct handle_pool *pool) {
+  return atomic_load(&pool->failures);
+}
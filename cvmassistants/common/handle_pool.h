@@ -0,0 +1,49 @@
+#ifndef CONKER_HANDLE_POOL_H
+#define CONKER_HANDLE_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <rats-tls/api.h>
+
+// -----------------------------------------------------------------------------
+// Warm pool of server rats-tls handles.
+//
+// rats_tls_init() loads the attester, verifier, TLS and crypto instances and
+// generates the server certificate with its evidence, which takes far longer
+// than a handshake. The pool creates its handles before the broker listens,
+// hands one to a worker per connection and takes it back afterwards, both in
+// constant time under a lock.
+//
+// Handles older than the rotation period are not handed out again: they are
+// cleaned up when returned and replaced by a background thread, so that the
+// certificate and evidence clients see are renewed without a handshake ever
+// waiting for rats_tls_init().
+// -----------------------------------------------------------------------------
+
+struct handle_pool;
+
+// Create size handles, in parallel, and return once all of them are ready.
+// cb is set as the verification callback of every handle; rotate_s of 0
+// keeps handles for the life of the process. Returns NULL when a handle
+// cannot be created.
+struct handle_pool *handle_pool_new(const rats_tls_conf_t *conf, size_t size,
+                                    unsigned rotate_s, rats_tls_callback_t cb);
+
+// Take a ready handle, waiting only when all of them are in use or being
+// replaced. slot receives what to give back.
+rats_tls_handle handle_pool_take(struct handle_pool *pool, unsigned *slot);
+
+// Give back the handle of slot once its connection is closed.
+void handle_pool_give(struct handle_pool *pool, unsigned slot);
+
+// Ready handles not in use.
+size_t handle_pool_idle(struct handle_pool *pool);
+
+// Handles replaced because they reached the rotation period.
+uint64_t handle_pool_rotations(struct handle_pool *pool);
+
+// Replacement handles that rats_tls_init() failed to create.
+uint64_t handle_pool_failures(struct handle_pool *pool);
+
+#endif
@@ -0,0 +1,66 @@
+#include "hex.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static const char hex_digits[16] = "0123456789abcdef";
+
+// digit value + 1, so that 0 marks anything that is not a hex digit
+static const uint8_t hex_values[256] = {
+    ['0'] = 1,  ['1'] = 2,  ['2'] = 3,  ['3'] = 4,  ['4'] = 5,  ['5'] = 6,
+    ['6'] = 7,  ['7'] = 8,  ['8'] = 9,  ['9'] = 10, ['a'] = 11, ['b'] = 12,
+    ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16, ['A'] = 11, ['B'] = 12,
+    ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+#ifdef __SSE2__
+// nibble -> '0' + nibble, plus 'a' - '0' - 10 for nibbles above 9
+static inline __m128i nibbles_to_hex(__m128i n) {
+  __m128i above_nine = _mm_cmpgt_epi8(n, _mm_set1_epi8(9));
+  __m128i digits = _mm_add_epi8(n, _mm_set1_epi8('0'));
+  return _mm_add_epi8(digits,
+                      _mm_and_si128(above_nine, _mm_set1_epi8('a' - '0' - 10)));
+}
+#endif
+
+void hex_encode(char *out, const uint8_t *in, size_t len) {
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i low_mask = _mm_set1_epi8(0x0f);
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+    __m128i hi = nibbles_to_hex(_mm_and_si128(_mm_srli_epi16(v, 4), low_mask));
+    __m128i lo = nibbles_to_hex(_mm_and_si128(v, low_mask));
+    _mm_storeu_si128((__m128i *)(out + 2 * i), _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *)(out + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+  }
+#endif
+  for (; i < len; i++) {
+    out[2 * i] = hex_digits[in[i] >> 4];
+    out[2 * i + 1] = hex_digits[in[i] & 0x0f];
+  }
+  out[2 * len] = '\0';
+}
+
+ssize_t hex_decode(uint8_t *out, const char *in, size_t hex_len) {
+  if (hex_len % 2 != 0)
+    return -1;
+  for (size_t i = 0; i < hex_len / 2; i++) {
+    uint8_t hi = hex_values[(unsigned char)in[2 * i]];
+    uint8_t lo = hex_values[(unsigned char)in[2 * i + 1]];
+    if (hi == 0 || lo == 0)
+      return -1;
+    out[i] = (uint8_t)((hi - 1) << 4 | (lo - 1));
+  }
+  return hex_len / 2;
+}
+
+bool ct_equal(const void *a, const void *b, size_t len) {
+  const volatile uint8_t *pa = a;
+  const volatile uint8_t *pb = b;
+  uint8_t diff = 0;
+  for (size_t i = 0; i < len; i++)
+    diff |= pa[i] ^ pb[i];
+  return diff == 0;
+}
@@ -0,0 +1,28 @@
+#ifndef CONKER_HEX_H
+#define CONKER_HEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// -----------------------------------------------------------------------------
+// Hex codec and digest comparison shared by the assistants.
+//
+// Encoding is table driven, 16 bytes at a time with SSE2 where the compiler
+// targets it (always the case on x86-64). Decoding accepts both cases and
+// may be done in place.
+// -----------------------------------------------------------------------------
+
+// Write 2 * len lowercase hex digits and a terminating NUL to out, which must
+// hold 2 * len + 1 bytes.
+void hex_encode(char *out, const uint8_t *in, size_t len);
+
+// Decode hex_len digits into out, returns the decoded length or -1 on an odd
+// length or an invalid digit. out may alias in.
+ssize_t hex_decode(uint8_t *out, const char *in, size_t hex_len);
+
+// Compare len bytes in time independent of their contents.
+bool ct_equal(const void *a, const void *b, size_t len);
+
+#endif
@@ -0,0 +1,14 @@
+#include "log.h"
+
+#include <strings.h>
+
+int app_log_level = LOG_LEVEL_INFO;
+
+int log_level_parse(const char *name) {
+  static const char *const names[] = {"debug", "info",  "warn",
+                                      "error", "fatal", "off"};
+  for (int level = LOG_LEVEL_DEBUG; level <= LOG_LEVEL_NONE; level++)
+    if (!strcasecmp(name, names[level]))
+      return level;
+  return -1;
+}
@@ -0,0 +1,50 @@
+#ifndef CONKER_LOG_H
+#define CONKER_LOG_H
+
+#include <stdio.h>
+#include <time.h>
+
+// -----------------------------------------------------------------------------
+// Timestamped logging for the agents. The brokers log through rats-tls
+// (RTLS_*), the levels here are in the same order as rats_tls_log_level_t so
+// that one level can drive both.
+// -----------------------------------------------------------------------------
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_FATAL 4
+#define LOG_LEVEL_NONE 5
+
+extern int app_log_level; // LOG_LEVEL_INFO unless changed
+
+// Level named debug, info, warn, error, fatal or off (any case), -1 otherwise.
+int log_level_parse(const char *name);
+
+#define LOG_WITH_TIMESTAMP(fmt, level, associated_level, ...)                  \
+  do {                                                                         \
+    if (app_log_level <= associated_level) {                                   \
+      time_t now = time(NULL);                                                 \
+      struct tm t; /* not gmtime(), callers log from several threads */       \
+      gmtime_r(&now, &t);                                                      \
+      char ts[24];                                                             \
+      strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S UTC", &t);                   \
+      printf("%-29s [%-5s] [%s:%d] " fmt "\n", ts, level, __FILE__, __LINE__,  \
+             ##__VA_ARGS__);                                                   \
+    }                                                                          \
+  } while (0)
+
+#define LOG_DEBUG(fmt, ...)                                                    \
+  LOG_WITH_TIMESTAMP(fmt, "DEBUG", LOG_LEVEL_DEBUG, ##__VA_ARGS__)
+
+#define LOG_INFO(fmt, ...)                                                     \
+  LOG_WITH_TIMESTAMP(fmt, "INFO", LOG_LEVEL_INFO, ##__VA_ARGS__)
+
+#define LOG_WARN(fmt, ...)                                                     \
+  LOG_WITH_TIMESTAMP(fmt, "WARN", LOG_LEVEL_WARN, ##__VA_ARGS__)
+
+#define LOG_ERROR(fmt, ...)                                                    \
+  LOG_WITH_TIMESTAMP(fmt, "ERROR", LOG_LEVEL_ERROR, ##__VA_ARGS__)
+
+#endif
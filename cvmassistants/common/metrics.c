@@ -0,0 +1,117 @@
+#include "metrics.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <rats-tls/api.h>
+#include <rats-tls/log.h>
+
+struct metric {
+  const char *name;
+  const char *type;
+  const char *help;
+  metric_read_fn read;
+  void *arg;
+};
+
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metric metrics[METRICS_MAX];
+static size_t metric_count;
+
+int metrics_register(const char *name, const char *type, const char *help,
+                     metric_read_fn read, void *arg) {
+  int ret = -1;
+  pthread_mutex_lock(&metrics_lock);
+  if (metric_count < METRICS_MAX) {
+    metrics[metric_count++] = (struct metric){name, type, help, read, arg};
+    ret = 0;
+  }
+  pthread_mutex_unlock(&metrics_lock);
+  return ret;
+}
+
+static void write_metrics(int fd) {
+  char *text = NULL;
+  size_t len = 0;
+  FILE *out = open_memstream(&text, &len);
+  if (out == NULL)
+    return;
+
+  pthread_mutex_lock(&metrics_lock);
+  size_t count = metric_count;
+  pthread_mutex_unlock(&metrics_lock);
+
+  // entries are never removed, the first count of them are stable
+  for (size_t i = 0; i < count; i++) {
+    const struct metric *m = &metrics[i];
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %" PRIu64 "\n", m->name,
+            m->help, m->name, m->type, m->name, m->read(m->arg));
+  }
+  fclose(out);
+
+  // the scraper may hang up early, don't let that raise SIGPIPE
+  for (size_t off = 0; off < len;) {
+    ssize_t n = send(fd, text + off, len - off, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    off += n;
+  }
+  free(text);
+}
+
+static void *metrics_main(void *arg) {
+  int listen_fd = (int)(intptr_t)arg;
+
+  for (;;) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EINTR)
+        RTLS_ERR("metrics accept failed: %s\n", strerror(errno));
+      continue;
+    }
+    write_metrics(fd);
+    close(fd);
+  }
+  return NULL;
+}
+
+int metrics_start(const char *socket_path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    RTLS_ERR("metrics socket path too long\n");
+    return -1;
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  unlink(socket_path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(fd, SOMAXCONN) < 0) {
+    RTLS_ERR("failed to listen on %s: %s\n", socket_path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, metrics_main, (void *)(intptr_t)fd) != 0) {
+    close(fd);
+    return -1;
+  }
+  pthread_detach(tid);
+  RTLS_INFO("metrics on %s\n", socket_path);
+  return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef CONKER_METRICS_H
+#define CONKER_METRICS_H
+
+#include <stdint.h>
+
+// -----------------------------------------------------------------------------
+// Broker metrics in the Prometheus text format.
+//
+// Each metric is read through a callback when it is scraped, so queue depths
+// and counters stay owned by the module that maintains them. Connecting to the
+// metrics socket returns one snapshot and closes, e.g.
+//
+//   socat - UNIX-CONNECT:/run/secret-broker.metrics
+// -----------------------------------------------------------------------------
+
+#define METRICS_MAX 32
+
+typedef uint64_t (*metric_read_fn)(void *arg);
+
+// type is "gauge" or "counter". Returns -1 when the table is full.
+int metrics_register(const char *name, const char *type, const char *help,
+                     metric_read_fn read, void *arg);
+
+// Serve the registered metrics on a UNIX socket from a background thread.
+int metrics_start(const char *socket_path);
+
+#endif
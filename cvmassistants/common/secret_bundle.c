@@ -0,0 +1,367 @@
+#include "secret_bundle.h"
+#include "hex.h"
+
+#include <ctype.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+struct secret_bundle {
+  const uint8_t *base;
+  size_t size;
+  const struct secret_bundle_index *index;
+  uint32_t count;
+};
+
+static int compare_app_ids(const char *a, size_t a_len, const char *b,
+                           size_t b_len) {
+  int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+  if (cmp != 0)
+    return cmp;
+  return a_len < b_len ? -1 : (a_len > b_len);
+}
+
+static bool range_valid(const struct secret_bundle *bundle, uint64_t offset,
+                        uint64_t len) {
+  return offset <= bundle->size && len <= bundle->size - offset;
+}
+
+static void entry_at(const struct secret_bundle *bundle, uint32_t i,
+                     struct secret_bundle_entry *entry) {
+  const struct secret_bundle_index *idx = &bundle->index[i];
+  entry->app_id = (const char *)bundle->base + le64toh(idx->app_id_offset);
+  entry->app_id_len = le32toh(idx->app_id_len);
+  entry->blob = bundle->base + le64toh(idx->blob_offset);
+  entry->blob_len = le32toh(idx->blob_len);
+  entry->flags = le32toh(idx->flags);
+}
+
+static int validate(struct secret_bundle *bundle) {
+  const struct secret_bundle_header *hdr =
+      (const struct secret_bundle_header *)bundle->base;
+
+  if (bundle->size < sizeof(*hdr) ||
+      memcmp(hdr->magic, SECRET_BUNDLE_MAGIC, sizeof(hdr->magic)) ||
+      le32toh(hdr->version) != SECRET_BUNDLE_VERSION ||
+      le64toh(hdr->file_size) != bundle->size)
+    return -1;
+
+  uint64_t index_offset = le64toh(hdr->index_offset);
+  bundle->count = le32toh(hdr->entry_count);
+  if (index_offset % sizeof(uint64_t) != 0 ||
+      !range_valid(bundle, index_offset,
+                   (uint64_t)bundle->count * sizeof(struct secret_bundle_index)))
+    return -1;
+  bundle->index =
+      (const struct secret_bundle_index *)(bundle->base + index_offset);
+
+  struct secret_bundle_entry prev = {0}, cur;
+  for (uint32_t i = 0; i < bundle->count; i++) {
+    const struct secret_bundle_index *idx = &bundle->index[i];
+    if (!range_valid(bundle, le64toh(idx->app_id_offset),
+                     le32toh(idx->app_id_len)) ||
+        !range_valid(bundle, le64toh(idx->blob_offset), le32toh(idx->blob_len)))
+      return -1;
+    entry_at(bundle, i, &cur);
+    if (cur.app_id_len == 0 ||
+        ((cur.flags & SECRET_BUNDLE_ENTRY_SEALED) &&
+         cur.blob_len < SECRET_BUNDLE_SEAL_OVERHEAD))
+      return -1;
+    // strictly increasing: lookups rely on it and duplicates are rejected
+    if (i > 0 && compare_app_ids(prev.app_id, prev.app_id_len, cur.app_id,
+                                 cur.app_id_len) >= 0)
+      return -1;
+    prev = cur;
+  }
+  return 0;
+}
+
+struct secret_bundle *secret_bundle_open(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+    close(fd);
+    return NULL;
+  }
+
+  void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return NULL;
+
+  struct secret_bundle *bundle = calloc(1, sizeof(struct secret_bundle));
+  if (bundle == NULL) {
+    munmap(base, st.st_size);
+    return NULL;
+  }
+  bundle->base = base;
+  bundle->size = st.st_size;
+  if (validate(bundle)) {
+    secret_bundle_close(bundle);
+    return NULL;
+  }
+  return bundle;
+}
+
+void secret_bundle_close(struct secret_bundle *bundle) {
+  if (bundle == NULL)
+    return;
+  munmap((void *)bundle->base, bundle->size);
+  free(bundle);
+}
+
+size_t secret_bundle_count(const struct secret_bundle *bundle) {
+  return bundle->count;
+}
+
+int secret_bundle_find(const struct secret_bundle *bundle, const char *app_id,
+                       struct secret_bundle_entry *entry) {
+  size_t app_id_len = strlen(app_id);
+  uint32_t lo = 0, hi = bundle->count;
+
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    entry_at(bundle, mid, entry);
+    int cmp =
+        compare_app_ids(app_id, app_id_len, entry->app_id, entry->app_id_len);
+    if (cmp == 0)
+      return 0;
+    if (cmp < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return -1;
+}
+
+size_t secret_bundle_plain_len(const struct secret_bundle_entry *entry) {
+  if (entry->flags & SECRET_BUNDLE_ENTRY_SEALED)
+    return entry->blob_len - SECRET_BUNDLE_SEAL_OVERHEAD;
+  return entry->blob_len;
+}
+
+int secret_bundle_unseal(const struct secret_bundle_entry *entry,
+                         const uint8_t key[SECRET_BUNDLE_KEY_SIZE],
+                         uint8_t *out) {
+  const uint8_t *nonce = entry->blob;
+  const uint8_t *tag = nonce + SECRET_BUNDLE_NONCE_SIZE;
+  const uint8_t *cipher = tag + SECRET_BUNDLE_TAG_SIZE;
+  int cipher_len = (int)secret_bundle_plain_len(entry);
+  int len, ret = -1;
+
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  if (ctx == NULL)
+    return -1;
+  if (EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, nonce) == 1 &&
+      EVP_DecryptUpdate(ctx, NULL, &len, (const uint8_t *)entry->app_id,
+                        (int)entry->app_id_len) == 1 &&
+      EVP_DecryptUpdate(ctx, out, &len, cipher, cipher_len) == 1 &&
+      EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, SECRET_BUNDLE_TAG_SIZE,
+                          (void *)tag) == 1 &&
+      EVP_DecryptFinal_ex(ctx, out + len, &len) == 1)
+    ret = 0;
+  EVP_CIPHER_CTX_free(ctx);
+  return ret;
+}
+
+static int seal(const struct secret_bundle_input *in, const uint8_t *key,
+                uint8_t *out) {
+  uint8_t *nonce = out;
+  uint8_t *tag = nonce + SECRET_BUNDLE_NONCE_SIZE;
+  uint8_t *cipher = tag + SECRET_BUNDLE_TAG_SIZE;
+  int len, ret = -1;
+
+  if (RAND_bytes(nonce, SECRET_BUNDLE_NONCE_SIZE) != 1)
+    return -1;
+
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  if (ctx == NULL)
+    return -1;
+  if (EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, nonce) == 1 &&
+      EVP_EncryptUpdate(ctx, NULL, &len, (const uint8_t *)in->app_id,
+                        (int)strlen(in->app_id)) == 1 &&
+      EVP_EncryptUpdate(ctx, cipher, &len, in->secret, (int)in->secret_len) ==
+          1 &&
+      EVP_EncryptFinal_ex(ctx, cipher + len, &len) == 1 &&
+      EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, SECRET_BUNDLE_TAG_SIZE,
+                          tag) == 1)
+    ret = 0;
+  EVP_CIPHER_CTX_free(ctx);
+  return ret;
+}
+
+int secret_bundle_load_key(const char *path,
+                           uint8_t key[SECRET_BUNDLE_KEY_SIZE]) {
+  char buf[2 * SECRET_BUNDLE_KEY_SIZE + 2];
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+    return -1;
+  size_t len = fread(buf, 1, sizeof(buf), file);
+  fclose(file);
+
+  if (len == SECRET_BUNDLE_KEY_SIZE) {
+    memcpy(key, buf, SECRET_BUNDLE_KEY_SIZE);
+    return 0;
+  }
+  while (len > 0 && isspace((unsigned char)buf[len - 1]))
+    len--;
+  if (len != 2 * SECRET_BUNDLE_KEY_SIZE)
+    return -1;
+  return hex_decode(key, buf, len) == SECRET_BUNDLE_KEY_SIZE ? 0 : -1;
+}
+
+static int compare_inputs(const void *a, const void *b) {
+  const struct secret_bundle_input *ia = a;
+  const struct secret_bundle_input *ib = b;
+  return compare_app_ids(ia->app_id, strlen(ia->app_id), ib->app_id,
+                         strlen(ib->app_id));
+}
+
+static uint64_t align_up(uint64_t v) {
+  return (v + SECRET_BUNDLE_ALIGN - 1) & ~(uint64_t)(SECRET_BUNDLE_ALIGN - 1);
+}
+
+static int write_padding(FILE *file, uint64_t *pos, uint64_t target) {
+  static const uint8_t zeros[SECRET_BUNDLE_ALIGN];
+  if (target > *pos && fwrite(zeros, 1, target - *pos, file) != target - *pos)
+    return -1;
+  *pos = target;
+  return 0;
+}
+
+static int write_entries(FILE *file, struct secret_bundle_input *inputs,
+                         size_t count, const uint8_t *key) {
+  size_t overhead = key != NULL ? SECRET_BUNDLE_SEAL_OVERHEAD : 0;
+  struct secret_bundle_header hdr;
+  uint64_t pos = 0;
+
+  // compute the layout first so the index can be written in one pass
+  uint64_t names_offset =
+      sizeof(hdr) + (uint64_t)count * sizeof(struct secret_bundle_index);
+  uint64_t end = names_offset;
+  for (size_t i = 0; i < count; i++)
+    end += strlen(inputs[i].app_id);
+  for (size_t i = 0; i < count; i++)
+    end = align_up(end) + inputs[i].secret_len + overhead;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, SECRET_BUNDLE_MAGIC, sizeof(hdr.magic));
+  hdr.version = htole32(SECRET_BUNDLE_VERSION);
+  hdr.entry_count = htole32((uint32_t)count);
+  hdr.index_offset = htole64(sizeof(hdr));
+  hdr.file_size = htole64(end);
+  if (fwrite(&hdr, sizeof(hdr), 1, file) != 1)
+    return -1;
+  pos += sizeof(hdr);
+
+  uint64_t name_pos = names_offset;
+  uint64_t blob_pos = names_offset;
+  for (size_t i = 0; i < count; i++)
+    blob_pos += strlen(inputs[i].app_id);
+  for (size_t i = 0; i < count; i++) {
+    struct secret_bundle_index idx;
+    memset(&idx, 0, sizeof(idx));
+    blob_pos = align_up(blob_pos);
+    idx.app_id_offset = htole64(name_pos);
+    idx.app_id_len = htole32((uint32_t)strlen(inputs[i].app_id));
+    idx.blob_offset = htole64(blob_pos);
+    idx.blob_len = htole32((uint32_t)(inputs[i].secret_len + overhead));
+    idx.flags = htole32(key != NULL ? SECRET_BUNDLE_ENTRY_SEALED : 0);
+    if (fwrite(&idx, sizeof(idx), 1, file) != 1)
+      return -1;
+    name_pos += strlen(inputs[i].app_id);
+    blob_pos += inputs[i].secret_len + overhead;
+  }
+  pos += count * sizeof(struct secret_bundle_index);
+
+  for (size_t i = 0; i < count; i++) {
+    size_t len = strlen(inputs[i].app_id);
+    if (fwrite(inputs[i].app_id, 1, len, file) != len)
+      return -1;
+    pos += len;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    if (write_padding(file, &pos, align_up(pos)))
+      return -1;
+    size_t len = inputs[i].secret_len + overhead;
+    if (key == NULL) {
+      if (fwrite(inputs[i].secret, 1, len, file) != len)
+        return -1;
+    } else {
+      uint8_t *sealed = malloc(len);
+      if (sealed == NULL)
+        return -1;
+      int ret = seal(&inputs[i], key, sealed);
+      if (ret == 0 && fwrite(sealed, 1, len, file) != len)
+        ret = -1;
+      free(sealed);
+      if (ret)
+        return -1;
+    }
+    pos += len;
+  }
+  return pos == end ? 0 : -1;
+}
+
+int secret_bundle_write(const char *path, struct secret_bundle_input *inputs,
+                        size_t count, const uint8_t *key) {
+  qsort(inputs, count, sizeof(struct secret_bundle_input), compare_inputs);
+  for (size_t i = 0; i < count; i++) {
+    if (inputs[i].app_id[0] == '\0' ||
+        inputs[i].secret_len > UINT32_MAX - SECRET_BUNDLE_SEAL_OVERHEAD ||
+        (i > 0 && !compare_inputs(&inputs[i - 1], &inputs[i])))
+      return -1;
+  }
+
+  char tmp_path[4096];
+  if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%d", path, getpid()) >=
+      (int)sizeof(tmp_path))
+    return -1;
+
+  // owner only: the bundle may hold plain secrets, and rename() keeps the mode
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                S_IRUSR | S_IWUSR);
+  if (fd < 0)
+    return -1;
+  FILE *file = fdopen(fd, "w");
+  if (file == NULL) {
+    close(fd);
+    unlink(tmp_path);
+    return -1;
+  }
+  int ret = write_entries(file, inputs, count, key);
+  if (fflush(file) != 0 || fsync(fileno(file)) != 0)
+    ret = -1;
+  if (fclose(file) != 0)
+    ret = -1;
+  if (ret == 0 && rename(tmp_path, path) != 0)
+    ret = -1;
+  if (ret != 0) {
+    unlink(tmp_path);
+    return -1;
+  }
+
+  // make the rename itself durable
+  char dir_copy[4096];
+  snprintf(dir_copy, sizeof(dir_copy), "%s", path);
+  int dir_fd = open(dirname(dir_copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd >= 0) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+  return 0;
+}
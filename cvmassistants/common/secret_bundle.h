@@ -0,0 +1,99 @@
+#ifndef CONKER_SECRET_BUNDLE_H
+#define CONKER_SECRET_BUNDLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// -----------------------------------------------------------------------------
+// Secret bundle: all per-app secrets of a broker in a single read-only file.
+//
+// Layout, all integers little-endian:
+//
+//   header   struct secret_bundle_header, 64 bytes
+//   index    entry_count x struct secret_bundle_index, sorted by appId
+//   names    appId strings, not NUL terminated
+//   blobs    one per entry, each aligned to SECRET_BUNDLE_ALIGN
+//
+// A sealed blob is nonce[12] | tag[16] | AES-256-GCM ciphertext with the appId
+// as additional data; plain blobs are the secret bytes themselves.
+//
+// The broker maps the file read-only and serves plain entries straight from
+// the mapping. Bundles are published by writing a new file next to the old one
+// and renaming it into place, see secret_bundle_write().
+// -----------------------------------------------------------------------------
+
+#define SECRET_BUNDLE_MAGIC "CNKRSBND"
+#define SECRET_BUNDLE_VERSION 1
+#define SECRET_BUNDLE_ALIGN 64
+
+#define SECRET_BUNDLE_KEY_SIZE 32
+#define SECRET_BUNDLE_NONCE_SIZE 12
+#define SECRET_BUNDLE_TAG_SIZE 16
+#define SECRET_BUNDLE_SEAL_OVERHEAD                                            \
+  (SECRET_BUNDLE_NONCE_SIZE + SECRET_BUNDLE_TAG_SIZE)
+
+// entry flags
+#define SECRET_BUNDLE_ENTRY_SEALED 0x1
+
+struct secret_bundle_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_count;
+  uint64_t index_offset;
+  uint64_t file_size;
+  uint8_t reserved[32];
+};
+
+struct secret_bundle_index {
+  uint64_t app_id_offset;
+  uint64_t blob_offset;
+  uint32_t app_id_len;
+  uint32_t blob_len;
+  uint32_t flags;
+  uint32_t reserved;
+};
+
+struct secret_bundle;
+
+struct secret_bundle_entry {
+  const uint8_t *blob;
+  size_t blob_len;
+  const char *app_id;
+  size_t app_id_len;
+  uint32_t flags;
+};
+
+// Map and validate a bundle, NULL on error. Every offset is checked here so
+// that lookups never need to.
+struct secret_bundle *secret_bundle_open(const char *path);
+void secret_bundle_close(struct secret_bundle *bundle);
+size_t secret_bundle_count(const struct secret_bundle *bundle);
+
+// Returns 0 and fills entry when app_id is present, -1 otherwise.
+int secret_bundle_find(const struct secret_bundle *bundle, const char *app_id,
+                       struct secret_bundle_entry *entry);
+
+// Size of the plaintext behind an entry.
+size_t secret_bundle_plain_len(const struct secret_bundle_entry *entry);
+
+// Decrypt a sealed entry into out (secret_bundle_plain_len() bytes).
+int secret_bundle_unseal(const struct secret_bundle_entry *entry,
+                         const uint8_t key[SECRET_BUNDLE_KEY_SIZE],
+                         uint8_t *out);
+
+// Read a key file holding either 32 raw bytes or 64 hex characters.
+int secret_bundle_load_key(const char *path,
+                           uint8_t key[SECRET_BUNDLE_KEY_SIZE]);
+
+struct secret_bundle_input {
+  const char *app_id;
+  const uint8_t *secret;
+  size_t secret_len;
+};
+
+// Write a bundle to path through a temporary file and rename(2), sealing every
+// blob when key is not NULL. Sorts inputs in place.
+int secret_bundle_write(const char *path, struct secret_bundle_input *inputs,
+                        size_t count, const uint8_t *key);
+
+#endif
@@ -0,0 +1,636 @@
+#include "secret_store.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <rats-tls/api.h>
+#include <rats-tls/log.h>
+
+#define SNAPSHOT_MAGIC "CNKRSTOR"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER_SIZE 12
+
+#define RECORD_HEADER_SIZE 13
+#define OP_PUT 1
+#define OP_DELETE 2
+
+// compact once the log is larger than this and than twice the live data
+#define COMPACT_MIN_BYTES (4 * 1024 * 1024)
+#define INITIAL_BUCKETS 1024
+
+struct store_entry {
+  struct store_entry *next;
+  uint32_t hash;
+  uint32_t key_len;
+  uint32_t value_len;
+  uint8_t data[]; // key followed by value
+};
+
+struct secret_store {
+  char *dir;
+  int lock_fd;
+  int wal_fd;
+  uint64_t wal_size;
+
+  pthread_rwlock_t index_lock;
+  struct store_entry **buckets;
+  size_t bucket_count;
+  size_t entry_count;
+  uint64_t live_bytes;
+
+  // group commit state, protected by commit_lock
+  pthread_mutex_t commit_lock;
+  pthread_cond_t committed;
+  uint8_t *pending;
+  size_t pending_len;
+  size_t pending_cap;
+  uint64_t next_seq;
+  uint64_t durable_seq;
+  bool flushing;
+  bool failed;
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++)
+      c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+    crc_table[i] = c;
+  }
+}
+
+static uint32_t crc32(const uint8_t *buf, size_t len) {
+  uint32_t c = 0xffffffffu;
+  for (size_t i = 0; i < len; i++)
+    c = crc_table[(c ^ buf[i]) & 0xff] ^ (c >> 8);
+  return c ^ 0xffffffffu;
+}
+
+static uint32_t hash_key(const uint8_t *key, size_t len) {
+  uint32_t h = 2166136261u; // FNV-1a
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ key[i]) * 16777619u;
+  return h;
+}
+
+static void free_entry(struct store_entry *e) {
+  explicit_bzero(e->data, e->key_len + e->value_len);
+  free(e);
+}
+
+static struct store_entry **find_slot(struct secret_store *store,
+                                      const uint8_t *key, size_t key_len,
+                                      uint32_t hash) {
+  struct store_entry **slot =
+      &store->buckets[hash & (store->bucket_count - 1)];
+  while (*slot != NULL) {
+    struct store_entry *e = *slot;
+    if (e->hash == hash && e->key_len == key_len &&
+        !memcmp(e->data, key, key_len))
+      break;
+    slot = &e->next;
+  }
+  return slot;
+}
+
+static void grow_index(struct secret_store *store) {
+  size_t count = store->bucket_count * 2;
+  struct store_entry **buckets = calloc(count, sizeof(struct store_entry *));
+  if (buckets == NULL)
+    return; // keep the longer chains
+  for (size_t i = 0; i < store->bucket_count; i++) {
+    struct store_entry *e = store->buckets[i];
+    while (e != NULL) {
+      struct store_entry *next = e->next;
+      e->next = buckets[e->hash & (count - 1)];
+      buckets[e->hash & (count - 1)] = e;
+      e = next;
+    }
+  }
+  free(store->buckets);
+  store->buckets = buckets;
+  store->bucket_count = count;
+}
+
+static int index_put(struct secret_store *store, const uint8_t *key,
+                     uint32_t key_len, const uint8_t *value,
+                     uint32_t value_len) {
+  struct store_entry *e = malloc(sizeof(*e) + key_len + value_len);
+  if (e == NULL)
+    return -1;
+  e->hash = hash_key(key, key_len);
+  e->key_len = key_len;
+  e->value_len = value_len;
+  memcpy(e->data, key, key_len);
+  memcpy(e->data + key_len, value, value_len);
+
+  struct store_entry **slot = find_slot(store, key, key_len, e->hash);
+  if (*slot != NULL) {
+    struct store_entry *old = *slot;
+    e->next = old->next;
+    store->live_bytes -= RECORD_HEADER_SIZE + old->key_len + old->value_len;
+    free_entry(old);
+  } else {
+    e->next = NULL;
+    store->entry_count++;
+  }
+  *slot = e;
+  store->live_bytes += RECORD_HEADER_SIZE + key_len + value_len;
+
+  if (store->entry_count > store->bucket_count)
+    grow_index(store);
+  return 0;
+}
+
+static void index_delete(struct secret_store *store, const uint8_t *key,
+                         uint32_t key_len) {
+  struct store_entry **slot =
+      find_slot(store, key, key_len, hash_key(key, key_len));
+  if (*slot == NULL)
+    return;
+  struct store_entry *old = *slot;
+  *slot = old->next;
+  store->entry_count--;
+  store->live_bytes -= RECORD_HEADER_SIZE + old->key_len + old->value_len;
+  free_entry(old);
+}
+
+static size_t encode_record(uint8_t *out, uint8_t op, const uint8_t *key,
+                            uint32_t key_len, const uint8_t *value,
+                            uint32_t value_len) {
+  uint32_t le_key_len = htole32(key_len);
+  uint32_t le_value_len = htole32(value_len);
+  memcpy(out + 4, &le_key_len, 4);
+  memcpy(out + 8, &le_value_len, 4);
+  out[12] = op;
+  memcpy(out + RECORD_HEADER_SIZE, key, key_len);
+  if (value_len > 0)
+    memcpy(out + RECORD_HEADER_SIZE + key_len, value, value_len);
+
+  size_t len = RECORD_HEADER_SIZE + key_len + value_len;
+  uint32_t crc = htole32(crc32(out + 4, len - 4));
+  memcpy(out, &crc, 4);
+  return len;
+}
+
+// Apply every valid record of buf to the index and return the length of the
+// valid prefix; anything after it is a torn or corrupted tail unless the index
+// ran out of memory, which is reported through failed.
+static size_t apply_records(struct secret_store *store, const uint8_t *buf,
+                            size_t len, bool *failed) {
+  size_t pos = 0;
+  *failed = false;
+  while (len - pos >= RECORD_HEADER_SIZE) {
+    uint32_t crc, key_len, value_len;
+    memcpy(&crc, buf + pos, 4);
+    memcpy(&key_len, buf + pos + 4, 4);
+    memcpy(&value_len, buf + pos + 8, 4);
+    key_len = le32toh(key_len);
+    value_len = le32toh(value_len);
+    uint8_t op = buf[pos + 12];
+
+    if (key_len == 0 || key_len > SECRET_STORE_KEY_MAX ||
+        value_len > SECRET_STORE_VALUE_MAX ||
+        len - pos - RECORD_HEADER_SIZE < (size_t)key_len + value_len)
+      break;
+    size_t rec_len = RECORD_HEADER_SIZE + key_len + value_len;
+    if (le32toh(crc) != crc32(buf + pos + 4, rec_len - 4))
+      break;
+
+    const uint8_t *key = buf + pos + RECORD_HEADER_SIZE;
+    if (op == OP_PUT) {
+      if (index_put(store, key, key_len, key + key_len, value_len)) {
+        *failed = true;
+        break;
+      }
+    } else if (op == OP_DELETE) {
+      index_delete(store, key, key_len);
+    } else {
+      break;
+    }
+    pos += rec_len;
+  }
+  return pos;
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static uint8_t *read_whole_file(const char *path, size_t *len) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  uint8_t *buf = NULL;
+  if (fstat(fd, &st) == 0 && (buf = malloc(st.st_size + 1)) != NULL) {
+    size_t pos = 0;
+    while (pos < (size_t)st.st_size) {
+      ssize_t n = read(fd, buf + pos, st.st_size - pos);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      pos += n;
+    }
+    *len = pos;
+  }
+  close(fd);
+  return buf;
+}
+
+static char *store_path(const struct secret_store *store, const char *name) {
+  size_t len = strlen(store->dir) + strlen(name) + 2;
+  char *path = malloc(len);
+  if (path != NULL)
+    snprintf(path, len, "%s/%s", store->dir, name);
+  return path;
+}
+
+static int sync_dir(const char *dir) {
+  int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  int ret = fsync(fd);
+  close(fd);
+  return ret;
+}
+
+static int load_snapshot(struct secret_store *store) {
+  char *path = store_path(store, "snapshot");
+  if (path == NULL)
+    return -1;
+
+  size_t len = 0;
+  uint8_t *buf = read_whole_file(path, &len);
+  int ret = 0;
+  if (buf == NULL) {
+    ret = errno == ENOENT ? 0 : -1;
+  } else {
+    uint32_t version = 0;
+    bool failed;
+    if (len >= SNAPSHOT_HEADER_SIZE)
+      memcpy(&version, buf + 8, 4);
+    // snapshots are renamed into place complete, any damage is fatal
+    if (len < SNAPSHOT_HEADER_SIZE ||
+        memcmp(buf, SNAPSHOT_MAGIC, 8) != 0 ||
+        le32toh(version) != SNAPSHOT_VERSION ||
+        apply_records(store, buf + SNAPSHOT_HEADER_SIZE,
+                      len - SNAPSHOT_HEADER_SIZE,
+                      &failed) != len - SNAPSHOT_HEADER_SIZE) {
+      RTLS_ERR("corrupted secret store snapshot %s\n", path);
+      ret = -1;
+    }
+    explicit_bzero(buf, len);
+    free(buf);
+  }
+  free(path);
+  return ret;
+}
+
+static int replay_wal(struct secret_store *store) {
+  char *path = store_path(store, "wal");
+  if (path == NULL)
+    return -1;
+
+  store->wal_fd =
+      open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  if (store->wal_fd < 0) {
+    RTLS_ERR("failed to open %s: %s\n", path, strerror(errno));
+    free(path);
+    return -1;
+  }
+
+  size_t len = 0;
+  uint8_t *buf = read_whole_file(path, &len);
+  int ret = 0;
+  if (buf != NULL) {
+    bool failed;
+    size_t valid = apply_records(store, buf, len, &failed);
+    if (failed) {
+      RTLS_ERR("out of memory replaying %s\n", path);
+      ret = -1;
+    } else if (valid != len) {
+      RTLS_WARN("dropping %zu bytes of torn log tail in %s\n", len - valid,
+                path);
+      if (ftruncate(store->wal_fd, valid) || fdatasync(store->wal_fd))
+        ret = -1;
+    }
+    store->wal_size = valid;
+    explicit_bzero(buf, len);
+    free(buf);
+  } else {
+    ret = -1;
+  }
+  free(path);
+  return ret;
+}
+
+struct secret_store *secret_store_open(const char *dir) {
+  pthread_once(&crc_once, crc_init);
+
+  if (mkdir(dir, S_IRWXU) < 0 && errno != EEXIST) {
+    RTLS_ERR("failed to create secret store %s: %s\n", dir, strerror(errno));
+    return NULL;
+  }
+
+  struct secret_store *store = calloc(1, sizeof(struct secret_store));
+  if (store == NULL)
+    return NULL;
+  store->lock_fd = -1;
+  store->wal_fd = -1;
+  store->dir = strdup(dir);
+  store->bucket_count = INITIAL_BUCKETS;
+  store->buckets = calloc(store->bucket_count, sizeof(struct store_entry *));
+  pthread_rwlock_init(&store->index_lock, NULL);
+  pthread_mutex_init(&store->commit_lock, NULL);
+  pthread_cond_init(&store->committed, NULL);
+  if (store->dir == NULL || store->buckets == NULL)
+    goto err;
+
+  char *lock_path = store_path(store, "LOCK");
+  if (lock_path == NULL)
+    goto err;
+  store->lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  free(lock_path);
+  if (store->lock_fd < 0 || flock(store->lock_fd, LOCK_EX | LOCK_NB) < 0) {
+    RTLS_ERR("secret store %s is in use\n", dir);
+    goto err;
+  }
+
+  if (load_snapshot(store) || replay_wal(store))
+    goto err;
+
+  RTLS_INFO("secret store %s: %zu entries\n", dir, store->entry_count);
+  return store;
+
+err:
+  secret_store_close(store);
+  return NULL;
+}
+
+void secret_store_close(struct secret_store *store) {
+  if (store == NULL)
+    return;
+  if (store->wal_fd >= 0)
+    close(store->wal_fd);
+  if (store->lock_fd >= 0)
+    close(store->lock_fd);
+  for (size_t i = 0; store->buckets != NULL && i < store->bucket_count; i++) {
+    struct store_entry *e = store->buckets[i];
+    while (e != NULL) {
+      struct store_entry *next = e->next;
+      free_entry(e);
+      e = next;
+    }
+  }
+  free(store->buckets);
+  if (store->pending != NULL)
+    explicit_bzero(store->pending, store->pending_cap);
+  free(store->pending);
+  pthread_rwlock_destroy(&store->index_lock);
+  pthread_mutex_destroy(&store->commit_lock);
+  pthread_cond_destroy(&store->committed);
+  free(store->dir);
+  free(store);
+}
+
+static uint64_t append(struct secret_store *store, uint8_t op, const char *key,
+                       const uint8_t *value, size_t value_len) {
+  size_t key_len = strlen(key);
+  if (key_len == 0 || key_len > SECRET_STORE_KEY_MAX ||
+      value_len > SECRET_STORE_VALUE_MAX)
+    return 0;
+  size_t rec_len = RECORD_HEADER_SIZE + key_len + value_len;
+
+  pthread_mutex_lock(&store->commit_lock);
+  if (store->failed) {
+    pthread_mutex_unlock(&store->commit_lock);
+    return 0;
+  }
+  if (store->pending_len + rec_len > store->pending_cap) {
+    size_t cap = store->pending_cap ? store->pending_cap : 4096;
+    while (cap < store->pending_len + rec_len)
+      cap *= 2;
+    uint8_t *grown = realloc(store->pending, cap);
+    if (grown == NULL) {
+      pthread_mutex_unlock(&store->commit_lock);
+      return 0;
+    }
+    store->pending = grown;
+    store->pending_cap = cap;
+  }
+  store->pending_len +=
+      encode_record(store->pending + store->pending_len, op,
+                    (const uint8_t *)key, key_len, value, value_len);
+  uint64_t seq = ++store->next_seq;
+  pthread_mutex_unlock(&store->commit_lock);
+  return seq;
+}
+
+uint64_t secret_store_append_put(struct secret_store *store, const char *key,
+                                 const uint8_t *value, size_t len) {
+  return append(store, OP_PUT, key, value, len);
+}
+
+uint64_t secret_store_append_delete(struct secret_store *store,
+                                    const char *key) {
+  return append(store, OP_DELETE, key, NULL, 0);
+}
+
+static int compact(struct secret_store *store) {
+  char *tmp_path = store_path(store, "snapshot.tmp");
+  char *path = store_path(store, "snapshot");
+  size_t buf_cap = RECORD_HEADER_SIZE + SECRET_STORE_KEY_MAX + 4096;
+  uint8_t *buf = malloc(buf_cap);
+  int fd = -1, ret = -1;
+  if (tmp_path == NULL || path == NULL || buf == NULL)
+    goto out;
+
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+            S_IRUSR | S_IWUSR);
+  if (fd < 0)
+    goto out;
+
+  uint32_t version = htole32(SNAPSHOT_VERSION);
+  memcpy(buf, SNAPSHOT_MAGIC, 8);
+  memcpy(buf + 8, &version, 4);
+  if (write_all(fd, buf, SNAPSHOT_HEADER_SIZE))
+    goto out;
+
+  pthread_rwlock_rdlock(&store->index_lock);
+  int failed = 0;
+  for (size_t i = 0; !failed && i < store->bucket_count; i++) {
+    for (struct store_entry *e = store->buckets[i]; !failed && e != NULL;
+         e = e->next) {
+      size_t len = RECORD_HEADER_SIZE + e->key_len + e->value_len;
+      if (len > buf_cap) {
+        explicit_bzero(buf, buf_cap);
+        free(buf);
+        buf_cap = len;
+        buf = malloc(buf_cap);
+        if (buf == NULL) {
+          failed = 1;
+          break;
+        }
+      }
+      encode_record(buf, OP_PUT, e->data, e->key_len, e->data + e->key_len,
+                    e->value_len);
+      failed = write_all(fd, buf, len);
+    }
+  }
+  pthread_rwlock_unlock(&store->index_lock);
+
+  // a crash after the rename replays the old log over the new snapshot,
+  // which is harmless since the log is applied in order
+  if (failed || fsync(fd) || rename(tmp_path, path) || sync_dir(store->dir) ||
+      ftruncate(store->wal_fd, 0) || fdatasync(store->wal_fd))
+    goto out;
+  store->wal_size = 0;
+  ret = 0;
+
+out:
+  if (fd >= 0)
+    close(fd);
+  if (ret != 0 && tmp_path != NULL)
+    unlink(tmp_path);
+  if (buf != NULL) {
+    explicit_bzero(buf, buf_cap);
+    free(buf);
+  }
+  free(tmp_path);
+  free(path);
+  return ret;
+}
+
+int secret_store_sync(struct secret_store *store, uint64_t seq) {
+  uint8_t *batch = NULL;
+  size_t batch_cap = 0;
+  int ret = 0;
+
+  pthread_mutex_lock(&store->commit_lock);
+  while (store->durable_seq < seq && !store->failed) {
+    if (store->flushing) {
+      pthread_cond_wait(&store->committed, &store->commit_lock);
+      continue;
+    }
+
+    // become the leader: take everything pending and flush it at once
+    store->flushing = true;
+    uint8_t *pending = store->pending;
+    size_t pending_len = store->pending_len;
+    size_t pending_cap = store->pending_cap;
+    uint64_t batch_seq = store->next_seq;
+    store->pending = batch;
+    store->pending_cap = batch_cap;
+    store->pending_len = 0;
+    pthread_mutex_unlock(&store->commit_lock);
+
+    bool ok = !write_all(store->wal_fd, pending, pending_len) &&
+              !fdatasync(store->wal_fd);
+    if (ok) {
+      bool failed;
+      pthread_rwlock_wrlock(&store->index_lock);
+      apply_records(store, pending, pending_len, &failed);
+      uint64_t live = store->live_bytes;
+      pthread_rwlock_unlock(&store->index_lock);
+      if (failed)
+        RTLS_ERR("out of memory indexing durable records\n");
+      store->wal_size += pending_len;
+      if (store->wal_size > COMPACT_MIN_BYTES && store->wal_size > 2 * live &&
+          compact(store))
+        RTLS_WARN("secret store compaction failed, log keeps growing\n");
+    } else {
+      RTLS_ERR("secret store log write failed: %s\n", strerror(errno));
+    }
+    explicit_bzero(pending, pending_len);
+    batch = pending;
+    batch_cap = pending_cap;
+
+    pthread_mutex_lock(&store->commit_lock);
+    if (ok)
+      store->durable_seq = batch_seq;
+    else
+      store->failed = true;
+    store->flushing = false;
+    pthread_cond_broadcast(&store->committed);
+  }
+  if (store->durable_seq < seq)
+    ret = -1;
+  pthread_mutex_unlock(&store->commit_lock);
+  free(batch);
+  return ret;
+}
+
+int secret_store_put(struct secret_store *store, const char *key,
+                     const uint8_t *value, size_t len) {
+  uint64_t seq = secret_store_append_put(store, key, value, len);
+  return seq == 0 ? -1 : secret_store_sync(store, seq);
+}
+
+int secret_store_delete(struct secret_store *store, const char *key) {
+  uint64_t seq = secret_store_append_delete(store, key);
+  return seq == 0 ? -1 : secret_store_sync(store, seq);
+}
+
+uint8_t *secret_store_get(struct secret_store *store, const char *key,
+                          size_t *len) {
+  size_t key_len = strlen(key);
+  uint8_t *value = NULL;
+
+  pthread_rwlock_rdlock(&store->index_lock);
+  struct store_entry *e = *find_slot(store, (const uint8_t *)key, key_len,
+                                     hash_key((const uint8_t *)key, key_len));
+  if (e != NULL && (value = malloc(e->value_len + 1)) != NULL) {
+    memcpy(value, e->data + e->key_len, e->value_len);
+    value[e->value_len] = '\0';
+    *len = e->value_len;
+  }
+  pthread_rwlock_unlock(&store->index_lock);
+  return value;
+}
+
+size_t secret_store_count(struct secret_store *store) {
+  pthread_rwlock_rdlock(&store->index_lock);
+  size_t count = store->entry_count;
+  pthread_rwlock_unlock(&store->index_lock);
+  return count;
+}
+
+int secret_store_compact(struct secret_store *store) {
+  pthread_mutex_lock(&store->commit_lock);
+  while (store->flushing)
+    pthread_cond_wait(&store->committed, &store->commit_lock);
+  store->flushing = true;
+  pthread_mutex_unlock(&store->commit_lock);
+
+  int ret = compact(store);
+
+  pthread_mutex_lock(&store->commit_lock);
+  store->flushing = false;
+  pthread_cond_broadcast(&store->committed);
+  pthread_mutex_unlock(&store->commit_lock);
+  return ret;
+}
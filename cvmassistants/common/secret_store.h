@@ -0,0 +1,62 @@
+#ifndef CONKER_SECRET_STORE_H
+#define CONKER_SECRET_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// -----------------------------------------------------------------------------
+// Crash-safe key/value store for provisioned secrets and wrap keys.
+//
+// A store is a directory holding:
+//
+//   snapshot   compacted image of every live key, replaced with rename(2)
+//   wal        append-only log of puts and deletes since the snapshot
+//   LOCK       flock(2)ed while a process has the store open
+//
+// Both files are sequences of records:
+//
+//   crc32 | key_len | value_len | op | key | value     (integers little-endian)
+//
+// The crc covers everything after itself, so a torn tail left by a crash is
+// detected and cut off when the log is replayed into the in-memory index.
+//
+// Writers append to a shared pending buffer; whichever writer finds no flush
+// in progress becomes the leader and writes and fdatasync()s everything
+// pending in one go, so concurrent provisioning shares one sync per batch.
+// Records only become visible to secret_store_get() once they are durable.
+// -----------------------------------------------------------------------------
+
+#define SECRET_STORE_KEY_MAX 255
+#define SECRET_STORE_VALUE_MAX (16 * 1024 * 1024)
+
+struct secret_store;
+
+struct secret_store *secret_store_open(const char *dir);
+void secret_store_close(struct secret_store *store);
+
+// Queue a put or delete without waiting for it to be durable. Returns the
+// record's sequence number for secret_store_sync(), 0 on error.
+uint64_t secret_store_append_put(struct secret_store *store, const char *key,
+                                 const uint8_t *value, size_t len);
+uint64_t secret_store_append_delete(struct secret_store *store,
+                                    const char *key);
+
+// Wait until every record up to seq is durable and visible.
+int secret_store_sync(struct secret_store *store, uint64_t seq);
+
+// Durable on return.
+int secret_store_put(struct secret_store *store, const char *key,
+                     const uint8_t *value, size_t len);
+int secret_store_delete(struct secret_store *store, const char *key);
+
+// Copy of the value of key, NULL if absent. The caller wipes and frees it.
+uint8_t *secret_store_get(struct secret_store *store, const char *key,
+                          size_t *len);
+
+size_t secret_store_count(struct secret_store *store);
+
+// Rewrite the snapshot from the index and truncate the log. Runs on its own
+// from the flush path once the log outgrows the live data.
+int secret_store_compact(struct secret_store *store);
+
+#endif
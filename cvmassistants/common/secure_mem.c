@@ -0,0 +1,182 @@
+#include "secure_mem.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define CLASS_COUNT 6
+#define CLASS_MIN_SHIFT 6 // 64 bytes, each class four times the previous one
+#define CLASS_SEPARATE CLASS_COUNT
+#define HEADER_SIZE 32
+#define ARENA_ALIGN 16
+
+// precedes every block; while a pool block is free only next is meaningful
+struct secure_block {
+  struct secure_block *next;
+  size_t len;     // bytes handed out, the only ones that can be dirty
+  size_t map_len; // whole mapping, separate blocks only
+  unsigned cls;
+};
+
+_Static_assert(sizeof(struct secure_block) <= HEADER_SIZE,
+               "secure block header too large");
+
+struct arena_chunk {
+  struct arena_chunk *next;
+  _Alignas(ARENA_ALIGN) uint8_t data[];
+};
+
+struct size_class {
+  pthread_mutex_t lock;
+  struct secure_block *free;
+};
+
+static struct size_class classes[CLASS_COUNT] = {
+    [0 ... CLASS_COUNT - 1] = {PTHREAD_MUTEX_INITIALIZER, NULL}};
+static atomic_uint_fast64_t in_use;
+static atomic_uint_fast64_t lock_failures;
+
+static size_t class_size(unsigned cls) {
+  return (size_t)1 << (CLASS_MIN_SHIFT + 2 * cls);
+}
+
+static unsigned class_of(size_t len) {
+  unsigned cls = 0;
+  while (cls < CLASS_COUNT && class_size(cls) < len)
+    cls++;
+  return cls;
+}
+
+// Anonymous mappings start zeroed; keep them out of swap and core dumps.
+static void *map_locked(size_t len) {
+  void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    return NULL;
+  madvise(mem, len, MADV_DONTDUMP);
+  if (mlock(mem, len) < 0)
+    atomic_fetch_add(&lock_failures, 1);
+  return mem;
+}
+
+int secure_pool_init(size_t size) {
+  size_t share = size / CLASS_COUNT;
+  size_t total = 0;
+  for (unsigned cls = 0; cls < CLASS_COUNT; cls++)
+    total += share / (HEADER_SIZE + class_size(cls)) *
+             (HEADER_SIZE + class_size(cls));
+
+  uint8_t *region = map_locked(total);
+  if (region == NULL)
+    return -1;
+
+  uint8_t *p = region;
+  for (unsigned cls = 0; cls < CLASS_COUNT; cls++) {
+    size_t stride = HEADER_SIZE + class_size(cls);
+    pthread_mutex_lock(&classes[cls].lock);
+    for (size_t n = share / stride; n > 0; n--, p += stride) {
+      struct secure_block *b = (struct secure_block *)p;
+      b->cls = cls;
+      b->next = classes[cls].free;
+      classes[cls].free = b;
+    }
+    pthread_mutex_unlock(&classes[cls].lock);
+  }
+  return 0;
+}
+
+void *secure_alloc(size_t len) {
+  unsigned cls = class_of(len);
+  struct secure_block *b = NULL;
+  if (cls < CLASS_COUNT) {
+    pthread_mutex_lock(&classes[cls].lock);
+    b = classes[cls].free;
+    if (b != NULL)
+      classes[cls].free = b->next;
+    pthread_mutex_unlock(&classes[cls].lock);
+  }
+
+  if (b == NULL) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (len > SIZE_MAX - HEADER_SIZE - page)
+      return NULL;
+    size_t map_len = (HEADER_SIZE + len + page - 1) / page * page;
+    if ((b = map_locked(map_len)) == NULL)
+      return NULL;
+    b->map_len = map_len;
+    b->cls = CLASS_SEPARATE;
+  }
+  b->next = NULL;
+  b->len = len;
+  atomic_fetch_add(&in_use, len);
+  return (uint8_t *)b + HEADER_SIZE;
+}
+
+void secure_free(void *ptr) {
+  if (ptr == NULL)
+    return;
+  struct secure_block *b =
+      (struct secure_block *)((uint8_t *)ptr - HEADER_SIZE);
+  atomic_fetch_sub(&in_use, b->len);
+  explicit_bzero(ptr, b->len);
+
+  if (b->cls == CLASS_SEPARATE) {
+    size_t map_len = b->map_len;
+    munlock(b, map_len);
+    munmap(b, map_len);
+    return;
+  }
+  b->len = 0;
+  pthread_mutex_lock(&classes[b->cls].lock);
+  b->next = classes[b->cls].free;
+  classes[b->cls].free = b;
+  pthread_mutex_unlock(&classes[b->cls].lock);
+}
+
+uint64_t secure_in_use(void) { return atomic_load(&in_use); }
+
+uint64_t secure_lock_failures(void) { return atomic_load(&lock_failures); }
+
+int arena_init(struct arena *arena, size_t size) {
+  memset(arena, 0, sizeof(*arena));
+  arena->base = secure_alloc(size);
+  if (arena->base == NULL)
+    return -1;
+  arena->size = size;
+  return 0;
+}
+
+void *arena_alloc(struct arena *arena, size_t size) {
+  size_t start = (arena->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  if (start <= arena->size && size <= arena->size - start) {
+    arena->used = start + size;
+    return arena->base + start;
+  }
+
+  if (size > SIZE_MAX - sizeof(struct arena_chunk))
+    return NULL;
+  struct arena_chunk *chunk = secure_alloc(sizeof(*chunk) + size);
+  if (chunk == NULL)
+    return NULL;
+  chunk->next = arena->overflow;
+  arena->overflow = chunk;
+  return chunk->data;
+}
+
+void arena_reset(struct arena *arena) {
+  explicit_bzero(arena->base, arena->used);
+  arena->used = 0;
+  while (arena->overflow != NULL) {
+    struct arena_chunk *next = arena->overflow->next;
+    secure_free(arena->overflow);
+    arena->overflow = next;
+  }
+}
+
+void arena_destroy(struct arena *arena) {
+  arena_reset(arena);
+  secure_free(arena->base);
+  memset(arena, 0, sizeof(*arena));
+}
@@ -0,0 +1,66 @@
+#ifndef CONKER_SECURE_MEM_H
+#define CONKER_SECURE_MEM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// -----------------------------------------------------------------------------
+// Allocators for secret bytes and per-connection scratch memory.
+//
+// secure pool: one region mapped up front, locked in memory and excluded from
+// core dumps, carved into power-of-four size classes (64 B to 64 KiB) with a
+// free list each. Blocks are handed out zeroed and wiped again when released,
+// so a freed block never holds a previous secret. Requests larger than the
+// biggest class, or made while their class is exhausted or before
+// secure_pool_init(), get a mapping of their own with the same guarantees.
+// When the memory lock limit is too low the memory is still used, unlocked;
+// secure_lock_failures() counts how often that happened.
+//
+// arena: bump allocator over one secure block, meant to live as long as the
+// thread serving connections. Everything a connection allocates from it is
+// dropped at once by arena_reset(); allocations that do not fit go to
+// separate secure blocks which the reset releases too.
+// -----------------------------------------------------------------------------
+
+#define SECURE_POOL_DEFAULT_SIZE (1024 * 1024)
+#define ARENA_DEFAULT_SIZE (16 * 1024)
+
+// Map and lock the pool, size bytes split evenly over the size classes.
+// Returns -1 when the region cannot be mapped; callers may carry on, every
+// allocation then gets its own mapping.
+int secure_pool_init(size_t size);
+
+// Zeroed, locked memory for len bytes, NULL when out of memory.
+void *secure_alloc(size_t len);
+
+// Wipe and release memory from secure_alloc(); NULL is ignored.
+void secure_free(void *ptr);
+
+// Bytes currently handed out, over the pool and separate mappings.
+uint64_t secure_in_use(void);
+
+// Regions that could not be locked in memory.
+uint64_t secure_lock_failures(void);
+
+struct arena_chunk;
+
+struct arena {
+  uint8_t *base;
+  size_t size;
+  size_t used;
+  struct arena_chunk *overflow;
+};
+
+// Back arena with a secure block of size bytes. Returns -1 when out of memory.
+int arena_init(struct arena *arena, size_t size);
+
+// size bytes aligned to 16, valid until the next arena_reset().
+void *arena_alloc(struct arena *arena, size_t size);
+
+// Wipe what was allocated and make the whole arena available again.
+void arena_reset(struct arena *arena);
+
+void arena_destroy(struct arena *arena);
+
+#endif
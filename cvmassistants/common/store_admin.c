@@ -0,0 +1,221 @@
+#include "store_admin.h"
+#include "hex.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <rats-tls/api.h>
+#include <rats-tls/log.h>
+
+// longest accepted command line, larger secrets belong in a bundle
+#define ADMIN_LINE_MAX (1024 * 1024)
+
+struct admin_server {
+  struct secret_store *store;
+  struct cluster *cluster;
+  int listen_fd;
+};
+
+struct admin_conn {
+  struct secret_store *store;
+  struct cluster *cluster;
+  int fd;
+};
+
+// Queue one command. Returns -1 when it is rejected, otherwise stores the
+// sequence number to sync in seq, 0 when the command is already durable.
+static int queue_command(struct admin_conn *conn, char *line, uint64_t *seq) {
+  char *save = NULL;
+  char *op = strtok_r(line, " \t", &save);
+  char *key = strtok_r(NULL, " \t", &save);
+  char *value = strtok_r(NULL, " \t", &save);
+
+  *seq = 0;
+  if (op == NULL || key == NULL)
+    return -1;
+  if (!strcmp(op, "put") && value != NULL) {
+    size_t hex_len = strlen(value);
+    ssize_t len = hex_decode((uint8_t *)value, value, hex_len);
+    int ret = -1;
+    if (len >= 0 && conn->cluster != NULL) {
+      ret = cluster_put(conn->cluster, key, (uint8_t *)value, len);
+    } else if (len >= 0) {
+      *seq = secret_store_append_put(conn->store, key, (uint8_t *)value, len);
+      ret = *seq != 0 ? 0 : -1;
+    }
+    explicit_bzero(value, hex_len);
+    return ret;
+  }
+  if (!strcmp(op, "del") && value == NULL) {
+    if (conn->cluster != NULL)
+      return cluster_delete(conn->cluster, key);
+    *seq = secret_store_append_delete(conn->store, key);
+    return *seq != 0 ? 0 : -1;
+  }
+  return -1;
+}
+
+static int write_reply(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static void *admin_conn_main(void *arg) {
+  struct admin_conn *conn = arg;
+  char *buf = malloc(ADMIN_LINE_MAX);
+  bool *accepted = NULL;
+  char *reply = NULL;
+  size_t len = 0, accepted_cap = 0;
+
+  while (buf != NULL) {
+    ssize_t n = read(conn->fd, buf + len, ADMIN_LINE_MAX - len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    len += n;
+
+    // queue every complete line, then make the whole batch durable at once
+    size_t lines = 0, start = 0;
+    uint64_t last_seq = 0;
+    for (size_t i = 0; i < len; i++) {
+      if (buf[i] != '\n')
+        continue;
+      buf[i] = '\0';
+      if (lines == accepted_cap) {
+        accepted_cap = accepted_cap ? 2 * accepted_cap : 64;
+        bool *grown = realloc(accepted, accepted_cap * sizeof(bool));
+        if (grown == NULL)
+          goto out;
+        accepted = grown;
+      }
+      uint64_t seq;
+      accepted[lines++] = queue_command(conn, buf + start, &seq) == 0;
+      if (seq > last_seq)
+        last_seq = seq;
+      start = i + 1;
+    }
+    if (lines == 0 && len == ADMIN_LINE_MAX) {
+      RTLS_ERR("admin command exceeds %d bytes\n", ADMIN_LINE_MAX);
+      break;
+    }
+    explicit_bzero(buf, start);
+    memmove(buf, buf + start, len - start);
+    len -= start;
+
+    bool durable = last_seq == 0 || !secret_store_sync(conn->store, last_seq);
+    char *grown = realloc(reply, lines * sizeof("error\n"));
+    if (lines > 0 && grown == NULL)
+      break;
+    reply = grown;
+    size_t reply_len = 0;
+    for (size_t i = 0; i < lines; i++) {
+      const char *status = accepted[i] && durable ? "ok\n" : "error\n";
+      memcpy(reply + reply_len, status, strlen(status));
+      reply_len += strlen(status);
+    }
+    if (write_reply(conn->fd, reply, reply_len))
+      break;
+  }
+
+out:
+  if (buf != NULL) {
+    explicit_bzero(buf, ADMIN_LINE_MAX);
+    free(buf);
+  }
+  free(accepted);
+  free(reply);
+  close(conn->fd);
+  free(conn);
+  return NULL;
+}
+
+static void *admin_accept_main(void *arg) {
+  struct admin_server *server = arg;
+
+  for (;;) {
+    int fd = accept(server->listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EINTR)
+        RTLS_ERR("admin accept failed: %s\n", strerror(errno));
+      continue;
+    }
+
+    struct admin_conn *conn = malloc(sizeof(struct admin_conn));
+    pthread_t tid;
+    if (conn == NULL) {
+      close(fd);
+      continue;
+    }
+    conn->store = server->store;
+    conn->cluster = server->cluster;
+    conn->fd = fd;
+    if (pthread_create(&tid, NULL, admin_conn_main, conn) != 0) {
+      close(fd);
+      free(conn);
+      continue;
+    }
+    pthread_detach(tid);
+  }
+  return NULL;
+}
+
+int store_admin_start(struct secret_store *store, struct cluster *cluster,
+                      const char *socket_path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    RTLS_ERR("admin socket path too long\n");
+    return -1;
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  // only the broker's user may provision secrets
+  mode_t old_mask = umask(S_IRWXG | S_IRWXO);
+  unlink(socket_path);
+  int ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(old_mask);
+  if (ret < 0 || listen(fd, SOMAXCONN) < 0) {
+    RTLS_ERR("failed to listen on %s: %s\n", socket_path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  struct admin_server *server = malloc(sizeof(struct admin_server));
+  pthread_t tid;
+  if (server == NULL) {
+    close(fd);
+    return -1;
+  }
+  server->store = store;
+  server->cluster = cluster;
+  server->listen_fd = fd;
+  if (pthread_create(&tid, NULL, admin_accept_main, server) != 0) {
+    close(fd);
+    free(server);
+    return -1;
+  }
+  pthread_detach(tid);
+  RTLS_INFO("secret store provisioning on %s\n", socket_path);
+  return 0;
+}
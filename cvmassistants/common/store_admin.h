@@ -0,0 +1,28 @@
+#ifndef CONKER_STORE_ADMIN_H
+#define CONKER_STORE_ADMIN_H
+
+#include "cluster.h"
+#include "secret_store.h"
+
+// -----------------------------------------------------------------------------
+// Local provisioning endpoint for a broker's secret store.
+//
+// A UNIX stream socket (mode 0600) accepting newline terminated commands:
+//
+//   put <key> <hex value>
+//   del <key>
+//
+// Every command gets an "ok" or "error" line back. Commands that arrive
+// together are appended first and synced once, and concurrent connections
+// share the store's group commit, so bulk provisioning does not pay one
+// fsync per key.
+//
+// With a cluster, commands are routed to the owners of the key instead and
+// answered once the write is durable on one of them.
+// -----------------------------------------------------------------------------
+
+// cluster may be NULL for a standalone broker.
+int store_admin_start(struct secret_store *store, struct cluster *cluster,
+                      const char *socket_path);
+
+#endif
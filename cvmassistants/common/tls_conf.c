@@ -0,0 +1,44 @@
+#include "tls_conf.h"
+#include "log.h"
+
+#include <string.h>
+
+static bool copy_type(char *dst, size_t size, const char *src,
+                      const char *what) {
+  if (src == NULL || strlen(src) >= size) {
+    LOG_ERROR("%s is NULL or exceeds maximum allowed size (%zu)", what,
+              size - 1);
+    return false;
+  }
+  strcpy(dst, src);
+  LOG_DEBUG("%s: %s", what, src);
+  return true;
+}
+
+int tls_conf_init(rats_tls_conf_t *conf, rats_tls_log_level_t log_level,
+                  const char *attester_type, const char *verifier_type,
+                  const char *tls_type, const char *crypto_type, bool mutual,
+                  bool server) {
+  memset(conf, 0, sizeof(*conf));
+  // check them all so that every bad name gets reported
+  bool ok = copy_type(conf->attester_type, sizeof(conf->attester_type),
+                      attester_type, "attester_type");
+  ok &= copy_type(conf->verifier_type, sizeof(conf->verifier_type),
+                  verifier_type, "verifier_type");
+  ok &= copy_type(conf->tls_type, sizeof(conf->tls_type), tls_type,
+                  "tls_type");
+  ok &= copy_type(conf->crypto_type, sizeof(conf->crypto_type), crypto_type,
+                  "crypto_type");
+  if (!ok)
+    return -1;
+
+  conf->log_level = log_level;
+  conf->cert_algo = RATS_TLS_CERT_ALGO_DEFAULT;
+  if (server)
+    conf->flags |= RATS_TLS_CONF_FLAGS_SERVER;
+  if (mutual) {
+    conf->flags |= RATS_TLS_CONF_FLAGS_MUTUAL;
+    LOG_DEBUG("Mutual attestation is enabled");
+  }
+  return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef CONKER_TLS_CONF_H
+#define CONKER_TLS_CONF_H
+
+#include <stdbool.h>
+#include <rats-tls/api.h>
+
+// Fill conf for a rats-tls client or server with the given instance types.
+// Returns -1, logging every offending name, when a type name is missing or
+// does not fit.
+int tls_conf_init(rats_tls_conf_t *conf, rats_tls_log_level_t log_level,
+                  const char *attester_type, const char *verifier_type,
+                  const char *tls_type, const char *crypto_type, bool mutual,
+                  bool server);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef CONKER_TRACE_H
+#define CONKER_TRACE_H
+
+// -----------------------------------------------------------------------------
+// Static tracepoints (USDT) of the brokers and agents, provider "conker".
+//
+// A probe compiles to a single nop plus an ELF note, so it costs nothing
+// until perf or bpftrace attaches to it, on a running process and without a
+// rebuild. The scripts in common/trace/ turn them into latency histograms;
+// list them with
+//
+//   bpftrace -l 'usdt:/path/to/secret_broker_server:conker:*'
+//
+// Broker probes, arguments in order:
+//   accept(fd)                   connection accepted, before queueing
+//   negotiate_start(fd)          a worker starts the handshake
+//   negotiate_end(fd, err)       handshake done, err is the rats-tls error
+//   verify_start()               verification callback entered
+//   verify_end(verdict)          -1 accepted, 0 rejected (rats-tls callback)
+//   request_start(id, command)   framed request id, 0 for a bare command
+//   request_end(id, err)         handler returned, err set when unanswered
+//   receive(len)                 bytes of one rats_tls_receive
+//   transmit(len)                bytes of one rats_tls_transmit
+//
+// Agent probes:
+//   connect_start(port) / connect_end(err)
+//   negotiate_start(fd) / negotiate_end(fd, err)
+//   receive(len) / transmit(len)
+//   write_start(len) / write_end(err)   saving the secret
+//   push_start() / push_end(err)        key provider agent, secret box push
+//
+// Without <sys/sdt.h> (systemtap-sdt-dev) the probes compile to nothing.
+// -----------------------------------------------------------------------------
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define CONKER_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef CONKER_HAVE_SDT
+#include <sys/sdt.h>
+#define TRACE(name, ...) STAP_PROBEV(conker, name, ##__VA_ARGS__)
+#else
+#define TRACE(name, ...)                                                       \
+  do {                                                                         \
+  } while (0)
+#endif
+
+#endif
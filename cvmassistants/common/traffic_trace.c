@@ -0,0 +1,147 @@
+#include "traffic_trace.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <sys/time.h>
+#include <rats-tls/api.h>
+#include <rats-tls/log.h>
+
+static FILE *trace_file;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t start_us; // monotonic
+
+static void put_be16(uint8_t *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static void put_be64(uint8_t *p, uint64_t v) {
+  put_be32(p, v >> 32);
+  put_be32(p + 4, v);
+}
+
+static uint16_t get_be16(const uint8_t *p) {
+  return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t get_be32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+static uint64_t get_be64(const uint8_t *p) {
+  return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+static uint64_t monotonic_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int traffic_trace_open(const char *path) {
+  FILE *f = fopen(path, "wb");
+  if (f == NULL) {
+    RTLS_ERR("Failed to open %s\n", path);
+    return -1;
+  }
+
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  uint8_t header[TRAFFIC_TRACE_HEADER_SIZE] = {0};
+  memcpy(header, TRAFFIC_TRACE_MAGIC, 4);
+  header[4] = TRAFFIC_TRACE_VERSION;
+  put_be64(header + 8, (uint64_t)now.tv_sec * 1000000 + now.tv_usec);
+  if (fwrite(header, sizeof(header), 1, f) != 1 || fflush(f)) {
+    RTLS_ERR("Failed to write %s\n", path);
+    fclose(f);
+    return -1;
+  }
+
+  start_us = monotonic_us();
+  trace_file = f;
+  return 0;
+}
+
+uint64_t traffic_trace_now_us(void) { return monotonic_us() - start_us; }
+
+void traffic_trace_write(const struct traffic_record *r) {
+  uint8_t buf[2 + TRAFFIC_TRACE_FIXED_SIZE + 2 * TRAFFIC_TRACE_NAME_MAX];
+  size_t app_id_len = strnlen(r->app_id, TRAFFIC_TRACE_NAME_MAX);
+  size_t command_len = strnlen(r->command, TRAFFIC_TRACE_NAME_MAX);
+  uint8_t *p = buf + 2;
+
+  put_be64(p, r->accept_us);
+  put_be32(p + 8, r->wait_us);
+  put_be32(p + 12, r->queue_us);
+  put_be32(p + 16, r->negotiate_us);
+  put_be32(p + 20, r->verify_us);
+  put_be32(p + 24, r->serve_us);
+  put_be32(p + 28, r->bytes_in);
+  put_be32(p + 32, r->bytes_out);
+  put_be16(p + 36, r->requests);
+  p[38] = r->outcome;
+  p[39] = app_id_len;
+  p[40] = command_len;
+  p += TRAFFIC_TRACE_FIXED_SIZE;
+  memcpy(p, r->app_id, app_id_len);
+  memcpy(p + app_id_len, r->command, command_len);
+  size_t len = TRAFFIC_TRACE_FIXED_SIZE + app_id_len + command_len;
+  put_be16(buf, len);
+
+  // a record per connection, flushed so that a crash loses none of them
+  pthread_mutex_lock(&trace_lock);
+  if (fwrite(buf, 2 + len, 1, trace_file) != 1 || fflush(trace_file))
+    RTLS_WARN("Failed to record traffic\n");
+  pthread_mutex_unlock(&trace_lock);
+}
+
+int traffic_trace_read_header(FILE *f, uint64_t *start_unix_us) {
+  uint8_t header[TRAFFIC_TRACE_HEADER_SIZE];
+  if (fread(header, sizeof(header), 1, f) != 1 ||
+      memcmp(header, TRAFFIC_TRACE_MAGIC, 4) ||
+      header[4] != TRAFFIC_TRACE_VERSION)
+    return -1;
+  *start_unix_us = get_be64(header + 8);
+  return 0;
+}
+
+int traffic_trace_read(FILE *f, struct traffic_record *r) {
+  uint8_t len_buf[2];
+  size_t n = fread(len_buf, 1, 2, f);
+  if (n == 0 && feof(f))
+    return 0;
+  if (n != 2)
+    return -1;
+
+  uint16_t len = get_be16(len_buf);
+  uint8_t buf[UINT16_MAX];
+  if (len < TRAFFIC_TRACE_FIXED_SIZE || fread(buf, len, 1, f) != 1)
+    return -1;
+
+  r->accept_us = get_be64(buf);
+  r->wait_us = get_be32(buf + 8);
+  r->queue_us = get_be32(buf + 12);
+  r->negotiate_us = get_be32(buf + 16);
+  r->verify_us = get_be32(buf + 20);
+  r->serve_us = get_be32(buf + 24);
+  r->bytes_in = get_be32(buf + 28);
+  r->bytes_out = get_be32(buf + 32);
+  r->requests = get_be16(buf + 36);
+  r->outcome = buf[38];
+  size_t app_id_len = buf[39], command_len = buf[40];
+  if (TRAFFIC_TRACE_FIXED_SIZE + app_id_len + command_len > len)
+    return -1;
+  memcpy(r->app_id, buf + TRAFFIC_TRACE_FIXED_SIZE, app_id_len);
+  r->app_id[app_id_len] = '\0';
+  memcpy(r->command, buf + TRAFFIC_TRACE_FIXED_SIZE + app_id_len, command_len);
+  r->command[command_len] = '\0';
+  return 1;
+}
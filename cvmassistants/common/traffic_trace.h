@@ -0,0 +1,73 @@
+#ifndef CONKER_TRAFFIC_TRACE_H
+#define CONKER_TRAFFIC_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// -----------------------------------------------------------------------------
+// Recording of broker traffic, for replay with bench/traffic_replay.
+//
+// With --record-traffic the broker appends one record per connection: when
+// it arrived, the appId claimed, the first command, sizes on the wire and how
+// long each phase took. Payloads are never recorded, and a command is only
+// recorded when it names a handler. Records are written as connections end,
+// so they are not in arrival order. Connections shed before a worker got
+// them are recorded too, with only their arrival and wait.
+//
+// File: "CKTR" | version u8 | 3 reserved bytes | start u64 (unix
+// microseconds), then records of
+//
+//   length u16 (of what follows) | accept_us u64 | wait_us u32 | queue_us
+//   u32 | negotiate_us u32 | verify_us u32 | serve_us u32 | bytes_in u32 |
+//   bytes_out u32 | requests u16 | outcome u8 | app_id_len u8 |
+//   command_len u8 | app_id | command
+//
+// integers in network byte order, accept_us relative to start. Readers skip
+// what follows the fields they know, so records can grow.
+// -----------------------------------------------------------------------------
+
+#define TRAFFIC_TRACE_MAGIC "CKTR"
+#define TRAFFIC_TRACE_VERSION 1
+#define TRAFFIC_TRACE_HEADER_SIZE 16
+#define TRAFFIC_TRACE_FIXED_SIZE 41 // record after the length, without names
+#define TRAFFIC_TRACE_NAME_MAX 255
+
+enum traffic_outcome {
+  TRAFFIC_SERVED = 0,
+  TRAFFIC_NEGOTIATE_FAILED = 1, // includes evidence rejected by the verifier
+  TRAFFIC_DROPPED = 2,          // queued longer than max_queue_wait_ms
+  TRAFFIC_SHED = 3,   // refused by a rate limit or a full poller or queue
+  TRAFFIC_SILENT = 4, // closed because its client sent nothing in time
+};
+
+struct traffic_record {
+  uint64_t accept_us;    // since the start of the recording
+  uint32_t wait_us;      // accept until the client's first bytes
+  uint32_t queue_us;     // first bytes until a worker took it
+  uint32_t negotiate_us; // handshake, verification included
+  uint32_t verify_us;    // evidence verification
+  uint32_t serve_us;     // handshake end until the connection closed
+  uint32_t bytes_in;     // received after the handshake
+  uint32_t bytes_out;
+  uint16_t requests;
+  uint8_t outcome;
+  char app_id[TRAFFIC_TRACE_NAME_MAX + 1];
+  char command[TRAFFIC_TRACE_NAME_MAX + 1]; // first one, "" when none
+};
+
+// Start recording to path, truncating it. Returns -1 on error.
+int traffic_trace_open(const char *path);
+
+// Microseconds since traffic_trace_open(), the clock of the records.
+uint64_t traffic_trace_now_us(void);
+
+// Append a record. Safe from any thread.
+void traffic_trace_write(const struct traffic_record *r);
+
+// Reading a trace: the header, then records until 0 at end of file. Both
+// return -1 on a malformed file.
+int traffic_trace_read_header(FILE *f, uint64_t *start_unix_us);
+int traffic_trace_read(FILE *f, struct traffic_record *r);
+
+#endif
@@ -0,0 +1,191 @@
+#include "verdict_cache.h"
+#include "admission.h"
+#include "hex.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <rats-tls/api.h>
+#include <rats-tls/log.h>
+
+#define PROBE_MAX 8    // entries looked at from the home slot of a key
+#define READ_RETRIES 4 // before a reader gives up on an entry being written
+
+struct entry_data {
+  uint64_t tag;
+  uint64_t expires_ms; // CLOCK_MONOTONIC
+  int32_t verdict;
+  uint8_t len; // 0 while the entry was never used
+  uint8_t key[VERDICT_CACHE_KEY_MAX];
+};
+
+struct entry {
+  atomic_uint seq; // odd while a writer owns the entry
+  struct entry_data d;
+};
+
+// the whole mapping
+struct verdict_cache {
+  size_t mask;
+  size_t bytes;
+  atomic_uint_fast64_t hits;
+  atomic_uint_fast64_t misses;
+  atomic_uint_fast64_t evictions;
+  struct entry entries[];
+};
+
+static uint64_t hash_key(uint64_t tag, const uint8_t *key, size_t len) {
+  uint64_t h = 14695981039346656037ULL ^ tag; // FNV-1a
+  for (size_t i = 0; i < len; i++) {
+    h ^= key[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// Copy an entry that no writer changed meanwhile. Returns -1 when writers
+// kept it busy.
+static int read_entry(struct entry *e, struct entry_data *out) {
+  for (int i = 0; i < READ_RETRIES; i++) {
+    unsigned before = atomic_load_explicit(&e->seq, memory_order_acquire);
+    if (before & 1)
+      continue;
+    memcpy(out, &e->d, sizeof(*out));
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&e->seq, memory_order_relaxed) == before)
+      return 0;
+  }
+  return -1;
+}
+
+// key is zero-padded to the full width like the stored ones, and compared
+// without early exit: the measurement allow-list compare is constant time,
+// its cache must not leak a matching prefix either
+static bool matches(const struct entry_data *d, uint64_t tag,
+                    const uint8_t *padded, size_t len) {
+  return (d->len == len) & (d->tag == tag) &
+         ct_equal(d->key, padded, VERDICT_CACHE_KEY_MAX);
+}
+
+struct verdict_cache *verdict_cache_new(size_t capacity) {
+  size_t size = PROBE_MAX;
+  while (size < capacity)
+    size *= 2;
+
+  size_t bytes = sizeof(struct verdict_cache) + size * sizeof(struct entry);
+  struct verdict_cache *cache = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (cache == MAP_FAILED) {
+    RTLS_ERR("Failed to map the verdict cache\n");
+    return NULL;
+  }
+  // a fresh mapping is zeroed: every entry is unused with an even counter
+  cache->mask = size - 1;
+  cache->bytes = bytes;
+  return cache;
+}
+
+int verdict_cache_get(struct verdict_cache *cache, uint64_t tag,
+                      const uint8_t *key, size_t len, int *verdict) {
+  if (len == 0 || len > VERDICT_CACHE_KEY_MAX)
+    return -1;
+
+  uint8_t padded[VERDICT_CACHE_KEY_MAX] = {0};
+  memcpy(padded, key, len);
+  uint64_t now = monotonic_ms();
+  size_t home = hash_key(tag, key, len) & cache->mask;
+  for (size_t i = 0; i < PROBE_MAX; i++) {
+    struct entry_data d;
+    if (read_entry(&cache->entries[(home + i) & cache->mask], &d) == 0 &&
+        matches(&d, tag, padded, len) && d.expires_ms > now) {
+      *verdict = d.verdict;
+      atomic_fetch_add(&cache->hits, 1);
+      return 0;
+    }
+  }
+  atomic_fetch_add(&cache->misses, 1);
+  return -1;
+}
+
+void verdict_cache_put(struct verdict_cache *cache, uint64_t tag,
+                       const uint8_t *key, size_t len, int verdict,
+                       unsigned ttl_s) {
+  if (len == 0 || len > VERDICT_CACHE_KEY_MAX)
+    return;
+
+  uint8_t padded[VERDICT_CACHE_KEY_MAX] = {0};
+  memcpy(padded, key, len);
+
+  // the same key, else a free or expired entry, else the one expiring first
+  uint64_t now = monotonic_ms();
+  size_t home = hash_key(tag, key, len) & cache->mask;
+  struct entry *victim = NULL;
+  uint64_t victim_expiry = UINT64_MAX;
+  bool evicting = false;
+  for (size_t i = 0; i < PROBE_MAX; i++) {
+    struct entry *e = &cache->entries[(home + i) & cache->mask];
+    struct entry_data d;
+    if (read_entry(e, &d))
+      continue;
+    if (matches(&d, tag, padded, len) || d.len == 0 || d.expires_ms <= now) {
+      victim = e;
+      evicting = false;
+      break;
+    }
+    if (d.expires_ms < victim_expiry) {
+      victim = e;
+      victim_expiry = d.expires_ms;
+      evicting = true;
+    }
+  }
+  if (victim == NULL)
+    return;
+
+  // a writer that loses the entry to another one leaves it to them
+  unsigned seq = atomic_load_explicit(&victim->seq, memory_order_relaxed);
+  if ((seq & 1) ||
+      !atomic_compare_exchange_strong_explicit(&victim->seq, &seq, seq + 1,
+                                               memory_order_acquire,
+                                               memory_order_relaxed))
+    return;
+  atomic_thread_fence(memory_order_release);
+
+  struct entry_data d = {.tag = tag,
+                         .expires_ms = now + (uint64_t)ttl_s * 1000,
+                         .verdict = verdict,
+                         .len = len};
+  memcpy(d.key, padded, sizeof(d.key));
+  memcpy(&victim->d, &d, sizeof(d));
+  atomic_store_explicit(&victim->seq, seq + 2, memory_order_release);
+  if (evicting)
+    atomic_fetch_add(&cache->evictions, 1);
+}
+
+uint64_t verdict_cache_hits(struct verdict_cache *cache) {
+  return atomic_load(&cache->hits);
+}
+
+uint64_t verdict_cache_misses(struct verdict_cache *cache) {
+  return atomic_load(&cache->misses);
+}
+
+uint64_t verdict_cache_evictions(struct verdict_cache *cache) {
+  return atomic_load(&cache->evictions);
+}
+
+size_t verdict_cache_entries(struct verdict_cache *cache) {
+  uint64_t now = monotonic_ms();
+  size_t count = 0;
+  for (size_t i = 0; i <= cache->mask; i++) {
+    struct entry_data d;
+    if (read_entry(&cache->entries[i], &d) == 0 && d.len != 0 &&
+        d.expires_ms > now)
+      count++;
+  }
+  return count;
+}
+
+size_t verdict_cache_bytes(struct verdict_cache *cache) {
+  return cache->bytes;
+}
@@ -0,0 +1,55 @@
+#ifndef CONKER_VERDICT_CACHE_H
+#define CONKER_VERDICT_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// -----------------------------------------------------------------------------
+// Cache of allow-list verdicts.
+//
+// A boot storm is many instances of few images: the same measurements are
+// checked against the allow-list over and over. The cache remembers the
+// verdict for a measurement under a given allow-list (tag, see
+// broker_config.measurement_tag) for a TTL, so that a repeated one is decided
+// without the allow-list scan. Tags are generations of this process's
+// configs, so the table is private to the process. A hit costs about as
+// much as scanning four allow-listed digests (bench/verdict_bench.c), so the
+// cache only pays off for long allow-lists.
+//
+// The table is a fixed open-addressing array in one mapping: every worker
+// reads and fills the same entries, so hit rate and memory do not depend on
+// how many there are. Entries are guarded by a sequence counter each, readers
+// never wait and a writer that loses a race simply does not insert. Expired
+// entries count as free and are overwritten, and when a probe window is full
+// the entry closest to expiry is evicted.
+// -----------------------------------------------------------------------------
+
+#define VERDICT_CACHE_KEY_MAX 64 // BROKER_MEASUREMENT_MAX
+#define VERDICT_CACHE_DEFAULT_TTL 300
+
+struct verdict_cache;
+
+// Map a table of at least capacity entries, rounded up to a power of two.
+struct verdict_cache *verdict_cache_new(size_t capacity);
+
+// Look key up under tag. Returns 0 and sets *verdict on a live entry, -1 on
+// a miss.
+int verdict_cache_get(struct verdict_cache *cache, uint64_t tag,
+                      const uint8_t *key, size_t len, int *verdict);
+
+// Remember verdict for ttl_s seconds.
+void verdict_cache_put(struct verdict_cache *cache, uint64_t tag,
+                       const uint8_t *key, size_t len, int verdict,
+                       unsigned ttl_s);
+
+uint64_t verdict_cache_hits(struct verdict_cache *cache);
+uint64_t verdict_cache_misses(struct verdict_cache *cache);
+uint64_t verdict_cache_evictions(struct verdict_cache *cache);
+
+// Live entries, by a scan of the table.
+size_t verdict_cache_entries(struct verdict_cache *cache);
+
+// Size of the mapping.
+size_t verdict_cache_bytes(struct verdict_cache *cache);
+
+#endif
@@ -0,0 +1,502 @@
+// -----------------------------------------------------------------------------
+// disk_provision: partition, encrypt, format and mount data disks, all disks
+// at once.
+//
+// Same environment as encryptedDisk.sh, which now runs this helper:
+//   DISK        device names under /dev, e.g. "vda" or "vda vdb" (spaces or
+//               commas)
+//   MOUNT_PATH  one mount point per disk, same order
+//   KEY_TYPE    only "wrapkey"
+//   WRAP_KEY    LUKS passphrase
+//
+// Each disk gets its own thread: an MBR with one partition over the disk is
+// written directly when the disk has no first partition yet, the node of the
+// new partition is awaited on kernel uevents instead of a fixed sleep, then
+// LUKS2 format, a single open (the earlier close and reopen check is gone),
+// mkfs.ext4 with lazy inode table and journal initialisation, and mount.
+//
+// The first partition is formatted whatever it holds: all data on it is lost.
+// -----------------------------------------------------------------------------
+
+#define _GNU_SOURCE // pipe2()
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/blkpg.h>
+#include <linux/fs.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define MAX_DISKS 16
+#define NODE_TIMEOUT_MS 10000
+#define NODE_RECHECK_MS 100 // also look without an event, in case one is missed
+#define PARTITION_ALIGN (1024 * 1024)
+#define LUKS_SECTOR_SIZE 4096
+// Argon2id, the LUKS2 default, with its memory capped: uncapped it may take
+// up to 1 GiB per disk, and the disks are formatted in parallel.
+#define PBKDF_MEMORY_KB "262144"
+
+struct disk {
+  char name[64];        // vda
+  char dev[80];         // /dev/vda
+  char part[96];        // /dev/vda1
+  char mapper[96];      // vda1
+  char mapped[128];     // /dev/mapper/vda1
+  const char *mount_path;
+  const char *key;
+  int status;
+};
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Kernel uevents, opened before the change that creates a node so that its
+// event cannot be missed. -1 when they cannot be received (no privilege, old
+// kernel); waits then fall back to rechecking.
+static int uevent_open(void) {
+  int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+  if (fd < 0)
+    return -1;
+  struct sockaddr_nl addr = {.nl_family = AF_NETLINK, .nl_groups = 1};
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Wait until path is a block device, waking on every uevent. Returns -1 on
+// timeout.
+static int wait_for_node(int uevent_fd, const char *path) {
+  double deadline = now_ms() + NODE_TIMEOUT_MS;
+  char buf[4096];
+
+  for (;;) {
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISBLK(st.st_mode))
+      return 0;
+    double left = deadline - now_ms();
+    if (left <= 0)
+      return -1;
+    int wait_ms = left < NODE_RECHECK_MS ? (int)left : NODE_RECHECK_MS;
+    if (uevent_fd < 0) {
+      usleep(wait_ms * 1000);
+      continue;
+    }
+    struct pollfd pfd = {.fd = uevent_fd, .events = POLLIN};
+    if (poll(&pfd, 1, wait_ms) > 0)
+      while (recv(uevent_fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        ; // any event may be ours, look again
+  }
+}
+
+// Run argv, feeding input (may be NULL) on its stdin. Returns the exit status,
+// -1 when it could not run. The pipe is close-on-exec so that a child started
+// by another disk's thread does not hold this one's stdin open.
+static int run(char *const argv[], const char *input) {
+  int in[2];
+  if (pipe2(in, O_CLOEXEC) < 0)
+    return -1;
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(in[0]);
+    close(in[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    dup2(in[0], STDIN_FILENO);
+    execvp(argv[0], argv);
+    _exit(127);
+  }
+
+  close(in[0]);
+  if (input != NULL) {
+    size_t len = strlen(input), off = 0;
+    while (off < len) {
+      ssize_t n = write(in[1], input + off, len - off);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      off += n;
+    }
+  }
+  close(in[1]);
+
+  int status;
+  while (waitpid(pid, &status, 0) < 0)
+    if (errno != EINTR)
+      return -1;
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static bool is_block_device(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 && S_ISBLK(st.st_mode);
+}
+
+static uint64_t device_size(const char *path) {
+  uint64_t size = 0;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+  if (ioctl(fd, BLKGETSIZE64, &size) < 0)
+    size = 0;
+  close(fd);
+  return size;
+}
+
+// Partition nodes of disks whose name ends in a digit take a "p" (nvme0n1p1)
+static void name_partition(struct disk *d) {
+  size_t len = strlen(d->name);
+  const char *sep = len > 0 && d->name[len - 1] >= '0' && d->name[len - 1] <= '9'
+                        ? "p"
+                        : "";
+  snprintf(d->part, sizeof(d->part), "%s%s1", d->dev, sep);
+  snprintf(d->mapper, sizeof(d->mapper), "%s%s1", d->name, sep);
+  snprintf(d->mapped, sizeof(d->mapped), "/dev/mapper/%s", d->mapper);
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+// What fdisk's "n p 1 <default> <default> w" produced: a DOS label with one
+// Linux partition from 1 MiB to the end, sized here to whole LUKS sectors.
+// MBR limits it to 2^32 - 1 sectors, 2 TiB with 512 byte sectors.
+static int write_partition_table(struct disk *d, int uevent_fd) {
+  int fd = open(d->dev, O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    LOG_ERROR("%s: failed to open: %s", d->dev, strerror(errno));
+    return -1;
+  }
+
+  int sector = 0;
+  uint64_t size = 0;
+  if (ioctl(fd, BLKSSZGET, &sector) < 0 || sector <= 0 ||
+      ioctl(fd, BLKGETSIZE64, &size) < 0) {
+    LOG_ERROR("%s: failed to read geometry: %s", d->dev, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  uint64_t start = PARTITION_ALIGN / sector;
+  uint64_t align = LUKS_SECTOR_SIZE > sector ? LUKS_SECTOR_SIZE / sector : 1;
+  uint64_t sectors = size / sector;
+  if (sectors <= start + align) {
+    LOG_ERROR("%s: disk too small", d->dev);
+    close(fd);
+    return -1;
+  }
+  uint64_t count = (sectors - start) / align * align;
+  if (count > UINT32_MAX)
+    count = UINT32_MAX / align * align;
+
+  uint8_t mbr[512];
+  if (pread(fd, mbr, sizeof(mbr), 0) != (ssize_t)sizeof(mbr)) {
+    LOG_ERROR("%s: failed to read the first sector", d->dev);
+    close(fd);
+    return -1;
+  }
+  memset(mbr + 446, 0, 64); // partition entries
+  uint32_t signature = (uint32_t)time(NULL) ^ (uint32_t)getpid() ^
+                       (uint32_t)(uintptr_t)d;
+  put_le32(mbr + 440, signature);
+  uint8_t *entry = mbr + 446;
+  entry[0] = 0x00;                                 // not bootable
+  entry[1] = 0xfe, entry[2] = 0xff, entry[3] = 0xff; // CHS unused, LBA only
+  entry[4] = 0x83;                                 // Linux
+  entry[5] = 0xfe, entry[6] = 0xff, entry[7] = 0xff;
+  put_le32(entry + 8, start);
+  put_le32(entry + 12, count);
+  mbr[510] = 0x55;
+  mbr[511] = 0xaa;
+
+  if (pwrite(fd, mbr, sizeof(mbr), 0) != (ssize_t)sizeof(mbr) || fsync(fd)) {
+    LOG_ERROR("%s: failed to write the partition table: %s", d->dev,
+              strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  // have the kernel pick the table up; when the disk is busy, add the
+  // partition alone, replacing a stale one the kernel still knows without
+  // a node
+  if (ioctl(fd, BLKRRPART) < 0) {
+    struct blkpg_partition part = {.start = start * sector,
+                                   .length = count * sector,
+                                   .pno = 1};
+    struct blkpg_ioctl_arg arg = {.op = BLKPG_ADD_PARTITION,
+                                  .datalen = sizeof(part),
+                                  .data = &part};
+    int ret = ioctl(fd, BLKPG, &arg);
+    if (ret < 0 && errno == EBUSY) {
+      arg.op = BLKPG_DEL_PARTITION;
+      if (ioctl(fd, BLKPG, &arg) == 0) {
+        arg.op = BLKPG_ADD_PARTITION;
+        ret = ioctl(fd, BLKPG, &arg);
+      }
+    }
+    if (ret < 0) {
+      LOG_ERROR("%s: kernel did not take the new partition: %s", d->dev,
+                strerror(errno));
+      close(fd);
+      return -1;
+    }
+  }
+  close(fd);
+
+  if (wait_for_node(uevent_fd, d->part)) {
+    LOG_ERROR("%s: no partition device after %d ms", d->part, NODE_TIMEOUT_MS);
+    return -1;
+  }
+  return 0;
+}
+
+static int format_and_open(struct disk *d) {
+  // a partition from an older table may not be whole LUKS sectors
+  const char *sector_size =
+      device_size(d->part) % LUKS_SECTOR_SIZE == 0 ? "4096" : "512";
+  char *const format[] = {"cryptsetup", "luksFormat", "--batch-mode",
+                          "--type", "luks2", "--sector-size", (char *)sector_size,
+                          "--pbkdf-memory", PBKDF_MEMORY_KB, "--key-file=-",
+                          d->part, NULL};
+  // the key is piped with a newline, as encryptedDisk.sh did with echo
+  size_t key_len = strlen(d->key);
+  char *key = malloc(key_len + 2);
+  if (key == NULL)
+    return -1;
+  memcpy(key, d->key, key_len);
+  memcpy(key + key_len, "\n", 2);
+
+  int ret = -1;
+  if (run(format, key)) {
+    LOG_ERROR("%s: failed to format in luks format", d->part);
+    goto out;
+  }
+  LOG_INFO("%s: formatted in luks format, %s byte sectors", d->part,
+           sector_size);
+
+  // dm-crypt queues every bio on a workqueue by default; on virtual disks
+  // handling it inline is cheaper
+  char *const open[] = {"cryptsetup", "open", "--perf-no_read_workqueue",
+                        "--perf-no_write_workqueue", "--key-file=-", d->part,
+                        d->mapper, NULL};
+  if (run(open, key)) {
+    LOG_ERROR("%s: failed to open in luks format", d->part);
+    goto out;
+  }
+  ret = 0;
+
+out:
+  explicit_bzero(key, key_len + 2);
+  free(key);
+  return ret;
+}
+
+static int make_filesystem(struct disk *d) {
+  // lazy init leaves zeroing the inode tables and journal to the kernel,
+  // after mount; there is nothing to discard on a fresh LUKS device
+  char *const mkfs[] = {"mkfs.ext4", "-q", "-F", "-E",
+                        "lazy_itable_init=1,lazy_journal_init=1,nodiscard",
+                        d->mapped, NULL};
+  if (run(mkfs, NULL)) {
+    LOG_ERROR("%s: failed to format in ext4 format", d->mapped);
+    return -1;
+  }
+  return 0;
+}
+
+static int mount_disk(struct disk *d) {
+  if (mkdir(d->mount_path, 0755) < 0 && errno != EEXIST) {
+    LOG_ERROR("%s: failed to create: %s", d->mount_path, strerror(errno));
+    return -1;
+  }
+  if (umount2(d->mount_path, 0) == 0)
+    LOG_INFO("Unmounted %s", d->mount_path);
+  if (mount(d->mapped, d->mount_path, "ext4", 0, NULL) < 0) {
+    LOG_ERROR("Failed to mount %s to %s: %s", d->mapped, d->mount_path,
+              strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static void *provision(void *arg) {
+  struct disk *d = arg;
+  double start = now_ms(), step = start;
+  d->status = -1;
+
+  name_partition(d);
+  if (is_block_device(d->mapped)) {
+    LOG_ERROR("Mapper %s already exists", d->mapped);
+    return NULL;
+  }
+  if (is_block_device(d->part)) {
+    LOG_INFO("Partition %s already exists for device %s", d->part, d->dev);
+  } else {
+    int uevent_fd = uevent_open();
+    int ret = write_partition_table(d, uevent_fd);
+    if (uevent_fd >= 0)
+      close(uevent_fd);
+    if (ret)
+      return NULL;
+    LOG_INFO("Partition %s created on %s in %.0f ms", d->part, d->dev,
+             now_ms() - step);
+  }
+
+  step = now_ms();
+  if (format_and_open(d))
+    return NULL;
+  LOG_INFO("%s: opened as %s, luks took %.0f ms", d->part, d->mapped,
+           now_ms() - step);
+
+  step = now_ms();
+  if (make_filesystem(d))
+    return NULL;
+  LOG_INFO("%s: ext4 created in %.0f ms", d->mapped, now_ms() - step);
+
+  if (mount_disk(d))
+    return NULL;
+  LOG_INFO("Mounted %s to %s, %s ready in %.0f ms", d->mapped, d->mount_path,
+           d->name, now_ms() - start);
+  d->status = 0;
+  return NULL;
+}
+
+// Split a DISK or MOUNT_PATH list in place
+static int split_list(char *list, char **items, int max) {
+  int n = 0;
+  for (char *save, *item = strtok_r(list, " ,\t\n", &save); item != NULL;
+       item = strtok_r(NULL, " ,\t\n", &save)) {
+    if (n == max)
+      return -1;
+    items[n++] = item;
+  }
+  return n;
+}
+
+static void usage(void) {
+  puts("    Usage:\n\n"
+       "        DISK=\"vda vdb\" MOUNT_PATH=\"/data1 /data2\" KEY_TYPE=wrapkey "
+       "WRAP_KEY=... disk_provision [options]\n\n"
+       "    Options:\n\n"
+       "        --log-level/-l value    set the log level (debug, info, "
+       "warn, error, off)\n"
+       "        --help/-h               show the usage\n");
+}
+
+int main(int argc, char **argv) {
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  char *const short_options = "l:h";
+  struct option long_options[] = {{"log-level", required_argument, NULL, 'l'},
+                                  {"help", no_argument, NULL, 'h'},
+                                  {0, 0, 0, 0}};
+  int opt;
+  while ((opt = getopt_long(argc, argv, short_options, long_options, NULL)) !=
+         -1) {
+    switch (opt) {
+    case 'l':
+      if (log_level_parse(optarg) >= 0)
+        app_log_level = log_level_parse(optarg);
+      break;
+    case 'h':
+      usage();
+      return 0;
+    default:
+      puts("Use --help for usage information");
+      return 1;
+    }
+  }
+
+  LOG_INFO("Starting encrypted disk configuration...");
+  char *disk_env = getenv("DISK");
+  char *mount_env = getenv("MOUNT_PATH");
+  const char *key_type = getenv("KEY_TYPE");
+  const char *key = getenv("WRAP_KEY");
+  if (mount_env == NULL || *mount_env == '\0') {
+    LOG_ERROR("Mount directory is null");
+    return 1;
+  }
+  if (disk_env == NULL || *disk_env == '\0') {
+    LOG_ERROR("Disk dev name is null");
+    return 1;
+  }
+  if (key_type == NULL || strcmp(key_type, "wrapkey")) {
+    LOG_ERROR("KEY_TYPE %s is not supported", key_type ? key_type : "");
+    return 1;
+  }
+  if (key == NULL || *key == '\0') {
+    LOG_ERROR("WRAP_KEY is null");
+    return 1;
+  }
+
+  char *names[MAX_DISKS], *mounts[MAX_DISKS];
+  int disk_count = split_list(disk_env, names, MAX_DISKS);
+  int mount_count = split_list(mount_env, mounts, MAX_DISKS);
+  if (disk_count <= 0 || mount_count != disk_count) {
+    LOG_ERROR("DISK and MOUNT_PATH must list the same number of entries, at "
+              "most %d",
+              MAX_DISKS);
+    return 1;
+  }
+
+  static struct disk disks[MAX_DISKS];
+  pthread_t threads[MAX_DISKS];
+  double start = now_ms();
+  for (int i = 0; i < disk_count; i++) {
+    struct disk *d = &disks[i];
+    if (strlen(names[i]) >= sizeof(d->name) || strchr(names[i], '/')) {
+      LOG_ERROR("Invalid disk name %s", names[i]);
+      return 1;
+    }
+    snprintf(d->name, sizeof(d->name), "%s", names[i]);
+    snprintf(d->dev, sizeof(d->dev), "/dev/%s", names[i]);
+    d->mount_path = mounts[i];
+    d->key = key;
+  }
+  for (int i = 0; i < disk_count; i++) {
+    if (pthread_create(&threads[i], NULL, provision, &disks[i])) {
+      LOG_ERROR("Failed to start the thread of %s", disks[i].name);
+      disk_count = i;
+      break;
+    }
+  }
+
+  int failed = 0;
+  for (int i = 0; i < disk_count; i++) {
+    pthread_join(threads[i], NULL);
+    failed |= disks[i].status;
+  }
+  if (failed) {
+    LOG_ERROR("Encrypted disk configuration failed");
+    return 1;
+  }
+  LOG_INFO("Encrypted disk configuration completed, %d disk(s) in %.0f ms",
+           disk_count, now_ms() - start);
+  return 0;
+}
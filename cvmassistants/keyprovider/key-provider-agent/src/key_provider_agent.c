@@ -5,47 +5,20 @@
 #include <string.h>
 #include <sys/time.h>
 #include <time.h>
-// Log levels
-#define LOG_LEVEL_DEBUG 0
-#define LOG_LEVEL_INFO 1
-#define LOG_LEVEL_WARN 2
-#define LOG_LEVEL_ERROR 3
-#define LOG_LEVEL_NONE 4
+
+#include "log.h"
+#include "secure_mem.h"
+#include "trace.h"
 
 // Key length for wrap key
 #define WRAP_KEY_LENGTH 32
 
-int app_log_level = LOG_LEVEL_INFO; // Default to INFO level
-
-#define LOG_WITH_TIMESTAMP(fmt, level, associated_level, ...)                  \
-  do {                                                                         \
-    if (app_log_level <= associated_level) {                                   \
-      time_t now = time(NULL);                                                 \
-      const struct tm *t = gmtime(&now);                                       \
-      char ts[24];                                                             \
-      strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S UTC", t);                    \
-      printf("%-29s [%-5s] [%s:%d] " fmt "\n", ts, level, __FILE__, __LINE__,  \
-             ##__VA_ARGS__);                                                   \
-    }                                                                          \
-  } while (0)
-
-#define LOG_DEBUG(fmt, ...)                                                    \
-  LOG_WITH_TIMESTAMP(fmt, "DEBUG", LOG_LEVEL_DEBUG, ##__VA_ARGS__)
-
-#define LOG_INFO(fmt, ...)                                                     \
-  LOG_WITH_TIMESTAMP(fmt, "INFO", LOG_LEVEL_INFO, ##__VA_ARGS__)
-
-#define LOG_WARN(fmt, ...)                                                     \
-  LOG_WITH_TIMESTAMP(fmt, "WARN", LOG_LEVEL_WARN, ##__VA_ARGS__)
-
-#define LOG_ERROR(fmt, ...)                                                    \
-  LOG_WITH_TIMESTAMP(fmt, "ERROR", LOG_LEVEL_ERROR, ##__VA_ARGS__)
-
 // -----------------------------------------------------------------------------
-// Generate a random 32-byte key (alphanumeric and special characters)
+// Generate a random 32-byte key (alphanumeric and special characters), in
+// locked memory released with secure_free()
 // -----------------------------------------------------------------------------
 char *generate_random_key(void) {
-  char *key = malloc(WRAP_KEY_LENGTH + 1);
+  char *key = secure_alloc(WRAP_KEY_LENGTH + 1);
 
   if (!key) {
     LOG_ERROR("Memory allocation failed");
@@ -85,7 +58,9 @@ int push_wrapkey_to_secret_box(const char *wrapkey) {
     strcat(request_buffer, wrapkey);
 
     curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request_buffer);
+    TRACE(push_start);
     res = curl_easy_perform(curl);
+    TRACE(push_end, res);
     if (res != CURLE_OK) {
       LOG_ERROR("curl_easy_perform() failed: %s", curl_easy_strerror(res));
       return -1;
@@ -120,16 +95,8 @@ int main(int argc, char **argv) {
     opt = getopt_long(argc, argv, short_options, long_options, NULL);
     switch (opt) {
     case 'l':
-      if (!strcasecmp(optarg, "debug"))
-        app_log_level = LOG_LEVEL_DEBUG;
-      else if (!strcasecmp(optarg, "info"))
-        app_log_level = LOG_LEVEL_INFO;
-      else if (!strcasecmp(optarg, "warn"))
-        app_log_level = LOG_LEVEL_WARN;
-      else if (!strcasecmp(optarg, "error"))
-        app_log_level = LOG_LEVEL_ERROR;
-      else if (!strcasecmp(optarg, "off"))
-        app_log_level = LOG_LEVEL_NONE;
+      if (log_level_parse(optarg) >= 0)
+        app_log_level = log_level_parse(optarg);
       break;
     case 'h':
       puts("    Usage:\n\n"
@@ -147,7 +114,7 @@ int main(int argc, char **argv) {
     }
   } while (opt != -1);
 
-  const char *wrap_key = generate_random_key();
+  char *wrap_key = generate_random_key();
   if (wrap_key == NULL) {
     LOG_ERROR("Failed to generate random wrap key");
     return -1;
@@ -155,6 +122,7 @@ int main(int argc, char **argv) {
   LOG_INFO("Successfully generated random wrap key");
 
   int ret = push_wrapkey_to_secret_box(wrap_key);
+  secure_free(wrap_key);
   if (ret != 0) {
     LOG_ERROR("Push wrapkey to secret box failed");
     return -1;
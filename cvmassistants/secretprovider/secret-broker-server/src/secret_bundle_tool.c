@@ -0,0 +1,143 @@
+#include <dirent.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "secret_bundle.h"
+
+// -----------------------------------------------------------------------------
+// Build a secret bundle from a directory holding one file per appId: the file
+// name is the appId and its content the secret. The bundle is written next to
+// the output path and renamed into place, so a running broker never maps a
+// partially written file.
+// -----------------------------------------------------------------------------
+
+static uint8_t *read_file(const char *path, size_t *len) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fileno(file), &st) < 0) {
+    fclose(file);
+    return NULL;
+  }
+  uint8_t *data = malloc(st.st_size > 0 ? st.st_size : 1);
+  if (data != NULL && fread(data, 1, st.st_size, file) != (size_t)st.st_size) {
+    free(data);
+    data = NULL;
+  }
+  fclose(file);
+  *len = st.st_size;
+  return data;
+}
+
+int main(int argc, char **argv) {
+  const char *secrets_dir = NULL;
+  const char *output = NULL;
+  const char *key_path = NULL;
+
+  char *const short_options = "d:o:k:h";
+  struct option long_options[] = {{"dir", required_argument, NULL, 'd'},
+                                  {"output", required_argument, NULL, 'o'},
+                                  {"key", required_argument, NULL, 'k'},
+                                  {"help", no_argument, NULL, 'h'},
+                                  {0, 0, 0, 0}};
+
+  int opt;
+  do {
+    opt = getopt_long(argc, argv, short_options, long_options, NULL);
+    switch (opt) {
+    case 'd':
+      secrets_dir = optarg;
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case 'k':
+      key_path = optarg;
+      break;
+    case -1:
+      break;
+    case 'h':
+      puts("    Usage:\n\n"
+           "        secret_bundle_tool <options>\n\n"
+           "    Options:\n\n"
+           "        --dir/-d value       directory with one secret file per "
+           "appId\n"
+           "        --output/-o value    bundle to publish\n"
+           "        --key/-k value       seal entries with this key file (32 "
+           "raw bytes or 64 hex)\n"
+           "        --help/-h            show the usage\n");
+      exit(0);
+    default:
+      exit(-1);
+    }
+  } while (opt != -1);
+
+  if (secrets_dir == NULL || output == NULL) {
+    fprintf(stderr, "--dir and --output are required\n");
+    return -1;
+  }
+
+  uint8_t key[SECRET_BUNDLE_KEY_SIZE];
+  if (key_path != NULL && secret_bundle_load_key(key_path, key)) {
+    fprintf(stderr, "Failed to read key file %s\n", key_path);
+    return -1;
+  }
+
+  DIR *dir = opendir(secrets_dir);
+  if (dir == NULL) {
+    fprintf(stderr, "Failed to open %s\n", secrets_dir);
+    return -1;
+  }
+
+  struct secret_bundle_input *inputs = NULL;
+  size_t count = 0;
+  int ret = 0;
+  struct dirent *de;
+  while (ret == 0 && (de = readdir(dir)) != NULL) {
+    char path[4096];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", secrets_dir, de->d_name);
+    if (de->d_name[0] == '.' || stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+      continue;
+
+    struct secret_bundle_input *grown =
+        realloc(inputs, (count + 1) * sizeof(struct secret_bundle_input));
+    if (grown == NULL) {
+      ret = -1;
+      break;
+    }
+    inputs = grown;
+    inputs[count].app_id = strdup(de->d_name);
+    inputs[count].secret = read_file(path, &inputs[count].secret_len);
+    if (inputs[count].app_id == NULL || inputs[count].secret == NULL) {
+      fprintf(stderr, "Failed to read %s\n", path);
+      free((void *)inputs[count].app_id);
+      free((void *)inputs[count].secret);
+      ret = -1;
+      break;
+    }
+    count++;
+  }
+  closedir(dir);
+
+  if (ret == 0 &&
+      secret_bundle_write(output, inputs, count, key_path ? key : NULL)) {
+    fprintf(stderr, "Failed to write bundle %s\n", output);
+    ret = -1;
+  }
+  if (ret == 0)
+    printf("Wrote %zu secrets to %s%s\n", count, output,
+           key_path ? " (sealed)" : "");
+
+  for (size_t i = 0; i < count; i++) {
+    free((void *)inputs[i].app_id);
+    free((void *)inputs[i].secret);
+  }
+  free(inputs);
+  return ret;
+}
@@ -5,42 +5,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <strings.h>
 #include <sys/socket.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "frame_client.h"
+#include "log.h"
+#include "secure_mem.h"
+#include "tls_conf.h"
+#include "trace.h"
+
 #define DEFAULT_PORT 1234
 #define DEFAULT_IP "127.0.0.1"
 // size of session
 #define MAX_SESSION_SIZE (100 * 1024 * 1024) // 100 MB
-#define CHUNK_SIZE 4096
-
-#define LOG_WITH_TIMESTAMP(fmt, level, rats_level, ...)                        \
-  do {                                                                         \
-    if (log_level <= rats_level) {                                             \
-      time_t now = time(NULL);                                                 \
-      const struct tm *t = gmtime(&now);                                       \
-      char ts[24];                                                             \
-      strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S UTC", t);                    \
-      printf("%-29s [%-5s] [%s:%d] " fmt "\n", ts, level, __FILE__, __LINE__,  \
-             ##__VA_ARGS__);                                                   \
-    }                                                                          \
-  } while (0)
-
-#define LOG_DEBUG(fmt, ...)                                                    \
-  LOG_WITH_TIMESTAMP(fmt, "DEBUG", RATS_TLS_LOG_LEVEL_DEBUG, ##__VA_ARGS__)
-
-#define LOG_INFO(fmt, ...)                                                     \
-  LOG_WITH_TIMESTAMP(fmt, "INFO", RATS_TLS_LOG_LEVEL_INFO, ##__VA_ARGS__)
-
-#define LOG_WARN(fmt, ...)                                                     \
-  LOG_WITH_TIMESTAMP(fmt, "WARN", RATS_TLS_LOG_LEVEL_WARN, ##__VA_ARGS__)
-
-#define LOG_ERROR(fmt, ...)                                                    \
-  LOG_WITH_TIMESTAMP(fmt, "ERROR", RATS_TLS_LOG_LEVEL_ERROR, ##__VA_ARGS__)
-
-rats_tls_log_level_t log_level = RATS_TLS_LOG_LEVEL_INFO;
 
 const char *command_get_secret = "getSecret";
 
@@ -49,43 +27,10 @@ char *get_secret_from_sbs_through_rats_tls(
     const char *verifier_type, const char *tls_type, const char *crypto_type,
     bool mutual, const char *ip, int port, const char *app_id) {
 
-  bool validation_error = false;
-  if (attester_type == NULL ||
-      strlen(attester_type) >= ENCLAVE_ATTESTER_TYPE_NAME_SIZE) {
-    LOG_ERROR("attester_type is NULL or exceeds maximum allowed size (%d)",
-              ENCLAVE_ATTESTER_TYPE_NAME_SIZE - 1);
-    validation_error = true;
-  }
-
-  if (verifier_type == NULL ||
-      strlen(verifier_type) >= ENCLAVE_VERIFIER_TYPE_NAME_SIZE) {
-    LOG_ERROR("verifier_type is NULL or exceeds maximum allowed size (%d)",
-              ENCLAVE_VERIFIER_TYPE_NAME_SIZE - 1);
-    validation_error = true;
-  }
-
-  if (tls_type == NULL || strlen(tls_type) >= TLS_TYPE_NAME_SIZE) {
-    LOG_ERROR("tls_type is NULL or exceeds maximum allowed size (%d)",
-              TLS_TYPE_NAME_SIZE - 1);
-    validation_error = true;
-  }
-
-  if (crypto_type == NULL || strlen(crypto_type) >= CRYPTO_TYPE_NAME_SIZE) {
-    LOG_ERROR("crypto_type is NULL or exceeds maximum allowed size (%d)",
-              CRYPTO_TYPE_NAME_SIZE - 1);
-    validation_error = true;
-  }
-
-  if (validation_error) {
-    return NULL;
-  }
-  LOG_DEBUG("attester_type: %s", attester_type);
-  LOG_DEBUG("verifier_type: %s", verifier_type);
-  LOG_DEBUG("tls_type: %s", tls_type);
-  LOG_DEBUG("crypto_type: %s", crypto_type);
-
   rats_tls_conf_t conf;
-  memset(&conf, 0, sizeof(conf));
+  if (tls_conf_init(&conf, log_level, attester_type, verifier_type, tls_type,
+                    crypto_type, mutual, false))
+    return NULL;
 
   claim_t custom_claims[1];
   if (app_id != NULL) {
@@ -96,23 +41,6 @@ char *get_secret_from_sbs_through_rats_tls(
     conf.custom_claims_length = 1;
   }
 
-  conf.log_level = log_level;
-  strncpy(conf.attester_type, attester_type,
-          ENCLAVE_ATTESTER_TYPE_NAME_SIZE - 1);
-  conf.attester_type[ENCLAVE_ATTESTER_TYPE_NAME_SIZE - 1] = '\0';
-  strncpy(conf.verifier_type, verifier_type,
-          ENCLAVE_VERIFIER_TYPE_NAME_SIZE - 1);
-  conf.verifier_type[ENCLAVE_VERIFIER_TYPE_NAME_SIZE - 1] = '\0';
-  strncpy(conf.tls_type, tls_type, TLS_TYPE_NAME_SIZE - 1);
-  conf.tls_type[TLS_TYPE_NAME_SIZE - 1] = '\0';
-  strncpy(conf.crypto_type, crypto_type, CRYPTO_TYPE_NAME_SIZE - 1);
-  conf.crypto_type[CRYPTO_TYPE_NAME_SIZE - 1] = '\0';
-  conf.cert_algo = RATS_TLS_CERT_ALGO_DEFAULT;
-  if (mutual) {
-    conf.flags |= RATS_TLS_CONF_FLAGS_MUTUAL;
-    LOG_DEBUG("Mutual attestation is enabled");
-  }
-
   /* Create a socket that uses an internet IPv4 address,
    * Sets the socket to be stream based (TCP),
    * 0 means choose the default protocol.
@@ -135,7 +63,10 @@ char *get_secret_from_sbs_through_rats_tls(
   }
 
   /* Connect to the server */
-  if (connect(sockfd, (struct sockaddr *)&s_addr, sizeof(s_addr)) == -1) {
+  TRACE(connect_start, port);
+  int connected = connect(sockfd, (struct sockaddr *)&s_addr, sizeof(s_addr));
+  TRACE(connect_end, connected);
+  if (connected == -1) {
     LOG_ERROR("Failed to call connect()");
     close(sockfd);
     return NULL;
@@ -152,65 +83,21 @@ char *get_secret_from_sbs_through_rats_tls(
     LOG_ERROR("Failed to set verification callback %#x", ret);
     goto err;
   }
+  TRACE(negotiate_start, sockfd);
   ret = rats_tls_negotiate(handle, sockfd);
+  TRACE(negotiate_end, sockfd, ret);
   if (ret != RATS_TLS_ERR_NONE) {
     LOG_ERROR("Failed to negotiate %#x", ret);
     goto err;
   }
 
-  // Receive the length of the upcoming session file as uint32_t in network byte
-  // order
-  uint32_t session_len_net;
-  size_t session_len_size = sizeof(uint32_t);
-  LOG_DEBUG("Receiving session length as uint32_t: %zu bytes",
-            session_len_size);
-  ret = rats_tls_receive(handle, &session_len_net, &session_len_size);
-  if (ret != RATS_TLS_ERR_NONE || session_len_size != sizeof(uint32_t)) {
-    LOG_ERROR("Failed to receive session length %#x (received %zu bytes, "
-              "expected %zu)",
-              ret, session_len_size, sizeof(uint32_t));
-    goto err;
-  }
-  uint32_t session_len =
-      ntohl(session_len_net); // from network byte order to host byte order
-  LOG_DEBUG("Received session length: %u", session_len);
-  if (session_len > MAX_SESSION_SIZE) {
-    LOG_ERROR("Session length exceeds maximum allowed size (%u > %u)",
-              session_len, (uint32_t)MAX_SESSION_SIZE);
-    goto err;
-  }
-
-  uint32_t buff_size = session_len + 1; // +1 for null terminator
-  char *buf = malloc(buff_size);
+  size_t len;
+  char *buf =
+      frame_client_call(handle, command_get_secret, MAX_SESSION_SIZE, &len);
   if (buf == NULL) {
-    LOG_ERROR("Failed to allocate memory for session file");
     goto err;
   }
 
-  // Receive session data in chunks
-  size_t bytes_received = 0;
-  while (bytes_received < session_len) {
-    size_t remaining = session_len - bytes_received;
-    size_t len = (remaining > CHUNK_SIZE) ? CHUNK_SIZE : remaining;
-    ret = rats_tls_receive(handle, buf + bytes_received, &len);
-    if (ret != RATS_TLS_ERR_NONE) {
-      LOG_ERROR("Failed to receive chunk %#x", ret);
-      free(buf);
-      goto err;
-    }
-    bytes_received += len;
-    LOG_DEBUG("Received chunk (%zu bytes), total received: %zu/%u", len,
-              bytes_received, session_len);
-  }
-  if (bytes_received != session_len) {
-    LOG_ERROR("Unexpected session size. Expected %u, got %zu", session_len,
-              bytes_received);
-    free(buf);
-    goto err;
-  }
-
-  buf[bytes_received] = '\0';
-
   ret = rats_tls_cleanup(handle);
   if (ret != RATS_TLS_ERR_NONE) {
     LOG_ERROR("Failed to cleanup %#x", ret);
@@ -274,18 +161,8 @@ int main(int argc, char **argv) {
       crypto_type = optarg;
       break;
     case 'l':
-      if (!strcasecmp(optarg, "debug"))
-        log_level = RATS_TLS_LOG_LEVEL_DEBUG;
-      else if (!strcasecmp(optarg, "info"))
-        log_level = RATS_TLS_LOG_LEVEL_INFO;
-      else if (!strcasecmp(optarg, "warn"))
-        log_level = RATS_TLS_LOG_LEVEL_WARN;
-      else if (!strcasecmp(optarg, "error"))
-        log_level = RATS_TLS_LOG_LEVEL_ERROR;
-      else if (!strcasecmp(optarg, "fatal"))
-        log_level = RATS_TLS_LOG_LEVEL_FATAL;
-      else if (!strcasecmp(optarg, "off"))
-        log_level = RATS_TLS_LOG_LEVEL_NONE;
+      if (log_level_parse(optarg) >= 0)
+        app_log_level = log_level_parse(optarg);
       break;
     case 'i':
       app_id = optarg;
@@ -325,7 +202,7 @@ int main(int argc, char **argv) {
     }
   } while (opt != -1);
 
-  LOG_INFO("Selected log level %d", log_level);
+  LOG_INFO("Selected log level %d", app_log_level);
 
   if (app_id == NULL) {
     LOG_ERROR("App ID is missing");
@@ -386,8 +263,8 @@ int main(int argc, char **argv) {
   }
 
   secret = get_secret_from_sbs_through_rats_tls(
-      log_level, attester_type, verifier_type, tls_type, crypto_type, mutual,
-      ip_buf, port, app_id);
+      (rats_tls_log_level_t)app_log_level, attester_type, verifier_type,
+      tls_type, crypto_type, mutual, ip_buf, port, app_id);
   if (secret == NULL) {
     LOG_ERROR("Get secret from SBS failed");
     return -1;
@@ -395,8 +272,14 @@ int main(int argc, char **argv) {
 
   LOG_INFO("Get secret successful");
 
-  fputs(secret, file);
-  fclose(file);
-  free(secret);
+  TRACE(write_start, strlen(secret));
+  int write_err = fputs(secret, file) < 0;
+  write_err |= fclose(file) != 0;
+  TRACE(write_end, write_err);
+  secure_free(secret);
+  if (write_err) {
+    LOG_ERROR("Failed to write the secret to %s", secret_save_path);
+    return -1;
+  }
   return 0;
 }